@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "globle.h"
+#include "vpcs.h"
+#include "agg.h"
+
+extern int devtype;
+
+static const u_char agg_mac[ETH_ALEN] = {0x01, 0x80, 0xc2, 0x00, 0x00, 0x0f};
+
+#define BUNDLE_HDRLEN	((int)(sizeof(ethdr) + sizeof(aggdr)))
+
+static aggdr *agg_header(const char *buf, int len)
+{
+	ethdr *eh = (ethdr *)buf;
+	aggdr *ah = (aggdr *)(eh + 1);
+	
+	if (len < BUNDLE_HDRLEN || eh->type != htons(ETHERTYPE_VPCS) ||
+	    memcmp(eh->dst, agg_mac, ETH_ALEN) != 0 ||
+	    ah->magic[0] != 'V' || ah->magic[1] != 'A' ||
+	    ah->version != AGG_VERSION)
+		return NULL;
+		
+	return ah;
+}
+
+static void agg_ctl(pcs *pc, int type)
+{
+	struct packet *m;
+	ethdr *eh;
+	aggdr *ah;
+	
+	m = new_pkt(BUNDLE_HDRLEN);
+	if (m == NULL)
+		return;
+	
+	eh = (ethdr *)(m->data);
+	encap_ehead(m->data, pc->ip4.mac, agg_mac, ETHERTYPE_VPCS);
+	ah = (aggdr *)(eh + 1);
+	ah->magic[0] = 'V';
+	ah->magic[1] = 'A';
+	ah->version = AGG_VERSION;
+	ah->type = type;
+	ah->maxsize = htons(AGG_MAXSIZE);
+	
+	enq(&pc->oq, m);
+}
+
+/*
+ * turn the aggregation on or off, the console calls it
+ */
+void agg_enable(pcs *pc, int on, int delay)
+{
+	if (devtype != DEV_UDP)
+		return;
+		
+	pc->agg.delay = delay;
+	if (on) {
+		if (pc->agg.mode == AGG_MODE_OFF)
+			pc->agg.mode = AGG_MODE_PROBE;
+		agg_ctl(pc, AGG_HELLO);
+	} else if (pc->agg.mode != AGG_MODE_OFF) {
+		pc->agg.mode = AGG_MODE_OFF;
+		agg_ctl(pc, AGG_BYE);
+	}
+}
+
+/*
+ * the peer of the tunnel was changed, ask the new one again
+ */
+void agg_reset(pcs *pc)
+{
+	if (pc->agg.mode == AGG_MODE_OFF)
+		return;
+		
+	pc->agg.mode = AGG_MODE_PROBE;
+	agg_ctl(pc, AGG_HELLO);
+}
+
+/*
+ * walk the frames of a bundle, stop if fn returns 0,
+ * return the count of the frames or -1 if the bundle is broken.
+ */
+int agg_unpack(const char *buf, int len, int (*fn)(const char *, int, void *), 
+    void *arg)
+{
+	aggdr *ah;
+	const char *p, *end;
+	u_short flen;
+	int i, n;
+	
+	ah = agg_header(buf, len);
+	if (ah == NULL || ah->type != AGG_BUNDLE)
+		return -1;
+	
+	n = ntohs(ah->count);
+	p = buf + BUNDLE_HDRLEN;
+	end = buf + len;
+	for (i = 0; i < n; i++) {
+		if (p + sizeof(flen) > end)
+			return -1;
+		memcpy(&flen, p, sizeof(flen));
+		flen = ntohs(flen);
+		p += sizeof(flen);
+		if (flen < sizeof(ethdr) || p + flen > end)
+			return -1;
+		if (!fn(p, flen, arg))
+			break;
+		p += flen;
+	}
+	
+	return i;
+}
+
+int agg_isbundle(const char *buf, int len)
+{
+	aggdr *ah = agg_header(buf, len);
+	
+	return (ah != NULL && ah->type == AGG_BUNDLE);
+}
+
+struct unpackarg {
+	struct packet **pkts;
+	struct timeval ts;
+	int n;
+};
+
+static int unpack_one(const char *frame, int len, void *arg)
+{
+	struct unpackarg *ua = arg;
+	struct packet *m;
+	
+	if (ua->n >= AGG_MAXFRAMES)
+		return 0;
+		
+	m = alloc_pkt(len);
+	if (m == NULL)
+		return 0;
+	memcpy(m->data, frame, len);
+	m->ts = ua->ts;
+	ua->pkts[ua->n++] = m;
+	
+	return 1;
+}
+
+/*
+ * called by the reader for every frame from the tunnel.
+ * return -1 if m is a normal frame, otherwise m is consumed and the
+ * frames carried by it (if any) are stored in pkts, AGG_MAXFRAMES at most.
+ */
+int agg_input(pcs *pc, struct packet *m, struct packet **pkts)
+{
+	struct unpackarg ua;
+	aggdr *ah;
+	
+	if (devtype != DEV_UDP)
+		return -1;
+		
+	ah = agg_header(m->data, m->len);
+	if (ah == NULL)
+		return -1;
+	
+	ua.n = 0;
+	switch (ah->type) {
+		case AGG_HELLO:
+			if (pc->agg.mode != AGG_MODE_OFF) {
+				pc->agg.mode = AGG_MODE_ON;
+				agg_ctl(pc, AGG_HELLO_ACK);
+			}
+			break;
+		case AGG_HELLO_ACK:
+			if (pc->agg.mode != AGG_MODE_OFF)
+				pc->agg.mode = AGG_MODE_ON;
+			break;
+		case AGG_BYE:
+			if (pc->agg.mode == AGG_MODE_ON)
+				pc->agg.mode = AGG_MODE_PROBE;
+			break;
+		case AGG_BUNDLE:
+			/* accepted in any mode, the peer may not know yet 
+			   we just turned it off */
+			ua.pkts = pkts;
+			ua.ts = m->ts;
+			agg_unpack(m->data, m->len, unpack_one, &ua);
+			pc->agg.rx_bundles++;
+			break;
+	}
+	del_pkt(m);
+	
+	return ua.n;
+}
+
+/*
+ * the bundle in making, only the writer touches it. A single frame is 
+ * held as it is and goes out unwrapped if nothing follows it in time.
+ */
+static struct packet *close_bundle(pcs *pc)
+{
+	struct packet *m;
+	
+	m = pc->agg.bundle;
+	if (m == NULL)
+		m = pc->agg.first;
+	else
+		pc->agg.tx_bundles++;
+	pc->agg.bundle = NULL;
+	pc->agg.first = NULL;
+	pc->agg.count = 0;
+	
+	return m;
+}
+
+static void append(struct packet *b, struct packet *m)
+{
+	u_short flen = htons(m->len);
+	
+	memcpy(b->data + b->len, &flen, sizeof(flen));
+	memcpy(b->data + b->len + sizeof(flen), m->data, m->len);
+	b->len += sizeof(flen) + m->len;
+}
+
+static int add_frame(pcs *pc, struct packet *m)
+{
+	struct packet *b;
+	aggdr *ah;
+	
+	if (pc->agg.first == NULL) {
+		pc->agg.first = m;
+		pc->agg.count = 1;
+		gettimeofday(&pc->agg.deadline, (void*)0);
+		pc->agg.deadline.tv_usec += pc->agg.delay;
+		if (pc->agg.deadline.tv_usec >= 1000000) {
+			pc->agg.deadline.tv_sec++;
+			pc->agg.deadline.tv_usec -= 1000000;
+		}
+		return 1;
+	}
+	
+	if (pc->agg.bundle == NULL) {
+		b = alloc_pkt(AGG_MAXSIZE);
+		if (b == NULL)
+			return 0;
+		encap_ehead(b->data, pc->ip4.mac, agg_mac, ETHERTYPE_VPCS);
+		ah = (aggdr *)(b->data + sizeof(ethdr));
+		ah->magic[0] = 'V';
+		ah->magic[1] = 'A';
+		ah->version = AGG_VERSION;
+		ah->type = AGG_BUNDLE;
+		ah->maxsize = htons(AGG_MAXSIZE);
+		b->len = BUNDLE_HDRLEN;
+		b->ts = pc->agg.first->ts;
+		append(b, pc->agg.first);
+		del_pkt(pc->agg.first);
+		pc->agg.bundle = b;
+	}
+	
+	append(pc->agg.bundle, m);
+	del_pkt(m);
+	pc->agg.count++;
+	ah = (aggdr *)(pc->agg.bundle->data + sizeof(ethdr));
+	ah->count = htons(pc->agg.count);
+	
+	return 1;
+}
+
+static int room(pcs *pc)
+{
+	if (pc->agg.first == NULL)
+		return AGG_MAXSIZE - BUNDLE_HDRLEN;
+	if (pc->agg.count >= AGG_MAXFRAMES)
+		return 0;
+	if (pc->agg.bundle == NULL)
+		return AGG_MAXSIZE - BUNDLE_HDRLEN - 2 - pc->agg.first->len;
+	
+	return AGG_MAXSIZE - pc->agg.bundle->len;
+}
+
+/*
+ * pack the frames going to the tunnel, the frames in pkts are consumed.
+ * return the count of the datagrams ready to send in out, which has 
+ * room for n + 1 of them. The last bundle may be kept back until it is
+ * full or its deadline passes, see agg_timeout and agg_flush.
+ */
+int agg_output(pcs *pc, struct packet **pkts, int n, struct packet **out)
+{
+	struct packet *m, *m0;
+	int i, k;
+	
+	k = 0;
+	if (pc->agg.mode != AGG_MODE_ON) {
+		if ((m = close_bundle(pc)) != NULL)
+			out[k++] = m;
+		for (i = 0; i < n; i++)
+			out[k++] = pkts[i];
+		return k;
+	}
+	
+	for (i = 0; i < n; i++) {
+		m = pkts[i];
+		if ((int)(m->len + sizeof(u_short)) > room(pc)) {
+			if ((m0 = close_bundle(pc)) != NULL)
+				out[k++] = m0;
+		}
+		if ((int)(m->len + sizeof(u_short)) > room(pc) || !add_frame(pc, m)) {
+			/* too big, send it as it is */
+			out[k++] = m;
+			continue;
+		}
+		if (room(pc) < (int)(sizeof(ethdr) + sizeof(u_short)))
+			out[k++] = close_bundle(pc);
+	}
+	
+	if (pc->agg.delay == 0 && (m = close_bundle(pc)) != NULL)
+		out[k++] = m;
+	
+	return k;
+}
+
+/*
+ * the usecs before the pending bundle must go, -1 if nothing is pending.
+ */
+int agg_timeout(pcs *pc)
+{
+	struct timeval now;
+	long usec;
+	
+	if (pc->agg.first == NULL)
+		return -1;
+		
+	gettimeofday(&now, (void*)0);
+	usec = (pc->agg.deadline.tv_sec - now.tv_sec) * 1000000L + 
+	    (pc->agg.deadline.tv_usec - now.tv_usec);
+	
+	return (usec > 0) ? usec : 0;
+}
+
+struct packet *agg_flush(pcs *pc)
+{
+	return close_bundle(pc);
+}
+
+/* end of file */
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#ifndef _AGG_H_
+#define _AGG_H_
+
+#include <sys/types.h>
+#include "vpcs.h"
+
+/*
+ * frame aggregation on the udp tunnel
+ *
+ * Both ends must be VPCS (directly or through the VPCS relay). The ends 
+ * exchange a hello, only then several frames are packed in one datagram.
+ * A control message or a bundle looks like an ethernet frame sent to 
+ * the bridge reserved group address, so a peer which knows nothing about
+ * it, dynamips for example, drops it.
+ *
+ *   ethdr     dst 01:80:c2:00:00:0f, src sender, type ETHERTYPE_VPCS
+ *   aggdr     magic, version, type, count
+ *   count x { u_short len, frame }       (AGG_BUNDLE only)
+ */
+#define ETHERTYPE_VPCS	0x88B5	/* IEEE local experimental */
+
+typedef struct {
+	u_char magic[2];	/* 'V' 'A' */
+	u_char version;
+	u_char type;
+#define AGG_HELLO	1
+#define AGG_HELLO_ACK	2
+#define AGG_BYE		3
+#define AGG_BUNDLE	4
+	u_short count;		/* frames in the bundle */
+	u_short maxsize;	/* hello: the largest bundle it accepts */
+} __attribute__ ((packed)) aggdr;
+
+#define AGG_VERSION	1
+#define AGG_MAXSIZE	1472	/* keep the datagram in one underlay frame */
+#define AGG_MAXFRAMES	((AGG_MAXSIZE - 14 - (int)sizeof(aggdr)) / 16)
+#define AGG_DELAY	20	/* usec, default flush deadline */
+
+void agg_enable(pcs *pc, int on, int delay);
+void agg_reset(pcs *pc);
+int agg_input(pcs *pc, struct packet *m, struct packet **pkts);
+int agg_output(pcs *pc, struct packet **pkts, int n, struct packet **out);
+struct packet *agg_flush(pcs *pc);
+int agg_timeout(pcs *pc);
+int agg_isbundle(const char *buf, int len);
+int agg_unpack(const char *buf, int len, int (*fn)(const char *, int, void *), 
+    void *arg);
+
+#endif
+/* end of file */
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "vpcs.h"
+#include "packets.h"
+#include "arp.h"
+#include "timer.h"
+
+extern u_char broadcast[ETH_ALEN];
+
+static void arp_timer(void *arg);
+
+static u_int arp_hash(u_int ip)
+{
+	ip = ntohl(ip);
+	
+	return (ip ^ (ip >> 6) ^ (ip >> 12)) & (ARP_HASHSIZE - 1);
+}
+
+static struct packet *arp_request(pcs *pc, u_int dip)
+{
+	ethdr *eh;
+	vpcs_arphdr *ah;
+	struct packet *m;
+	u_int *si, *di;
+	
+	m = new_pkt(ARP_PSIZE);
+	if (m == NULL)
+		return NULL;
+
+	eh = (ethdr *)(m->data);
+	ah = (vpcs_arphdr *)(eh + 1);
+
+	ah->hrd = htons(ARPHRD_ETHER);
+	ah->pro = htons(ETHERTYPE_IP);
+	ah->hln = 6;
+	ah->pln = 4;
+	ah->op = htons(ARPOP_REQUEST);
+	
+	si = (u_int *)ah->sip;
+	di = (u_int *)ah->dip;
+	si[0] = pc->ip4.ip;
+	di[0] = dip;
+
+	memcpy(ah->dea, broadcast, ETH_ALEN);
+	memcpy(ah->sea, pc->ip4.mac, ETH_ALEN);
+	
+	encap_ehead(m->data, pc->ip4.mac, broadcast, ETHERTYPE_ARP);
+	
+	return m;
+}
+
+static void arp_send(pcs *pc, u_int ip)
+{
+	struct packet *m;
+	
+	m = arp_request(pc, ip);
+	if (m != NULL)
+		enq(&pc->oq, m);
+}
+
+/* drop the packets held by the entry */
+static void arp_drop(arpcache *ac, ipmac *e)
+{
+	struct packet *m;
+	
+	while ((m = e->pending) != NULL) {
+		e->pending = m->next;
+		m->next = NULL;
+		del_pkt(m);
+	}
+	e->ptail = NULL;
+	ac->npending -= e->npending;
+	e->npending = 0;
+}
+
+static ipmac *arp_find(arpcache *ac, u_int ip)
+{
+	int i;
+	
+	for (i = ac->hash[arp_hash(ip)]; i; i = ac->ent[i - 1].next) {
+		if (ac->ent[i - 1].ip == ip)
+			return &ac->ent[i - 1];
+	}
+	return NULL;
+}
+
+static void arp_remove(arpcache *ac, ipmac *e)
+{
+	int *pi;
+	int i = e - ac->ent + 1;
+	
+	for (pi = &ac->hash[arp_hash(e->ip)]; *pi; pi = &ac->ent[*pi - 1].next) {
+		if (*pi == i) {
+			*pi = e->next;
+			break;
+		}
+	}
+	arp_drop(ac, e);
+	memset(e, 0, sizeof(ipmac));
+	e->next = ac->free;
+	ac->free = i;
+}
+
+/* 
+ * a REACHABLE entry becomes STALE after POOL_TIMEOUT, an entry which 
+ * does not answer is removed, return NULL if so.
+ */
+static ipmac *arp_update(arpcache *ac, ipmac *e)
+{
+	if (e->state == ARP_REACHABLE && time_tick - e->timeout > POOL_TIMEOUT) {
+		e->state = ARP_STALE;
+		e->tries = 0;
+	}
+	if (e->state != ARP_REACHABLE && e->tries >= ARP_MAXTRIES && 
+	    time_tick - e->sent > ARP_RETRANS) {
+		arp_remove(ac, e);
+		return NULL;
+	}
+	return e;
+}
+
+static ipmac *arp_new(arpcache *ac, u_int ip)
+{
+	ipmac *e, *old;
+	int i, h;
+	
+	if (ac->free == 0) {
+		/* reuse the oldest entry, the resolving ones at last */
+		old = NULL;
+		for (i = 0; i < ARP_CACHE_SIZE; i++) {
+			e = &ac->ent[i];
+			if (old == NULL || 
+			    (old->state == ARP_INCOMPLETE && 
+			    e->state != ARP_INCOMPLETE) ||
+			    ((old->state == ARP_INCOMPLETE) == 
+			    (e->state == ARP_INCOMPLETE) && 
+			    e->timeout - old->timeout < 0))
+				old = e;
+		}
+		arp_remove(ac, old);
+	}
+	
+	i = ac->free;
+	e = &ac->ent[i - 1];
+	ac->free = e->next;
+	
+	h = arp_hash(ip);
+	e->ip = ip;
+	e->next = ac->hash[h];
+	ac->hash[h] = i;
+	
+	return e;
+}
+
+void arp_init(pcs *pc)
+{
+	arpcache *ac = &pc->arp4;
+	int i;
+	
+	memset(ac->ent, 0, sizeof(ac->ent));
+	memset(ac->hash, 0, sizeof(ac->hash));
+	for (i = 0; i < ARP_CACHE_SIZE; i++)
+		ac->ent[i].next = (i + 1 < ARP_CACHE_SIZE) ? i + 2 : 0;
+	ac->free = 1;
+	ac->npending = 0;
+	pthread_mutex_init(&ac->locker, NULL);
+	pthread_cond_init(&ac->cond, NULL);
+	timer_set(&ac->timer, arp_timer, pc);
+}
+
+void arp_flush(pcs *pc)
+{
+	arpcache *ac = &pc->arp4;
+	int i;
+	
+	pthread_mutex_lock(&ac->locker);
+	for (i = 0; i < ARP_CACHE_SIZE; i++) {
+		arp_drop(ac, &ac->ent[i]);
+		memset(&ac->ent[i], 0, sizeof(ipmac));
+		ac->ent[i].next = (i + 1 < ARP_CACHE_SIZE) ? i + 2 : 0;
+	}
+	memset(ac->hash, 0, sizeof(ac->hash));
+	ac->free = 1;
+	pthread_mutex_unlock(&ac->locker);
+}
+
+/*
+ * look up the address, start or refresh the resolution when it is time to.
+ * return 1 and the mac if the entry is usable, otherwise the packet m, if 
+ * any, is held by the entry or dropped.
+ * force: send a request even though the last one is recent.
+ */
+static int arp_lookup(pcs *pc, u_int ip, u_char *mac, struct packet *m, 
+    int force)
+{
+	arpcache *ac = &pc->arp4;
+	ipmac *e;
+	int ok = 0, req = 0;
+	
+	pthread_mutex_lock(&ac->locker);
+	
+	e = arp_find(ac, ip);
+	if (e != NULL)
+		e = arp_update(ac, e);
+	if (e == NULL) {
+		e = arp_new(ac, ip);
+		e->state = ARP_INCOMPLETE;
+	}
+	
+	if (e->state == ARP_REACHABLE || e->state == ARP_STALE) {
+		memcpy(mac, e->mac, ETH_ALEN);
+		ok = 1;
+	} else if (m != NULL) {
+		if (e->npending >= ARP_MAXPENDING) {
+			struct packet *p = e->pending;
+			
+			e->pending = p->next;
+			p->next = NULL;
+			del_pkt(p);
+			e->npending--;
+			ac->npending--;
+		}
+		m->next = NULL;
+		if (e->ptail)
+			e->ptail->next = m;
+		else
+			e->pending = m;
+		e->ptail = m;
+		e->npending++;
+		ac->npending++;
+	}
+	
+	if (e->state != ARP_REACHABLE && (force || e->tries == 0 || 
+	    (e->tries < ARP_MAXTRIES && time_tick - e->sent >= ARP_RETRANS))) {
+		e->tries++;
+		e->sent = time_tick;
+		req = 1;
+		if (e->state == ARP_INCOMPLETE && !timer_pending(&ac->timer))
+			timer_add(&ac->timer, ARP_RETRANS * 1000);
+	}
+	
+	pthread_mutex_unlock(&ac->locker);
+	
+	if (req)
+		arp_send(pc, ip);
+	
+	return ok;
+}
+
+/*
+ * fill the destination of the packet for the next hop ip,
+ * return 1 if it can be sent, 0 if the packet is held till the answer.
+ */
+int arp_output(pcs *pc, u_int ip, struct packet *m)
+{
+	ethdr *eh = (ethdr *)(m->data);
+	
+	return arp_lookup(pc, ip, eh->dst, m, 0);
+}
+
+/*
+ * the address is confirmed by the ARP packet, 
+ * send the packets waiting for it.
+ */
+void arp_input(pcs *pc, u_int ip, u_char *mac)
+{
+	arpcache *ac = &pc->arp4;
+	struct packet *m, *p;
+	ipmac *e;
+	
+	if (!sameNet(ip, pc->ip4.ip, pc->ip4.cidr))
+		return;
+	
+	pthread_mutex_lock(&ac->locker);
+	
+	e = arp_find(ac, ip);
+	if (e == NULL)
+		e = arp_new(ac, ip);
+	memcpy(e->mac, mac, ETH_ALEN);
+	e->state = ARP_REACHABLE;
+	e->timeout = time_tick;
+	e->tries = 0;
+	
+	m = e->pending;
+	e->pending = e->ptail = NULL;
+	ac->npending -= e->npending;
+	e->npending = 0;
+	
+	pthread_cond_broadcast(&ac->cond);
+	pthread_mutex_unlock(&ac->locker);
+	
+	while (m != NULL) {
+		p = m->next;
+		m->next = NULL;
+		memcpy(((ethdr *)(m->data))->dst, mac, ETH_ALEN);
+		if (pc->ip4.flags & IPF_FRAG)
+			m = ipfrag(m, pc->mtu);
+		enq(&pc->oq, m);
+		m = p;
+	}
+}
+
+/*
+ * retransmit the requests of the entries holding packets, 
+ * drop the ones without answer.
+ */
+static void arp_timer(void *arg)
+{
+	pcs *pc = arg;
+	arpcache *ac = &pc->arp4;
+	u_int ips[ARP_CACHE_SIZE];
+	ipmac *e;
+	int i, n = 0, busy = 0;
+	
+	pthread_mutex_lock(&ac->locker);
+	for (i = 0; i < ARP_CACHE_SIZE; i++) {
+		e = &ac->ent[i];
+		if (e->state != ARP_INCOMPLETE)
+			continue;
+		if (arp_update(ac, e) == NULL)
+			continue;
+		if (e->npending > 0 && e->tries < ARP_MAXTRIES &&
+		    time_tick - e->sent >= ARP_RETRANS) {
+			e->tries++;
+			e->sent = time_tick;
+			ips[n++] = e->ip;
+		}
+		busy = 1;
+	}
+	if (busy)
+		timer_add(&ac->timer, ARP_RETRANS * 1000);
+	pthread_mutex_unlock(&ac->locker);
+	
+	for (i = 0; i < n; i++)
+		arp_send(pc, ips[i]);
+}
+
+/*
+ * get the mac address for the application, wait for 3 seconds at most
+ */
+int arpResolve(pcs *pc, u_int ip, u_char *dmac)
+{
+	arpcache *ac = &pc->arp4;
+	struct timeval now;
+	struct timespec ts;
+	ipmac *e;
+	int c, rc;
+	
+	for (c = 0; c < ARP_MAXTRIES; c++) {
+		if (arp_lookup(pc, ip, dmac, NULL, c > 0))
+			return 1;
+		
+		gettimeofday(&now, NULL);
+		ts.tv_sec = now.tv_sec + 1;
+		ts.tv_nsec = now.tv_usec * 1000;
+		
+		pthread_mutex_lock(&ac->locker);
+		do {
+			e = arp_find(ac, ip);
+			if (e != NULL && e->state != ARP_INCOMPLETE) {
+				memcpy(dmac, e->mac, ETH_ALEN);
+				pthread_mutex_unlock(&ac->locker);
+				return 1;
+			}
+			rc = pthread_cond_timedwait(&ac->cond, &ac->locker, &ts);
+		} while (rc != ETIMEDOUT);
+		pthread_mutex_unlock(&ac->locker);
+	}
+	return 0;
+}
+
+/* end of file */
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#ifndef _ARP_H_
+#define _ARP_H_
+
+#include <sys/types.h>
+#include "vpcs.h"
+
+/*
+ * ipv4 neighbor cache
+ *
+ * The entries are hashed by address. An unresolved entry (INCOMPLETE) holds
+ * the outgoing packets until the ARP reply arrives in upv4, so the sender 
+ * never waits. A REACHABLE entry turns STALE after POOL_TIMEOUT seconds, it
+ * is still used, but the next use sends a request to refresh it. An entry 
+ * without answer after ARP_MAXTRIES requests is removed. The requests are
+ * retransmitted by the timer of the cache.
+ */
+#define ARP_MAXTRIES	3
+#define ARP_RETRANS	1	/* seconds between the requests */
+#define ARP_MAXPENDING	16	/* packets held by an entry */
+
+void arp_init(pcs *pc);
+void arp_flush(pcs *pc);
+int arp_output(pcs *pc, u_int ip, struct packet *m);
+void arp_input(pcs *pc, u_int ip, u_char *mac);
+int arpResolve(pcs *pc, u_int ip, u_char *dmac);
+
+#endif
+
+/* end of file */
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "cksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CKSUM_X86
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+typedef u_int (*cksum_fn)(const u_char *, int, u_int);
+
+static inline u_int fold64(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	
+	return (u_int)sum;
+}
+
+/* the former cksum(), one word a time, the reference of the benchmark */
+static u_int sum_ref(const u_char *buf, int len, u_int sum0)
+{
+	const u_short *w = (const u_short *)buf;
+	unsigned long sum = sum0;
+	
+	while (len > 1) {
+		sum += *w++;
+		len -= 2;
+	}
+	if (len)
+		sum += *(const u_char *)w;
+	
+	return fold64(sum);
+}
+
+/* 
+ * 32-bit loads into a 64-bit accumulator, 
+ * the carries are kept in the high half.
+ */
+static u_int sum_64(const u_char *buf, int len, u_int sum0)
+{
+	uint64_t sum = sum0, s1 = 0;
+	uint32_t a, b, c, d;
+	u_short w = 0;
+	
+	while (len >= 32) {
+		memcpy(&a, buf, 4); memcpy(&b, buf + 4, 4);
+		memcpy(&c, buf + 8, 4); memcpy(&d, buf + 12, 4);
+		sum += (uint64_t)a + b;
+		s1 += (uint64_t)c + d;
+		memcpy(&a, buf + 16, 4); memcpy(&b, buf + 20, 4);
+		memcpy(&c, buf + 24, 4); memcpy(&d, buf + 28, 4);
+		sum += (uint64_t)a + b;
+		s1 += (uint64_t)c + d;
+		buf += 32;
+		len -= 32;
+	}
+	sum += s1;
+	while (len >= 4) {
+		memcpy(&a, buf, 4);
+		sum += a;
+		buf += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&w, buf, 2);
+		sum += w;
+		buf += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* pad the odd octet with zero */
+		w = 0;
+		memcpy(&w, buf, 1);
+		sum += w;
+	}
+	
+	return fold64(sum);
+}
+
+#ifdef CKSUM_X86
+/*
+ * the low and high words of each 32-bit lane are added in the lane, the
+ * lanes are reduced every VMAX vectors, long before they may overflow.
+ * The short buffers do not pay for the reduction, the scalar one is faster.
+ */
+#define VMAX	8192
+#define VMIN	256
+
+__attribute__((target("sse2")))
+static u_int sum_sse2(const u_char *buf, int len, u_int sum0)
+{
+	uint64_t sum = sum0;
+	__m128i mask = _mm_set1_epi32(0xffff);
+	__m128i acc, acc1, v, v1;
+	uint32_t lane[4];
+	int n;
+	
+	if (len < VMIN)
+		return sum_64(buf, len, sum0);
+	
+	while (len >= 32) {
+		acc = acc1 = _mm_setzero_si128();
+		for (n = 0; n < VMAX && len >= 32; n += 2) {
+			v = _mm_loadu_si128((const __m128i *)buf);
+			v1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+			acc = _mm_add_epi32(acc, _mm_and_si128(v, mask));
+			acc1 = _mm_add_epi32(acc1, _mm_srli_epi32(v, 16));
+			acc = _mm_add_epi32(acc, _mm_and_si128(v1, mask));
+			acc1 = _mm_add_epi32(acc1, _mm_srli_epi32(v1, 16));
+			buf += 32;
+			len -= 32;
+		}
+		_mm_storeu_si128((__m128i *)lane, acc);
+		sum += (uint64_t)lane[0] + lane[1] + lane[2] + lane[3];
+		_mm_storeu_si128((__m128i *)lane, acc1);
+		sum += (uint64_t)lane[0] + lane[1] + lane[2] + lane[3];
+	}
+	
+	return sum_64(buf, len, fold64(sum));
+}
+
+__attribute__((target("avx2")))
+static u_int sum_avx2(const u_char *buf, int len, u_int sum0)
+{
+	uint64_t sum = sum0;
+	__m256i mask = _mm256_set1_epi32(0xffff);
+	__m256i acc, acc1, v, v1;
+	__m128i h;
+	uint32_t lane[4];
+	int n;
+	
+	if (len < VMIN)
+		return sum_64(buf, len, sum0);
+	
+	while (len >= 64) {
+		acc = acc1 = _mm256_setzero_si256();
+		for (n = 0; n < VMAX && len >= 64; n += 2) {
+			v = _mm256_loadu_si256((const __m256i *)buf);
+			v1 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+			acc = _mm256_add_epi32(acc, _mm256_and_si256(v, mask));
+			acc1 = _mm256_add_epi32(acc1, _mm256_srli_epi32(v, 16));
+			acc = _mm256_add_epi32(acc, _mm256_and_si256(v1, mask));
+			acc1 = _mm256_add_epi32(acc1, _mm256_srli_epi32(v1, 16));
+			buf += 64;
+			len -= 64;
+		}
+		/* fold the 2 accumulators and the 2 halves into 4 lanes */
+		acc = _mm256_add_epi32(acc, acc1);
+		h = _mm_add_epi32(_mm256_castsi256_si128(acc), 
+		    _mm256_extracti128_si256(acc, 1));
+		_mm_storeu_si128((__m128i *)lane, h);
+		sum += (uint64_t)lane[0] + lane[1] + lane[2] + lane[3];
+	}
+	
+	return sum_64(buf, len, fold64(sum));
+}
+#endif
+
+static struct {
+	const char *name;
+	cksum_fn fn;
+} kernels[] = {
+	{"reference", sum_ref},
+	{"64-bit", sum_64},
+#ifdef CKSUM_X86
+	{"sse2", sum_sse2},
+	{"avx2", sum_avx2},
+#endif
+	{NULL, NULL}
+};
+
+static cksum_fn kernel = sum_64;
+static const char *kernel_name = "64-bit";
+
+static int kernel_usable(const char *name)
+{
+#ifdef CKSUM_X86
+	__builtin_cpu_init();
+	if (!strcmp(name, "sse2"))
+		return __builtin_cpu_supports("sse2");
+	if (!strcmp(name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+void cksum_init(void)
+{
+	int i;
+	
+	/* the last usable one is the fastest */
+	for (i = 1; kernels[i].name != NULL; i++) {
+		if (kernel_usable(kernels[i].name)) {
+			kernel = kernels[i].fn;
+			kernel_name = kernels[i].name;
+		}
+	}
+}
+
+const char *cksum_kernel(void)
+{
+	return kernel_name;
+}
+
+u_int cksum_add(const void *buf, int len, u_int sum)
+{
+	return kernel((const u_char *)buf, len, sum);
+}
+
+/* copy the buffer and sum it while it is in the cache */
+u_int cksum_copy(void *dst, const void *src, int len, u_int sum)
+{
+	memcpy(dst, src, len);
+	
+	return kernel((const u_char *)dst, len, sum);
+}
+
+u_short cksum_fold(u_int sum)
+{
+	return (u_short)~fold64(sum);
+}
+
+static uint64_t bench_clock(void)
+{
+#ifdef CKSUM_X86
+	return __rdtsc();
+#else
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * sum a buffer of len octets with every usable kernel, 
+ * print the throughput against the reference.
+ */
+void cksum_bench(int len)
+{
+	u_char *buf;
+	uint64_t t0, t1, best;
+	u_int sum, ref = 0;
+	double rate, rate0 = 0;
+	int i, j, k, rounds;
+	
+	buf = malloc(len + 1);
+	if (buf == NULL) {
+		printf("out of memory\n");
+		return;
+	}
+	for (i = 0; i <= len; i++)
+		buf[i] = rand();
+	
+	rounds = 4 * 1024 * 1024 / len + 1;
+#ifdef CKSUM_X86
+	printf("%d bytes, %d rounds, TSC cycles\n", len, rounds);
+#else
+	printf("%d bytes, %d rounds, nanoseconds\n", len, rounds);
+#endif
+	for (i = 0; kernels[i].name != NULL; i++) {
+		if (!kernel_usable(kernels[i].name))
+			continue;
+		best = 0;
+		sum = 0;
+		for (k = 0; k < 5; k++) {
+			t0 = bench_clock();
+			/* odd offset, the frames are seldom aligned */
+			for (j = 0; j < rounds; j++)
+				sum += kernels[i].fn(buf + 1, len, 0);
+			t1 = bench_clock();
+			if (best == 0 || t1 - t0 < best)
+				best = t1 - t0;
+		}
+		if (i == 0)
+			ref = sum;
+		rate = (double)len * rounds / (best ? best : 1);
+		if (i == 0)
+			rate0 = rate;
+		printf("  %-10s %6.2f bytes/%s  x%-5.2f %s%s\n", kernels[i].name, 
+		    rate,
+#ifdef CKSUM_X86
+		    "cycle",
+#else
+		    "ns",
+#endif
+		    rate / rate0, sum == ref ? "ok" : "MISMATCH",
+		    kernels[i].fn == kernel ? "  (in use)" : "");
+	}
+	free(buf);
+}
+
+/* end of file */
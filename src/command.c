@@ -45,19 +45,22 @@
 #include "queue.h"
 #include "dhcp.h"
 #include "tcp.h"
+#include "cksum.h"
 #include "dns.h"
 #include "remote.h"
 #include "readline.h"
 #include "help.h"
 #include "dump.h"
+#include "filter.h"
 #include "relay.h"
 #include "httpd.h"
+#include "agg.h"
+#include "ring.h"
 
 extern int pcid;
 extern int devtype;
 extern int ctrl_c;
 extern int ctrl_z;
-extern u_int time_tick;
 extern u_long ip_masks[33];
 extern struct echoctl echoctl;
 //int canEcho;
@@ -76,6 +79,8 @@ static int set_dump(int argc, char **argv);
 static int show_dump(int argc, char **argv);
 static int show_ip(int argc, char **argv);
 static int show_echo(int argc, char **argv);
+static int show_pool(int argc, char **argv);
+static int show_capture(int argc, char **argv);
 static int show_arp(int argc, char **argv);
 
 static int run_dhcp_new(int renew, int dump);
@@ -119,6 +124,12 @@ int run_show(int argc, char **argv)
 		if (!strncmp("echo", argv[1], strlen(argv[1])))
 			return show_echo(argc, argv);
 
+		if (!strncmp("pool", argv[1], strlen(argv[1])))
+			return show_pool(argc, argv);
+
+		if (!strncmp("capture", argv[1], strlen(argv[1])))
+			return show_capture(argc, argv);
+
 		if (!strncmp("version", argv[1], strlen(argv[1])))
 			return run_ver(0, NULL);
 
@@ -132,6 +143,7 @@ int run_show(int argc, char **argv)
 	printf("\n");
 	switch(devtype) {
 		case DEV_TAP:
+		case DEV_PACKET:
 			j = sprintf(buf, "NAME");
 			buf[j] = ' ';
 			j = sprintf(buf + 7, "IP/MASK");
@@ -513,6 +525,7 @@ redirect:
 			traveltime = 0.6 * usec / 1000;
 			/* send data after 1.5 * time2travel */
 			delay_ms(traveltime);
+			pc->mscb.data = NULL; /* the pattern */
 			gettimeofday(&(ts), (void*)0);
 			k = tcp_send(pc, 4);
 			if (k == 0) {
@@ -680,7 +693,7 @@ static int run_dhcp_new(int renew, int dump)
 					fflush(stdout);
 				}
 			}
-			free(p);
+			del_pkt(p);
 		}
 
 		i++;
@@ -717,7 +730,7 @@ static int run_dhcp_new(int renew, int dump)
 					fflush(stdout);
 				}
 			}
-			free(p);
+			del_pkt(p);
 		}
 
 		i++;
@@ -732,7 +745,7 @@ static int run_dhcp_new(int renew, int dump)
 		in.s_addr = pc->ip4.ip;
 		PRINT_MAC(mac);
 		printf(" use my ip %s\n",  inet_ntoa(in));
-		memset(pc->ipmac4, 0, sizeof(pc->ipmac4));
+		arp_flush(pc);
 		/* clear ip address */
 		pc->ip4.ip = 0;
 		pc->ip4.cidr = 0;
@@ -755,6 +768,7 @@ static int run_dhcp_new(int renew, int dump)
 	if (pc->ip4.dhcp.rebind == 0)
 		pc->ip4.dhcp.rebind = pc->ip4.dhcp.lease * 7 / 8;
 	pc->ip4.dhcp.timetick = time_tick;
+	dhcp_schedule(pc);
 
 	return 1;
 }
@@ -993,7 +1007,7 @@ int run_ipconfig(int argc, char **argv)
 		printf("%s is being used by MAC ",  inet_ntoa(in));
 		PRINT_MAC(mac);
 		printf("\nAddress not changed\n");
-		memset(pc->ipmac4, 0, sizeof(pc->ipmac4));
+		arp_flush(pc);
 		/* clear ip address */
 		pc->ip4.ip = 0;
 		pc->ip4.cidr = 0;
@@ -1309,7 +1323,7 @@ redirect:
 int run_set(int argc, char **argv)
 {
 	int value;
-	int fd;
+	int fd, ofd;
 	pcs *pc = &vpc[pcid];
 	u_int ip;
 
@@ -1338,6 +1352,21 @@ int run_set(int argc, char **argv)
 		return 1;
 	}
 
+	if (!strncmp("reassembly", argv[1], strlen(argv[1])) && 
+	    strlen(argv[1]) > 1) {
+		if (argc != 3 || !digitstring(argv[2])) {
+		    	argc = 3;
+		    	argv[2] = "?";
+			return help_set(argc, argv);
+		}
+		value = atoi(argv[2]);
+		if (value < 128 || value > 65536) {
+			printf("Invalid budget, should be 128 to 65536 KB\n");
+		} else
+			reass_budget(&pc->reass, value);
+		return 1;
+	}
+
 	if (!strncmp("lport", argv[1], strlen(argv[1]))) {
 		if (argc != 3) {
 			printf("Incomplete command.\n");
@@ -1353,9 +1382,14 @@ int run_set(int argc, char **argv)
 				printf("Device(%d) open error [%s]\n", pcid, strerror(errno));
 				return 0;
 			}
-			close(pc->fd);
+			/* switch first, the reader picks up the new 
+			   socket once the old one is shut down */
+			ofd = pc->fd;
 			pc->fd = fd;
 			pc->lport = value;
+			connect_udp(pc);
+			close_dev(ofd);
+			agg_reset(pc);
 		}
 	} else if (!strncmp("rport", argv[1], strlen(argv[1]))) {
 		if (argc != 3) {
@@ -1365,8 +1399,11 @@ int run_set(int argc, char **argv)
 		value = atoi(argv[2]);
 		if (value < 1024 || value > 65000) {
 			printf("Invalid port. 1024 > port < 65000.\n");
-		} else
+		} else {
 			pc->rport = value;
+			connect_udp(pc);
+			agg_reset(pc);
+		}
 	} else if (!strncmp("rhost", argv[1], strlen(argv[1]))) {
 		if (argc != 3) {
 			printf("Incomplete command.\n");
@@ -1378,6 +1415,27 @@ int run_set(int argc, char **argv)
 			return 0;
 		}
 		pc->rhost = ip;
+		connect_udp(pc);
+		agg_reset(pc);
+	} else if (!strncmp("aggregate", argv[1], strlen(argv[1]))) {
+		if (devtype != DEV_UDP) {
+			printf("Only for the UDP mode\n");
+			return 1;
+		}
+		if (argc == 3 && !strcasecmp(argv[2], "off")) {
+			agg_enable(pc, 0, pc->agg.delay);
+		} else if ((argc == 3 || argc == 4) && 
+		    !strcasecmp(argv[2], "on")) {
+			value = (argc == 4) ? atoi(argv[3]) : AGG_DELAY;
+			if (value < 0 || value > 1000000) {
+				printf("Invalid delay, 0 to 1000000 microseconds\n");
+				return 1;
+			}
+			agg_enable(pc, 1, value);
+		} else {
+			printf("Incomplete command.\n");
+			return 1;
+		}
 	} else if (!strncmp("pcname", argv[1], strlen(argv[1]))) {
 		if (argc != 3) {
 			printf("Incomplete command.\n");
@@ -1484,9 +1542,12 @@ int run_clear(int argc, char **argv)
 		memset(&vpc[pcid].ip6, 0, sizeof(vpc[pcid].ip6));
 		printf("IPv6 address/mask and router link-layer address cleared\n");
 	} else if (!strncmp("arp", argv[1], strlen(argv[1])))
-		memset(&vpc[pcid].ipmac4, 0, sizeof(vpc[pcid].ipmac4));
-	else if (!strncmp("neighbor", argv[1], strlen(argv[1])))
+		arp_flush(&vpc[pcid]);
+	else if (!strncmp("neighbor", argv[1], strlen(argv[1]))) {
+		pthread_mutex_lock(&vpc[pcid].locker6);
 		memset(&vpc[pcid].ipmac6, 0, sizeof(vpc[pcid].ipmac6));
+		pthread_mutex_unlock(&vpc[pcid].locker6);
+	}
 	else if (!strncmp("hist", argv[1], strlen(argv[1])))
 		clear_hist();
 	else
@@ -1538,13 +1599,39 @@ int run_remote(int argc, char **argv)
 	return help_rlogin(argc, argv);
 }
 
+/* replace the dump filter, free the old one once the reader/writer left */
+static int set_dumpfilter(pcs *pc, int argc, char **argv)
+{
+	struct dmpfilter *flt = NULL, *old;
+	char err[128];
+	
+	if (argc > 0) {
+		flt = filter_compile(argc, argv, err, sizeof(err));
+		if (flt == NULL) {
+			printf("Invalid filter: %s\n", err);
+			return -1;
+		}
+	}
+	old = pc->dmpfilter;
+	pc->dmpfilter = flt;
+	if (old) {
+		dump_quiesce(pc);
+		filter_free(old);
+	}
+	
+	return 0;
+}
+
 static int set_dump(int argc, char **argv)
 {
 	int ok = 1;
 	int i = 2;
 	pcs *pc = &vpc[pcid];
+	struct dmpfile *df;
 
 	int dmpflag = 0;
+	int dmpfile = 0, nsec = 0, off = 0;
+	int maxsize = -1, maxtime = -1;
 
 	if (argc == 2)
 		ok = 0;
@@ -1558,21 +1645,35 @@ static int set_dump(int argc, char **argv)
 			dmpflag |= DMP_DETAIL;
 		else if (!strncmp(argv[i], "all", strlen(argv[i])))
 			dmpflag |= DMP_ALL;
-		else if (!strncmp(argv[i], "file", strlen(argv[i]))) {
-			if (pc->dmpfile == NULL) {
-				char tfname[1024];
-				sprintf(tfname, "vpcs%d", pc->id + 1);
-				pc->dmpfile = open_dmpfile(tfname);
-			}
-			dmpflag |= DMP_FILE;
+		else if (!strncmp(argv[i], "file", strlen(argv[i])))
+			dmpfile = 1;
+		else if (!strncmp(argv[i], "nsec", strlen(argv[i])))
+			nsec = 1;
+		else if (!strncmp(argv[i], "size", strlen(argv[i])) && 
+		    i + 1 < argc && digitstring(argv[i + 1]))
+			maxsize = atoi(argv[++i]);
+		else if (!strncmp(argv[i], "time", strlen(argv[i])) && 
+		    i + 1 < argc && digitstring(argv[i + 1]))
+			maxtime = atoi(argv[++i]);
+		else if (!strncmp(argv[i], "filter", strlen(argv[i]))) {
+			/* the rest is the expression, none to clear it */
+			if (set_dumpfilter(pc, argc - i - 1, argv + i + 1) < 0)
+				ok = 0;
+			break;
 		} else if (!strncmp(argv[i], "off", strlen(argv[i]))) {
 			dmpflag = 0;
-			/* give pthread reader/writer a little time */
-			usleep(1000);
-			if (pc->dmpfile) {
-				close_dmpfile(pc->dmpfile);
-				pc->dmpfile = NULL;
+			dmpfile = 0;
+			off = 1;
+			/* stop the reader/writer first, wait for them 
+			   to leave the file */
+			df = pc->dmpfile;
+			pc->dmpflag = 0;
+			pc->dmpfile = NULL;
+			if (df) {
+				dump_quiesce(pc);
+				close_dmpfile(df);
 			}
+			set_dumpfilter(pc, 0, NULL);
 		} else {
 			printf("Invalid options\n");
 			ok = 0;
@@ -1580,9 +1681,26 @@ static int set_dump(int argc, char **argv)
 		}
 		i++;
 	}
+	if (ok && dmpfile) {
+		if (pc->dmpfile == NULL) {
+			char tfname[1024];
+			sprintf(tfname, "vpcs%d", pc->id + 1);
+			pc->dmpfile = open_dmpfile(tfname, nsec);
+		}
+		if (pc->dmpfile == NULL)
+			printf("Open dump file error [%s]\n", strerror(errno));
+		else
+			dmpflag |= DMP_FILE;
+	}
+	if (ok && pc->dmpfile) {
+		if (maxsize >= 0)
+			pc->dmpfile->maxsize = maxsize;
+		if (maxtime >= 0)
+			pc->dmpfile->maxtime = maxtime;
+	}
 	if (ok) {
-		if (dmpflag == 0)
-			pc->dmpflag = 0;
+		if (off)
+			pc->dmpflag = dmpflag;
 		else
 			pc->dmpflag |= dmpflag;
 
@@ -1606,14 +1724,37 @@ static int set_dump(int argc, char **argv)
 	return 1;
 }
 
-int show_arp(int argc, char **argv)
+/* print the reachable entries of the arp cache, return the count */
+static int show_arp4(pcs *pc)
 {
-	pcs *pc;
-	int i, j;
+	arpcache *ac = &pc->arp4;
+	ipmac *e;
+	int i, j, n = 0;
 	struct in_addr in;
 	char buf[19];
-	u_char zero[ETH_ALEN] = {0};
-	int empty = 1;
+
+	pthread_mutex_lock(&ac->locker);
+	for (i = 0; i < ARP_CACHE_SIZE; i++) {
+		e = &ac->ent[i];
+		if (e->state != ARP_REACHABLE)
+			continue;
+		if (time_tick - e->timeout > POOL_TIMEOUT)
+			continue;
+		for (j = 0; j < 6; j++)
+			sprintf(buf + j * 3, "%2.2x:", e->mac[j]);
+		buf[17] = '\0';
+		in.s_addr = e->ip;
+		printf("%s  %s expires in %d seconds \n", buf, inet_ntoa(in),
+		    POOL_TIMEOUT - (time_tick - e->timeout));
+		n++;
+	}
+	pthread_mutex_unlock(&ac->locker);
+	
+	return n;
+}
+
+int show_arp(int argc, char **argv)
+{
 	int si;
 
 	printf("\n");
@@ -1621,31 +1762,13 @@ int show_arp(int argc, char **argv)
 	if (argc == 3) {
 		if (!strncmp(argv[2], "all", strlen(argv[2]))) {
 			for (si = 0; si < num_pths; si++) {
-				pc = &vpc[si];
-				printf("%s[%d]:\n", pc->xname, si + 1);
-
-				for (i = 0; i < POOL_SIZE; i++) {
-					if (pc->ipmac4[i].ip == 0)
-						continue;
-					if (memcmp(pc->ipmac4[i].mac, zero, ETH_ALEN) == 0)
-						continue;
-					if (time_tick - pc->ipmac4[i].timeout > POOL_TIMEOUT)
-						continue;
-					for (j = 0; j < 6; j++)
-						sprintf(buf + j * 3, "%2.2x:", pc->ipmac4[i].mac[j]);
-					buf[17] = '\0';
-					in.s_addr = pc->ipmac4[i].ip;
-					printf("%s  %s expires in %d seconds \n", buf, inet_ntoa(in),
-					    POOL_TIMEOUT - (time_tick - pc->ipmac4[i].timeout));
-					empty = 0;
-
-				}
-				if (empty)
+				printf("%s[%d]:\n", vpc[si].xname, si + 1);
+				if (show_arp4(&vpc[si]) == 0)
 					printf("arp table is empty\n");
 			}
 			return 1;
-		} else if (strlen(argv[2]) == 1 && digitstring(argv[2])) {
-			si = atoi(argv[2]) - 1;
+		} else if (digitstring(argv[2])) {
+			si = str2vpcid(argv[2]);
 			if (si < 0) {
 				printf("Invalid ID\n");
 				return 1;
@@ -1660,23 +1783,7 @@ int show_arp(int argc, char **argv)
 	if (si != pcid)
 		printf("%s[%d]:\n", vpc[si].xname, si + 1);
 
-	pc = &vpc[si];
-	for (i = 0; i < POOL_SIZE; i++) {
-		if (pc->ipmac4[i].ip == 0)
-			continue;
-		if (etherIsZero(pc->ipmac4[i].mac))
-			continue;
-		if (time_tick - pc->ipmac4[i].timeout < POOL_TIMEOUT) {
-			for (j = 0; j < 6; j++)
-				sprintf(buf + j * 3, "%2.2x:", pc->ipmac4[i].mac[j]);
-			buf[17] = '\0';
-			in.s_addr = pc->ipmac4[i].ip;
-			printf("%s  %s expires in %d seconds \n", buf, inet_ntoa(in),
-			    POOL_TIMEOUT - (time_tick - pc->ipmac4[i].timeout));
-			empty = 0;
-		}
-	}
-	if (empty)
+	if (show_arp4(&vpc[si]) == 0)
 		printf("arp table is empty\n");
 
 	return 1;
@@ -1708,15 +1815,13 @@ static int show_dump(int argc, char **argv)
 			}
 			return 1;
 		}
-		if (strlen(argv[2]) == 1 && digitstring(argv[2])) {
-			i = atoi(argv[2]) - 1;
+		if ((i = str2vpcid(argv[2])) != -1) {
 			pc = &vpc[i];
 		} else {
 			printf( "\033[1mshow dump [all]\033[0m\n"
 				"    all     all vpc's dump flags\n");
+			return 1;
 		}
-
-		return 1;
 	}
 	printf("dump flags:");
 	if (pc->dmpflag & DMP_MAC)
@@ -1732,6 +1837,19 @@ static int show_dump(int argc, char **argv)
 	if (pc->dmpflag == 0)
 		printf(" (none)");
 	printf("\n");
+	if (dmp_skipped())
+		printf("console: %u frames skipped\n", dmp_skipped());
+	if (pc->dmpfilter)
+		printf("dump filter: %s\n", pc->dmpfilter->text);
+	if (pc->dmpfile) {
+		struct dmpfile *df = pc->dmpfile;
+		
+		printf("dump file: %s, %lu frames, %u dropped\n", df->fname, 
+		    df->frames, df->ring.drops);
+		if (df->maxsize || df->maxtime)
+			printf("rotate: %u MB, %u seconds, %u files\n", 
+			    df->maxsize, df->maxtime, df->files);
+	}
 	return 1;
 }
 
@@ -1794,9 +1912,7 @@ static int show_ip(int argc, char **argv)
 			}
 			return 1;
 		}
-		if (strlen(argv[2]) == 1 && digitstring(argv[2])){
-			id = argv[2][0] - '1';
-		}
+		id = str2vpcid(argv[2]);
 	} else if (argc == 2)
 		id = pcid;
 
@@ -1839,6 +1955,11 @@ static int show_ip(int argc, char **argv)
 		printf("LPORT       : %d\n", vpc[id].lport);
 		in.s_addr = vpc[id].rhost;
 		printf("RHOST:PORT  : %s:%d\n", inet_ntoa(in), vpc[id].rport);
+		if (vpc[id].agg.mode != AGG_MODE_OFF)
+			printf("AGGREGATE   : %s, %dus, %u/%u bundles out/in\n", 
+			    (vpc[id].agg.mode == AGG_MODE_ON) ? "on" : 
+			    "waiting for peer", vpc[id].agg.delay, 
+			    vpc[id].agg.tx_bundles, vpc[id].agg.rx_bundles);
 		printf("MTU         : %d\n", vpc[id].mtu);
 		return 1;
 	}
@@ -1867,6 +1988,129 @@ static int show_echo(int argc, char **argv)
 	return 1;
 }
 
+static int show_pool(int argc, char **argv)
+{
+	struct pktpool_stat st;
+	int i;
+	
+	pktpool_stat(&st);
+	
+	printf("\n");
+	printf("Packet buffers: %u, idle: %u, in use or cached: %u\n", 
+	    st.total, st.idle, st.total - st.idle);
+	printf("Pool exhausted: %u, oversize: %u, out of memory: %u\n",
+	    st.exhausted, st.oversize, st.nomem);
+	
+	printf("Queue drops:\n");
+	for (i = 0; i < num_pths; i++) {
+		if (vpc[i].fd == 0)
+			continue;
+		printf("  VPCS%d  in %u, out %u, bgin %u, bgout %u", i + 1,
+		    vpc[i].iq.drops, vpc[i].oq.drops, 
+		    vpc[i].bgiq.drops, vpc[i].bgoq.drops);
+		if (vpc[i].ring != NULL)
+			printf(", ring %u", ring_drops(&vpc[i]));
+		printf("\n");
+	}
+	
+	printf("Reassembly:\n");
+	for (i = 0; i < num_pths; i++) {
+		struct reasstab *rt = &vpc[i].reass;
+		
+		if (vpc[i].fd == 0)
+			continue;
+		printf("  VPCS%d  %d in progress, %u/%u KB, done %u, timeouts %u, "
+		    "overlaps %u, evictions %u, invalid %u\n", i + 1, rt->count,
+		    (rt->mem + 1023) >> 10, rt->budget >> 10, rt->done, 
+		    rt->timeouts, rt->overlaps, rt->evictions, rt->invalid);
+	}
+
+	return 1;
+}
+
+static void capture_stat(pcs *pc)
+{
+	u_int seen = pc->capring ? pc->capring->tail : 0;
+	
+	if (pc->capoff) {
+		printf("%s[%d] off\n", pc->xname, pc->id + 1);
+		return;
+	}
+	printf("%s[%d] %d frames held, %u seen\n", pc->xname, pc->id + 1, 
+	    cap_count(pc->capring), seen);
+}
+
+static int show_capture(int argc, char **argv)
+{
+	int i;
+	
+	printf("\n");
+	if (argc == 3) {
+		if (!strncmp(argv[2], "all", strlen(argv[2]))) {
+			for (i = 0; i < num_pths; i++)
+				capture_stat(&vpc[i]);
+			return 1;
+		}
+		if ((i = str2vpcid(argv[2])) == -1) {
+			printf("Invalid arguments\n");
+			return 1;
+		}
+	} else
+		i = pcid;
+	
+	capture_stat(&vpc[i]);
+	printf("flight recorder: %d frames, %d bytes of each\n", 
+	    CAP_FRAMES, CAP_SNAPLEN);
+	
+	return 1;
+}
+
+/* save, turn on or off the flight recorder of the current VPC */
+int run_dump(int argc, char **argv)
+{
+	pcs *pc = &vpc[pcid];
+	struct capring *cr;
+	char prefix[64], fname[128];
+	int n;
+	
+	if (argc == 2 && !strcmp(argv[1], "on")) {
+		pc->capoff = 0;
+		return 1;
+	}
+	if (argc == 2 && !strcmp(argv[1], "off")) {
+		/* no frame goes into the ring once the reader/writer left */
+		pc->capoff = 1;
+		dump_quiesce(pc);
+		cr = pc->capring;
+		pc->capring = NULL;
+		cap_close(cr);
+		return 1;
+	}
+	if (argc < 2 || argc > 3 || 
+	    strncmp(argv[1], "flush", strlen(argv[1]))) {
+		help_dump(argc, argv);
+		return 1;
+	}
+	if (pc->capring == NULL) {
+		printf("%s\n", pc->capoff ? "The flight recorder is off" : 
+		    "No frames held");
+		return 1;
+	}
+	
+	if (argc == 3)
+		snprintf(prefix, sizeof(prefix), "%s", argv[2]);
+	else
+		snprintf(prefix, sizeof(prefix), "vpcs%d", pc->id + 1);
+	
+	n = cap_flush(pc->capring, prefix, fname, sizeof(fname));
+	if (n < 0)
+		printf("Can not save to %s\n", fname);
+	else
+		printf("%d frames saved to %s\n", n, fname);
+	
+	return 1;
+}
+
 int run_ver(int argc, char **argv)
 {
 	printf ("\r\n"
@@ -2005,6 +2249,8 @@ int run_save(int argc, char **argv)
 				fprintf(fp, "set rhost %s\n", inet_ntoa(in));
 			}
 		}
+		if (vpc[i].agg.mode != AGG_MODE_OFF)
+			fprintf(fp, "set aggregate on %d\n", vpc[i].agg.delay);
 
 		if (vpc[i].ip4.dynip == 1)
 			fputs("dhcp\n", fp);
@@ -2085,6 +2331,20 @@ int str2color(const char *cstr)
 
 int run_test(int argc, char **argv)
 {
+	int len = 1500;
+
+	if (argc > 1 && !strcmp(argv[1], "cksum")) {
+		if (argc > 2)
+			len = atoi(argv[2]);
+		if (len < 1 || len > 65535) {
+			printf("Invalid size\n");
+			return 1;
+		}
+		printf("\nchecksum kernel: %s\n", cksum_kernel());
+		cksum_bench(len);
+		return 1;
+	}
+
 	printf("\nTest command executed!\n");
 	printf("Arguments received:\n");
 	for (int i = 0; i < argc; i++) {
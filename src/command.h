@@ -44,6 +44,7 @@ int run_load(int argc, char **argv);
 int run_save(int argc, char **argv);
 int run_test(int argc, char **argv);
 int run_httpd(int argc, char **argv);
+int run_dump(int argc, char **argv);
 
 const char *ip4Info(const int id);
 
@@ -46,7 +46,6 @@
 extern int pcid;
 extern int devtype;
 extern int ctrl_c;
-extern u_int time_tick;
 extern int num_pths;
 
 int run_net6(char *cmdstr);
@@ -169,6 +168,7 @@ int run_ping6(int argc, char **argv)
 			traveltime = 0.6 * usec / 1000;
 			/* send data */
 			delay_ms(traveltime);		
+			pc->mscb.data = NULL; /* the pattern */
 			gettimeofday(&(ts), (void*)0);
 			k = tcp_send(pc, IPV6_VERSION);
 			if (k == 0) {
@@ -693,9 +693,7 @@ int show_ipv6(int argc, char **argv)
 			}
 			return 1;
 		}
-		if (strlen(argv[2]) == 1 && digitstring(argv[2])){
-			id = argv[2][0] - '1';
-		}	
+		id = str2vpcid(argv[2]);
 	} else if (argc == 2)
 		id = pcid;
 	
@@ -801,8 +799,8 @@ int show_mtu6(int argc, char **argv)
 				show_pc_mtu6(pc);
 			}
 			return 1;	
-		} else if (strlen(argv[2]) == 1 && digitstring(argv[2])) {
-			si = atoi(argv[2]) - 1;
+		} else if (digitstring(argv[2])) {
+			si = str2vpcid(argv[2]);
 			if (si < 0) {
 				printf("Invalid ID\n");
 				return 1;
@@ -24,6 +24,10 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
 **/
 
+#ifdef Linux
+#define _GNU_SOURCE		/* recvmmsg, sendmmsg */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,80 +41,471 @@
 #include <arpa/inet.h>
 
 #include <net/if.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef Linux
+#include <sched.h>
+#endif
 
 #ifdef Linux
 #ifdef TAP
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 #endif
 #endif
 
 #include "globle.h"
 #include "dev.h"
+#include "ring.h"
+#include "uring.h"
 
 extern int devtype;
 
 #ifdef TAP
 extern int num_pths;
 extern char *tapname;
+extern int tapoffload;
+extern int tapqueues;
 #endif
+extern int devuring;
 
-int VRead(pcs *pc, void *buf, int len)
+/*
+ * the device fds are blocking, the reader sleeps in the kernel until a 
+ * frame arrives. The sends are non-blocking, poll is only called when 
+ * the socket buffer or the tap queue is full.
+ */
+static int wait_writable(int fd)
 {
-	struct sockaddr addr;
-	socklen_t size;
-	int n = 0;
-	fd_set readSet;
-	struct timeval timeout = {1, 0};
+	struct pollfd pfd;
+	
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	
+	return (poll(&pfd, 1, 1000) > 0);
+}
+
+/*
+ * the checksums and the tcp segmentation are left to the tap, every 
+ * frame is led by a virtio_net_hdr.
+ */
+int dev_offload(void)
+{
+#ifdef IFF_VNET_HDR
+	return (devtype == DEV_TAP && tapoffload);
+#else
+	return 0;
+#endif
+}
+
+#ifdef IFF_VNET_HDR
+/*
+ * the frames from the kernel may have the l4 checksum unfinished, the 
+ * stack never checks the inbound sums, keep the flag for the replies 
+ * made in place (udpReply), the kernel finishes them on the way out.
+ */
+static int tap_read(int fd, struct packet *m)
+{
+	struct virtio_net_hdr vh;
+	struct iovec iov[2];
+	int n;
 	
-	FD_ZERO(&readSet);
-	FD_SET(pc->fd, &readSet);
+	iov[0].iov_base = &vh;
+	iov[0].iov_len = sizeof(vh);
+	iov[1].iov_base = m->data;
+	iov[1].iov_len = PKT_MAXSIZE;
 	
-	if (select(pc->fd + 1, &readSet, NULL, NULL, &timeout) <= 0)
+	n = readv(fd, iov, 2);
+	if (n <= (int)sizeof(vh))
 		return 0;
+	
+	m->len = n - sizeof(vh);
+	if (vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+		m->flags |= PKT_F_CSUM;
+	
+	return 1;
+}
+
+/*
+ * the checksum field holds the sum of the pseudo header, the kernel sums
+ * from csum_start on and stores the result at csum_offset. A segment 
+ * with gso_size is cut into gso_size pieces, the headers are copied.
+ */
+static void tap_vnethdr(struct packet *m, struct virtio_net_hdr *vh)
+{
+	ethdr *eh = (ethdr *)(m->data);
+	int hlen, proto, v4;
+	
+	memset(vh, 0, sizeof(struct virtio_net_hdr));
+	if (!(m->flags & PKT_F_CSUM))
+		return;
+	
+	v4 = (eh->type == htons(ETHERTYPE_IP));
+	if (v4) {
+		iphdr *ip = (iphdr *)(eh + 1);
+		
+		hlen = ip->ihl << 2;
+		proto = ip->proto;
+	} else {
+		ip6hdr *ip = (ip6hdr *)(eh + 1);
 		
+		hlen = sizeof(ip6hdr);
+		proto = ip->ip6_nxt;
+	}
+	
+	vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vh->csum_start = sizeof(ethdr) + hlen;
+	vh->csum_offset = (proto == IPPROTO_TCP) ? 16 : 6;
+	
+	if (m->gso_size && proto == IPPROTO_TCP) {
+		tcphdr *th = (tcphdr *)(m->data + vh->csum_start);
+		
+		vh->gso_type = v4 ? VIRTIO_NET_HDR_GSO_TCPV4 : 
+		    VIRTIO_NET_HDR_GSO_TCPV6;
+		vh->gso_size = m->gso_size;
+		vh->hdr_len = vh->csum_start + (th->th_off << 2);
+	}
+}
+
+static int tap_write(int fd, struct packet *m)
+{
+	struct virtio_net_hdr vh;
+	struct iovec iov[2];
+	int n;
+	
+	tap_vnethdr(m, &vh);
+	iov[0].iov_base = &vh;
+	iov[0].iov_len = sizeof(vh);
+	iov[1].iov_base = m->data;
+	iov[1].iov_len = m->len;
+	
+	while ((n = writev(fd, iov, 2)) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			break;
+		if (errno != EINTR && !wait_writable(fd))
+			break;
+	}
+	
+	return (n < 0) ? n : n - (int)sizeof(vh);
+}
+#endif
+
+int VRead(int fd, void *buf, int len)
+{
+	int n = 0;
+	
 	switch (devtype) {
 		case DEV_TAP:
-			n = read(pc->fd, buf, len);
+			n = read(fd, buf, len);
 			break;
 		case DEV_UDP:
-			size = sizeof(addr);
-			n = recvfrom(pc->fd, buf, len, 0, (struct sockaddr *)&addr, &size);
+			n = recv(fd, buf, len, 0);
 			break;
 	}
 	return n;
 }
 
-int VWrite(pcs *pc, void *buf, int len)
+int VWrite(int fd, void *buf, int len)
 {
-	struct sockaddr_in addr;
 	int n = 0;
-	fd_set writeSet;
-	struct timeval timeout = {1, 0};
 	
-	FD_ZERO(&writeSet);
-	FD_SET(pc->fd, &writeSet);
+	while (1) {
+		switch (devtype) {
+			case DEV_TAP:
+				n = write(fd, buf, len);
+				break;
+			case DEV_UDP:
+				n = send(fd, buf, len, MSG_DONTWAIT);
+				if (n < 0 && TUNNEL_ERR(errno))
+					n = len;
+				break;
+		}
+		if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && 
+		    errno != EINTR))
+			break;
+		if (errno != EINTR && !wait_writable(fd))
+			break;
+	}
+	return n;
+}
+
+/*
+ * the fd of the queue q, the tap of a VPC may have several queues, 
+ * the others have only queue 0.
+ */
+static int dev_fd(pcs *pc, int q)
+{
+	return (q == 0) ? pc->fd : pc->tapq[q].fd;
+}
+
+static struct uring *dev_uring(pcs *pc, int q)
+{
+	return (q == 0) ? pc->uring : pc->tapq[q].uring;
+}
+
+/*
+ * move the i/o of the queue q to io_uring if -U is set, the vnet header 
+ * of -O and the packet socket keep their own way. 
+ */
+int open_uring(pcs *pc, int q)
+{
+	struct uring *u;
+	
+	if (!devuring || devtype == DEV_PACKET || dev_offload())
+		return 0;
 	
-	if (select(pc->fd + 1, NULL, &writeSet, NULL, &timeout) <= 0)
+	u = uring_open();
+	if (u == NULL)
+		return -1;
+	if (q == 0)
+		pc->uring = u;
+	else
+		pc->tapq[q].uring = u;
+	
+	return 0;
+}
+
+/*
+ * receive up to n frames from the queue q into the packets, each of them
+ * has room for PKT_MAXSIZE octets. return the count of the received 
+ * frames, the length of every frame is stored in pkts[i]->len.
+ */
+int VReadv(pcs *pc, int q, struct packet **pkts, int n)
+{
+	int fd = dev_fd(pc, q);
+#if defined(Linux)
+	struct mmsghdr msgs[PKT_BURST];
+	struct iovec iovs[PKT_BURST];
+	int i;
+#endif
+	int k;
+	
+	if (n <= 0)
 		return 0;
+	
+	if (devtype == DEV_PACKET)
+		return ring_readv(pc, pkts, n);
+	if (dev_uring(pc, q) != NULL)
+		return uring_readv(dev_uring(pc, q), fd, pkts, n);
 		
+#if defined(Linux)
+	if (devtype == DEV_UDP) {
+		if (n > PKT_BURST)
+			n = PKT_BURST;
 		
-	switch (devtype) {
-		case DEV_TAP:
-			n = write(pc->fd, buf, len);
-			break;
-		case DEV_UDP:
-			bzero(&addr, sizeof(addr));
-			addr.sin_family = AF_INET;
-			addr.sin_port = htons(pc->rport);
-			addr.sin_addr.s_addr = pc->rhost;
+		memset(msgs, 0, n * sizeof(struct mmsghdr));
+		for (i = 0; i < n; i++) {
+			iovs[i].iov_base = pkts[i]->data;
+			iovs[i].iov_len = PKT_MAXSIZE;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		
+		/* wait for the first one only, take what else is queued */
+		k = recvmmsg(fd, msgs, n, MSG_WAITFORONE, NULL);
+		if (k <= 0)
+			return 0;
+		for (i = 0; i < k; i++)
+			pkts[i]->len = msgs[i].msg_len;
 		
-			n = sendto(pc->fd, buf, len, 0, (struct sockaddr *)&addr, sizeof(addr));
+		return k;
+	}
+#endif
+#ifdef IFF_VNET_HDR
+	if (dev_offload())
+		return tap_read(fd, pkts[0]);
+#endif
+	k = VRead(fd, pkts[0]->data, PKT_MAXSIZE);
+	if (k <= 0)
+		return 0;
+	pkts[0]->len = k;
+	
+	return 1;
+}
 
+/*
+ * send n frames on the queue q, return the count of the frames handed 
+ * to the kernel.
+ */
+int VWritev(pcs *pc, int q, struct packet **pkts, int n)
+{
+	int fd = dev_fd(pc, q);
+#if defined(Linux)
+	struct mmsghdr msgs[PKT_BURST];
+	struct iovec iovs[PKT_BURST];
+	int rc;
+#endif
+	int i;
+	
+	if (devtype == DEV_PACKET)
+		return ring_writev(pc, pkts, n);
+	if (dev_uring(pc, q) != NULL)
+		return uring_writev(dev_uring(pc, q), fd, pkts, n);
+	
+#if defined(Linux)
+	if (devtype == DEV_UDP && n > 1) {
+		if (n > PKT_BURST)
+			n = PKT_BURST;
+		
+		memset(msgs, 0, n * sizeof(struct mmsghdr));
+		for (i = 0; i < n; i++) {
+			iovs[i].iov_base = pkts[i]->data;
+			iovs[i].iov_len = pkts[i]->len;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		
+		for (i = 0; i < n; i += rc) {
+			rc = sendmmsg(fd, msgs + i, n - i, MSG_DONTWAIT);
+			if (rc > 0)
+				continue;
+			rc = 0;
+			if (errno == EINTR)
+				continue;
+			if (TUNNEL_ERR(errno)) {
+				/* the head frame is lost, go on with the rest */
+				rc = 1;
+				continue;
+			}
+			if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+			    !wait_writable(fd))
+				break;
+		}
+		
+		return i;
+	}
+#endif
+#ifdef IFF_VNET_HDR
+	if (dev_offload()) {
+		for (i = 0; i < n; i++) {
+			if (tap_write(fd, pkts[i]) != pkts[i]->len)
+				break;
+		}
+		return i;
+	}
+#endif
+	for (i = 0; i < n; i++) {
+		if (VWrite(fd, pkts[i]->data, pkts[i]->len) != pkts[i]->len)
 			break;
 	}
-	return n;
+	
+	return i;
 }
 
+/*
+ * the frames to the tap may leave by any queue, keep a flow on one queue
+ * so its frames are not reordered. The hash takes the addresses and the 
+ * ports of the unfragmented tcp/udp, the rest go by queue 0.
+ */
+static int tapq_hash(struct packet *m, int nq)
+{
+	ethdr *eh = (ethdr *)(m->data);
+	u_int h = 0;
+	u_short *ports = NULL;
+	
+	if (eh->type == htons(ETHERTYPE_IP)) {
+		iphdr *ip = (iphdr *)(eh + 1);
+		
+		h = ip->sip ^ ip->dip;
+		if ((ip->proto == IPPROTO_TCP || ip->proto == IPPROTO_UDP) &&
+		    !(ntohs(ip->frag) & (IP_MF | IP_OFFMASK)))
+			ports = (u_short *)((char *)ip + (ip->ihl << 2));
+	} else if (eh->type == htons(ETHERTYPE_IPV6)) {
+		ip6hdr *ip = (ip6hdr *)(eh + 1);
+		int i;
+		
+		for (i = 0; i < 4; i++)
+			h ^= ip->src.addr32[i] ^ ip->dst.addr32[i];
+		if (ip->ip6_nxt == IPPROTO_TCP || ip->ip6_nxt == IPPROTO_UDP)
+			ports = (u_short *)(ip + 1);
+	} else
+		return 0;
+	
+	if (ports != NULL)
+		h ^= ports[0] ^ ports[1];
+	h ^= h >> 16;
+	h ^= h >> 8;
+	
+	return h % nq;
+}
+
+/*
+ * the writer of queue 0 hands the frames of the other queues to their 
+ * writers, return the count of the frames left in pkts for queue 0.
+ * The queues are set up while the writer runs, ntapq is published last.
+ */
+int tapq_steer(pcs *pc, struct packet **pkts, int n)
+{
+	int i, k, q, nq;
+	
+	nq = __atomic_load_n(&pc->ntapq, __ATOMIC_ACQUIRE);
+	if (nq <= 1)
+		return n;
+	
+	for (i = 0, k = 0; i < n; i++) {
+		q = tapq_hash(pkts[i], nq);
+		if (q == 0)
+			pkts[k++] = pkts[i];
+		else
+			enq(&pc->tapq[q].oq, pkts[i]);
+	}
+	
+	return k;
+}
+
+/*
+ * keep the reader and the writer of a queue on one core, the queues of 
+ * all the VPCs are laid out over the cores in turn.
+ */
+void tapq_pin(pcs *pc, int q)
+{
+#ifdef Linux
+	cpu_set_t set;
+	int ncpu;
+	
+	if (devtype != DEV_TAP || tapqueues <= 1)
+		return;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu <= 1)
+		return;
+	
+	CPU_ZERO(&set);
+	CPU_SET((pc->id * tapqueues + q) % ncpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+/*
+ * fix the peer of the udp tunnel, the kernel needs not look up the route
+ * for every send, and only the frames from the peer are received.
+ */
+int connect_udp(pcs *pc)
+{
+	struct sockaddr_in addr;
+	
+	if (devtype != DEV_UDP || pc->fd <= 0)
+		return 0;
+		
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(pc->rport);
+	addr.sin_addr.s_addr = pc->rhost;
+	
+	return connect(pc->fd, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+/*
+ * wake up the reader blocked on the old device, then close it.
+ */
+void close_dev(int fd)
+{
+	if (fd <= 0)
+		return;
+	
+	shutdown(fd, SHUT_RDWR);
+	close(fd);
+}
 
 int open_dev(int id)
 {
@@ -133,6 +528,13 @@ int open_dev(int id)
 				return 0;
 			}
 			break;
+		case DEV_PACKET:
+			fd = open_ring(id);
+			if (fd <= 0) {
+				fd = 0;
+				return 0;
+			}
+			break;
 	}
 		
 	return fd;
@@ -188,12 +590,40 @@ int open_tap(int id)
 	 *             TUNSLMODE | TUNSIFHEAD on the freebsd.
 	 */
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+#ifdef IFF_VNET_HDR
+	/*
+	 * IFF_VNET_HDR - a virtio_net_hdr leads every frame, the sums of 
+	 *                the frames to us may be unfinished (TUN_F_CSUM), 
+	 *                no TSO to us, the buffers are PKT_MAXSIZE.
+	 */
+	if (tapoffload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+#endif
+#ifdef IFF_MULTI_QUEUE
+	/*
+	 * IFF_MULTI_QUEUE - every open of the same name adds a queue, the 
+	 *                   kernel spreads the flows to us by the hash.
+	 */
+	if (tapqueues > 1)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+#endif
 	strncpy(ifr.ifr_name, dev, IFNAMESIZ);
 
 	if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0) {
 		close(fd);
 		return(-1);
 	}
+#ifdef IFF_VNET_HDR
+	if (tapoffload) {
+		int hlen = sizeof(struct virtio_net_hdr);
+		
+		if (ioctl(fd, TUNSETVNETHDRSZ, &hlen) < 0 ||
+		    ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM) < 0) {
+			close(fd);
+			return(-1);
+		}
+	}
+#endif
 	return(fd);
 }
 #endif
@@ -29,11 +29,26 @@
 
 #include "vpcs.h"
 
+/*
+ * a connected udp socket reports the icmp errors of the earlier sends,
+ * the peer is not up yet, the frame is just lost in the tunnel.
+ */
+#define TUNNEL_ERR(e) ((e) == ECONNREFUSED || (e) == EHOSTUNREACH || \
+    (e) == ENETUNREACH)
+
 int open_dev(int id);
 int open_udp(int port);
 int open_tap(int id);
-int VRead(pcs *pc, void *buf, int len);
-int VWrite(pcs *pc, void *buf, int len);
+int connect_udp(pcs *pc);
+int dev_offload(void);
+void close_dev(int fd);
+int VRead(int fd, void *buf, int len);
+int VWrite(int fd, void *buf, int len);
+int VReadv(pcs *pc, int q, struct packet **pkts, int n);
+int VWritev(pcs *pc, int q, struct packet **pkts, int n);
+int tapq_steer(pcs *pc, struct packet **pkts, int n);
+void tapq_pin(pcs *pc, int q);
+int open_uring(pcs *pc, int q);
 
 #endif
 
@@ -677,7 +677,7 @@ int dhcp_renew(pcs *pc)
 		
 		while ((p = deq(&pc->bgiq)) != NULL && !ok) {
 			ok = isDhcp4_packer(pc, p);
-			free(p);
+			del_pkt(p);
 		}
 		
 		i++;
@@ -715,7 +715,7 @@ int dhcp_rebind(pcs *pc)
 		
 		while ((p = deq(&pc->bgiq)) != NULL && !ok) {
 			ok = isDhcp4_Offer(pc, p);
-			free(p);
+			del_pkt(p);
 		}
 	}
 	if (!ok)
@@ -736,7 +736,7 @@ int dhcp_rebind(pcs *pc)
 		
 		while ((p = deq(&pc->bgiq)) != NULL && !ok) {
 			ok = isDhcp4_packer(pc, p);
-			free(p);
+			del_pkt(p);
 		}
 	}
 
@@ -747,6 +747,24 @@ int dhcp_rebind(pcs *pc)
 	return 1;
 }
 
+/*
+ * arm the timer of the lease for the renewing, or the rebinding if the 
+ * renewing is over, pth_bgjob does the work.
+ */
+void dhcp_schedule(pcs *pc)
+{
+	int t;
+	
+	if (!pc->ip4.dhcp.svr || !pc->ip4.dhcp.timetick)
+		return;
+	
+	t = time_tick - pc->ip4.dhcp.timetick;
+	if (t <= pc->ip4.dhcp.renew)
+		timer_add(&pc->dhcptimer, (pc->ip4.dhcp.renew - t + 1) * 1000);
+	else if (t <= pc->ip4.dhcp.rebind)
+		timer_add(&pc->dhcptimer, (pc->ip4.dhcp.rebind - t + 1) * 1000);
+}
+
 int dhcp_enq(pcs *pc, const struct packet *m)
 {
 	ethdr *eh;
@@ -91,6 +91,7 @@ int dmp_dhcp(pcs *pc, const struct packet *m);
 
 int dhcp_renew(pcs *pc);
 int dhcp_rebind(pcs *pc);
+void dhcp_schedule(pcs *pc);
 int dhcp_enq(pcs *pc, const struct packet *m);
 
 
@@ -96,7 +96,7 @@ int hostresolv(pcs *pc, char *name, char *ipstr)
 				ok = 0;
 				while ((m = deq(&pc->iq)) != NULL && !ok) {
 					ok = dnsparse(m, magicid, dname, namelen, ip);
-					free(m);
+					del_pkt(m);
 				}
 				if (ok == 2) {
 					tryagain = 1;
@@ -24,9 +24,16 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
 **/
 
+#define _GNU_SOURCE		/* SCHED_IDLE */
+
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <ctype.h>
 #include <sys/time.h>
 
@@ -40,27 +47,59 @@ static void dmp_arp(void *dat);
 static void dmp_dns(void *dat);
 static char *dmp_dns_timestr(u_int s);
 
-static struct timeval gtv = {0, 0};
+static struct dmprec *dmpr_rec(struct dmpring *ring, u_int i);
+static int dmpr_init(struct dmpring *ring, int nrec, int recsize);
+static void dmpr_free(struct dmpring *ring);
+static struct dmprec *dmpr_claim(struct dmpring *ring);
+static void dmpr_commit(struct dmpring *ring, struct dmprec *r);
+static struct dmprec *dmpr_peek(struct dmpring *ring);
+static void dmpr_release(struct dmpring *ring, struct dmprec *r);
+static void dmpr_wait(struct dmpring *ring, const int *stop);
+static void dmpr_stamp(const struct packet *m, struct timespec *ts);
 
-int dmp_packet(const struct packet *m, const int flag)
+static struct dmpring conring;
+static pthread_once_t con_once = PTHREAD_ONCE_INIT;
+static int con_ok = 0;
+static u_int con_skipped = 0;
+static struct timespec gts = {0, 0};
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static void dmp_hex(const u_char *p, int len)
+{
+	char line[80];
+	int i, j, k, pos;
+	
+	for (i = 0; i < len; i += 16) {
+		/* the bytes in pairs, then the ascii from column 43 */
+		memset(line, ' ', 43);
+		pos = 0;
+		k = 43;
+		for (j = i; j < i + 16 && j < len; j++) {
+			line[pos++] = hexdigits[p[j] >> 4];
+			line[pos++] = hexdigits[p[j] & 0xf];
+			if ((j - i) & 1)
+				pos++;
+			line[k++] = isprint(p[j]) ? p[j] : '.';
+		}
+		line[k] = '\0';
+		printf("%s\n", line);
+	}
+}
+
+static void dmp_show(const struct dmprec *r)
 {
-	struct timeval tv;
+	u_char *p = (u_char *)r->data;
+	ethdr *eh = (ethdr *)r->data;
 	uint32_t usec;
-	int i, j, pos0, pos1;
-	char x0[96], x1[17];
-	u_char *p = (u_char *)m->data;
-	int len = m->len;
-	int left;
-	ethdr *eh = (ethdr *)m->data;
+	int flag = r->flag;
 	int cr = 0;
-
-	if (flag == 0)
-		return flag;
-	if (gtv.tv_sec == 0)
-		gettimeofday(&gtv, 0);
 	
-	gettimeofday(&tv, 0);
-	usec = (tv.tv_sec - gtv.tv_sec) * 1000000 + tv.tv_usec - gtv.tv_usec;
+	if (gts.tv_sec == 0)
+		gts = r->ts;
+	
+	usec = (r->ts.tv_sec - gts.tv_sec) * 1000000 + 
+	    (r->ts.tv_nsec - gts.tv_nsec) / 1000;
 	printf("\n\033[32m%04u.%u\033[0m", usec / 1000000, usec % 1000000);
 	if (flag & DMP_MAC) {
 		printf("  ");
@@ -70,42 +109,15 @@ int dmp_packet(const struct packet *m, const int flag)
 		printf(" -> ");
 		PRINT_MAC(p);
 		printf("\n");
-	}	
-	len -= 14;
-	p += 14;
+	}
 	
-	if (flag & DMP_RAW) {	
-		i = 0;
+	if (flag & DMP_RAW) {
 		if (!cr) {
 			printf("\n");
 			printf("\033[33m");
 			cr = 1;
 		}
-		while (i < len) {
-			pos0 = pos1 = 0;
-			left = 40;
-			for (j = i; (j < i + 16 && j < len); j += 2) {
-				
-				pos0 += sprintf(x0 + pos0, "%2.2x", *(p + j));
-				left -= 2;
-				if (isprint(*(p + j)))
-					pos1 += sprintf(x1 + pos1, "%c", *(p + j));
-				else
-					pos1 += sprintf(x1 + pos1, ".");
-				
-				pos0 += sprintf(x0 + pos0, "%2.2x ", *(p + j + 1));
-				left -= 3;
-				if (isprint(*(p + j + 1)))
-					pos1 += sprintf(x1 + pos1, "%c", *(p + j + 1));
-				else
-					pos1 += sprintf(x1 + pos1, ".");
-			}
-	
-			for (pos1 = 0; pos1 < left; pos1++)
-				pos0 += sprintf(x0 + pos0, " ");
-			printf("%s   %s\n", x0, x1);
-			i += (j - i);
-		}
+		dmp_hex(p + 14, r->caplen - 14);
 		printf("\n");
 	}
 	if (flag & DMP_DETAIL) {
@@ -124,10 +136,95 @@ int dmp_packet(const struct packet *m, const int flag)
 	}
 	if (cr)
 		printf("\033[0m");
+}
+
+/* the decoder, it runs only when the cpus have nothing else to do */
+static void *pth_decode(void *arg)
+{
+	struct dmprec *r;
+	u_int drops;
+#ifdef SCHED_IDLE
+	struct sched_param sp;
+	
+	memset(&sp, 0, sizeof(sp));
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+#endif
+	
+	while (1) {
+		r = dmpr_peek(&conring);
+		if (r == NULL) {
+			fflush(stdout);
+			dmpr_wait(&conring, NULL);
+			continue;
+		}
+		
+		drops = __atomic_load_n(&conring.drops, __ATOMIC_RELAXED);
+		if (drops != con_skipped) {
+			printf("\n\033[31m(%u frames skipped)\033[0m\n", 
+			    drops - con_skipped);
+			con_skipped = drops;
+		}
+		
+		dmp_show(r);
+		dmpr_release(&conring, r);
+	}
+	
+	return NULL;
+}
+
+static void dmp_start(void)
+{
+	pthread_t tid;
+	
+	if (!dmpr_init(&conring, DMP_CONRING, DMP_CONRECSIZE))
+		return;
+	if (pthread_create(&tid, NULL, pth_decode, NULL) != 0) {
+		dmpr_free(&conring);
+		return;
+	}
+	pthread_detach(tid);
+	con_ok = 1;
+}
+
+/* 
+ * called from the data plane, only a snapshot of the frame is taken, 
+ * the decoder prints it later
+ */
+int dmp_packet(const struct packet *m, const int flag)
+{
+	struct dmprec *r;
+	int maxlen;
+	
+	if (flag == 0)
+		return flag;
+	
+	pthread_once(&con_once, dmp_start);
+	if (!con_ok || m->len < 14)
+		return 0;
+	
+	r = dmpr_claim(&conring);
+	if (r == NULL)
+		return 0;
+	
+	maxlen = conring.recsize - sizeof(struct dmprec);
+	r->len = m->len;
+	r->caplen = (m->len > maxlen) ? maxlen : m->len;
+	r->flag = flag;
+	dmpr_stamp(m, &r->ts);
+	memcpy(r->data, m->data, r->caplen);
+	dmpr_commit(&conring, r);
 	
 	return 1;
 }
 
+/* the frames the decoder could not keep up with */
+u_int dmp_skipped(void)
+{
+	if (!con_ok)
+		return 0;
+	return __atomic_load_n(&conring.drops, __ATOMIC_RELAXED);
+}
+
 static void dmp_arp(void *dat)
 {
 	vpcs_arphdr *ah = (vpcs_arphdr *)dat;
@@ -548,85 +645,468 @@ dmp_dns_timestr(u_int s)
 	return buf;
 }
 
-FILE *
-open_dmpfile(const char *fname)
+/*
+ * the record ring, a ticket (seq) per record: seq == pos, free for the 
+ * producer of the lap; seq == pos + 1, ready for the consumer.
+ */
+static struct dmprec *dmpr_rec(struct dmpring *ring, u_int i)
+{
+	return (struct dmprec *)(ring->recs + 
+	    (i & (ring->nrec - 1)) * ring->recsize);
+}
+
+static int dmpr_init(struct dmpring *ring, int nrec, int recsize)
+{
+	u_int i;
+	
+	ring->recs = malloc(nrec * recsize);
+	if (ring->recs == NULL)
+		return 0;
+	ring->nrec = nrec;
+	ring->recsize = recsize;
+	ring->head = ring->tail = ring->drops = 0;
+	ring->waiting = 0;
+	for (i = 0; i < nrec; i++)
+		dmpr_rec(ring, i)->seq = i;
+	
+	pthread_mutex_init(&ring->locker, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	
+	return 1;
+}
+
+static void dmpr_free(struct dmpring *ring)
+{
+	pthread_mutex_destroy(&ring->locker);
+	pthread_cond_destroy(&ring->cond);
+	free(ring->recs);
+	ring->recs = NULL;
+}
+
+/* claim a record by the ticket, NULL if the consumer is a lap behind */
+static struct dmprec *dmpr_claim(struct dmpring *ring)
+{
+	struct dmprec *r;
+	u_int pos, seq;
+	
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	while (1) {
+		r = dmpr_rec(ring, pos);
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, 
+			    pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int)(seq - pos) < 0) {
+			__atomic_add_fetch(&ring->drops, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+	
+	return r;
+}
+
+/* hand the filled record to the consumer */
+static void dmpr_commit(struct dmpring *ring, struct dmprec *r)
+{
+	__atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+	
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&ring->locker);
+		pthread_cond_signal(&ring->cond);
+		pthread_mutex_unlock(&ring->locker);
+	}
+}
+
+static struct dmprec *dmpr_peek(struct dmpring *ring)
+{
+	struct dmprec *r = dmpr_rec(ring, ring->head);
+	
+	if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != ring->head + 1)
+		return NULL;
+	return r;
+}
+
+/* the record is free for the lap after the next */
+static void dmpr_release(struct dmpring *ring, struct dmprec *r)
+{
+	__atomic_store_n(&r->seq, ring->head + ring->nrec, __ATOMIC_RELEASE);
+	ring->head++;
+}
+
+/* idle, the producers wake it up, or DMP_WAIT later */
+static void dmpr_wait(struct dmpring *ring, const int *stop)
+{
+	struct timespec ts;
+	
+	pthread_mutex_lock(&ring->locker);
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+	if (dmpr_peek(ring) == NULL && (stop == NULL || !*stop)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += DMP_WAIT * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&ring->cond, &ring->locker, &ts);
+	}
+	__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ring->locker);
+}
+
+/* the frame is stamped with the time it was received or queued */
+static void dmpr_stamp(const struct packet *m, struct timespec *ts)
+{
+	if (m != NULL && m->ts.tv_sec != 0) {
+		ts->tv_sec = m->ts.tv_sec;
+		ts->tv_nsec = m->ts.tv_usec * 1000;
+	} else
+		clock_gettime(CLOCK_REALTIME, ts);
+}
+
+/* open the next file of the capture, prefix_yyyymmddHHMMSS[_n].pcap */
+static int dmp_open(struct dmpfile *df)
 {
-	char tfname[1024];
-	FILE *fp;
 	pcap_hdr_t phdr;
 	time_t t0;
 	struct tm *tm;
-				
+	
 	t0 = time(0);
 	tm = localtime(&t0);
-		
-	snprintf(tfname, sizeof(tfname), "%s_%4d%02d%02d%02d%02d%02d.pcap", 
-	    fname, tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, 
-	    tm->tm_hour, tm->tm_min, tm->tm_sec);
-				    
-	fp = fopen(tfname, "ab");
-	if (!fp)
-		return NULL;
-        		
-	phdr.magic_number = 0xa1b2c3d4;
+	
+	if (df->files == 0)
+		snprintf(df->fname, sizeof(df->fname), 
+		    "%s_%4d%02d%02d%02d%02d%02d.pcap", df->prefix, 
+		    tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, 
+		    tm->tm_hour, tm->tm_min, tm->tm_sec);
+	else
+		snprintf(df->fname, sizeof(df->fname), 
+		    "%s_%4d%02d%02d%02d%02d%02d_%d.pcap", df->prefix, 
+		    tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, 
+		    tm->tm_hour, tm->tm_min, tm->tm_sec, df->files);
+	
+	df->fp = fopen(df->fname, "wb");
+	if (!df->fp)
+		return 0;
+	setvbuf(df->fp, NULL, _IOFBF, DMP_BUFSIZE);
+	
+	phdr.magic_number = df->nsec ? PCAP_MAGIC_NS : PCAP_MAGIC;
 	phdr.version_major = 2;
 	phdr.version_minor = 4;
 	phdr.thiszone =  0;
 	phdr.sigfigs = 0;
-	phdr.snaplen = 0xffff;
+	phdr.snaplen = DMP_SNAPLEN;
 	phdr.network = 1;
 	
-	fwrite(&phdr, sizeof(phdr), 1, fp);
-	fflush(fp);
-	return fp;
+	fwrite(&phdr, sizeof(phdr), 1, df->fp);
+	fflush(df->fp);
+	
+	df->opened = t0;
+	df->lastflush = t0;
+	df->size = sizeof(phdr);
+	df->dirty = 0;
+	df->files++;
+	
+	return 1;
 }
 
-void 
-close_dmpfile(FILE *fp)
+/* the frames are dropped and counted if the next file can not be opened */
+static void dmp_rotate(struct dmpfile *df)
 {
-	fclose(fp);
+	fclose(df->fp);
+	df->fp = NULL;
+	if (!dmp_open(df))
+		printf("Can not open %s: %s, the frames are dropped\n", 
+		    df->fname, strerror(errno));
 }
 
-int 
-dmp_packet2file(const struct packet *m, FILE *fp)
+/* write the ready records, return the count */
+static int dmp_drain(struct dmpfile *df)
 {
+	struct dmprec *r;
 	pcaprec_hdr_t phdr;
-	struct timeval ts;
+	int n = 0;
 	
-	gettimeofday(&(ts), (void*)0);
+	while ((r = dmpr_peek(&df->ring)) != NULL) {
+		if (df->fp != NULL) {
+			phdr.ts_sec = r->ts.tv_sec;
+			phdr.ts_usec = df->nsec ? r->ts.tv_nsec : 
+			    r->ts.tv_nsec / 1000;
+			phdr.incl_len = r->caplen;
+			phdr.orig_len = r->len;
+			fwrite(&phdr, sizeof(phdr), 1, df->fp);
+			fwrite(r->data, r->caplen, 1, df->fp);
+			df->size += sizeof(phdr) + r->caplen;
+			df->frames++;
+			df->dirty = 1;
+		} else
+			__atomic_add_fetch(&df->ring.drops, 1, __ATOMIC_RELAXED);
+		
+		dmpr_release(&df->ring, r);
+		n++;
+		
+		if (df->fp != NULL && df->maxsize && 
+		    df->size >= (u_long)df->maxsize << 20)
+			dmp_rotate(df);
+	}
 	
-	phdr.ts_sec = ts.tv_sec;
-	phdr.ts_usec = ts.tv_usec;
-	phdr.incl_len = m->len;
-	phdr.orig_len = m->len;
+	return n;
+}
+
+static void *pth_dump(void *arg)
+{
+	struct dmpfile *df = arg;
+	time_t now;
 	
-	fwrite(&phdr, sizeof(phdr), 1, fp);
-	fwrite(m->data, m->len, 1, fp);
-	fflush(fp);
+	while (1) {
+		if (dmp_drain(df) > 0)
+			continue;
+		if (__atomic_load_n(&df->stop, __ATOMIC_ACQUIRE))
+			break;
+		
+		now = time(0);
+		if (df->fp != NULL && df->dirty && 
+		    now - df->lastflush >= DMP_FLUSH) {
+			fflush(df->fp);
+			df->lastflush = now;
+			df->dirty = 0;
+		}
+		/* no empty files */
+		if (df->fp != NULL && df->maxtime && 
+		    df->size > sizeof(pcap_hdr_t) && 
+		    now - df->opened >= df->maxtime)
+			dmp_rotate(df);
+		
+		dmpr_wait(&df->ring, &df->stop);
+	}
+	
+	if (df->fp != NULL)
+		fclose(df->fp);
+	df->fp = NULL;
+	
+	return NULL;
+}
+
+/* copy the frame and hand it to the writer, dropped if the ring is full */
+static int dmp_put(struct dmpfile *df, const char *data, int len, 
+    const struct timespec *ts)
+{
+	struct dmprec *r;
+	
+	if (df == NULL || len <= 0)
+		return 0;
+	
+	r = dmpr_claim(&df->ring);
+	if (r == NULL)
+		return 0;
+	
+	r->len = len;
+	r->caplen = (len > DMP_SNAPLEN) ? DMP_SNAPLEN : len;
+	r->flag = DMP_FILE;
+	r->ts = *ts;
+	memcpy(r->data, data, r->caplen);
+	dmpr_commit(&df->ring, r);
 	
-	return 0;
+	return 1;
+}
+
+struct dmpfile *
+open_dmpfile(const char *fname, int nsec)
+{
+	struct dmpfile *df;
+	
+	df = calloc(1, sizeof(struct dmpfile));
+	if (df == NULL)
+		return NULL;
+	if (!dmpr_init(&df->ring, DMP_RING, DMP_RECSIZE)) {
+		free(df);
+		return NULL;
+	}
+	
+	snprintf(df->prefix, sizeof(df->prefix), "%s", fname);
+	df->nsec = nsec;
+	if (!dmp_open(df))
+		goto err;
+	
+	if (pthread_create(&df->tid, NULL, pth_dump, df) != 0) {
+		fclose(df->fp);
+		goto err;
+	}
+	
+	return df;
+
+err:
+	dmpr_free(&df->ring);
+	free(df);
+	return NULL;
+}
+
+/* the producers are gone, save what is left and close the file */
+void 
+close_dmpfile(struct dmpfile *df)
+{
+	if (df == NULL)
+		return;
+	
+	pthread_mutex_lock(&df->ring.locker);
+	__atomic_store_n(&df->stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&df->ring.cond);
+	pthread_mutex_unlock(&df->ring.locker);
+	pthread_join(df->tid, NULL);
+	
+	dmpr_free(&df->ring);
+	free(df);
 }
 
 int 
-dmp_buffer2file(const char *m, int len, FILE *fp)
+dmp_packet2file(const struct packet *m, struct dmpfile *df)
 {
-	pcaprec_hdr_t phdr;
-	struct timeval ts;
+	struct timespec ts;
 	
-	gettimeofday(&(ts), (void*)0);
+	dmpr_stamp(m, &ts);
 	
-	phdr.ts_sec = ts.tv_sec;
-	phdr.ts_usec = ts.tv_usec;
-	phdr.incl_len = len;
-	phdr.orig_len = len;
+	return dmp_put(df, m->data, m->len, &ts);
+}
+
+int 
+dmp_buffer2file(const char *m, int len, struct dmpfile *df)
+{
+	struct timespec ts;
 	
-	if (!fp)
+	clock_gettime(CLOCK_REALTIME, &ts);
+	
+	return dmp_put(df, m, len, &ts);
+}
+
+struct capring *
+cap_open(void)
+{
+	return calloc(1, sizeof(struct capring));
+}
+
+void 
+cap_close(struct capring *cr)
+{
+	free(cr);
+}
+
+/* 
+ * seqlock per slot, the writer clears seq, copies the frame, then sets 
+ * seq to its ticket + 1, the reader takes the slot only if seq is the 
+ * same before and after the copy
+ */
+static void cap_put(struct capring *cr, const char *data, int len, 
+    const struct timeval *tv)
+{
+	struct caprec *r;
+	u_int t;
+	
+	if (cr == NULL || len <= 0)
+		return;
+	
+	t = __atomic_fetch_add(&cr->tail, 1, __ATOMIC_RELAXED);
+	r = &cr->recs[t & (CAP_FRAMES - 1)];
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	r->len = len;
+	r->caplen = (len > CAP_SNAPLEN) ? CAP_SNAPLEN : len;
+	if (tv != NULL && tv->tv_sec != 0)
+		r->ts = *tv;
+	else
+		gettimeofday(&r->ts, 0);
+	memcpy(r->data, data, r->caplen);
+	
+	__atomic_store_n(&r->seq, t + 1, __ATOMIC_RELEASE);
+}
+
+void 
+cap_packet(struct capring *cr, const struct packet *m)
+{
+	cap_put(cr, m->data, m->len, &m->ts);
+}
+
+void 
+cap_buffer(struct capring *cr, const char *buf, int len)
+{
+	cap_put(cr, buf, len, NULL);
+}
+
+/* the frames held */
+int 
+cap_count(struct capring *cr)
+{
+	u_int t;
+	
+	if (cr == NULL)
 		return 0;
+	t = __atomic_load_n(&cr->tail, __ATOMIC_RELAXED);
+	
+	return (t > CAP_FRAMES) ? CAP_FRAMES : t;
+}
 
+/* 
+ * save the frames held, the oldest first, to fname_yyyymmddHHMMSS.pcap, 
+ * return the count of the frames, -1 if the file could not be opened
+ */
+int 
+cap_flush(struct capring *cr, const char *fname, char *saved, int size)
+{
+	struct caprec rec, *r;
+	pcap_hdr_t phdr;
+	pcaprec_hdr_t rhdr;
+	FILE *fp;
+	time_t t0;
+	struct tm *tm;
+	u_int t, i, seq;
+	int n = 0;
+	
+	if (cr == NULL)
+		return -1;
+	
+	t0 = time(0);
+	tm = localtime(&t0);
+	snprintf(saved, size, "%s_%4d%02d%02d%02d%02d%02d.pcap", fname, 
+	    tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, 
+	    tm->tm_hour, tm->tm_min, tm->tm_sec);
+	fp = fopen(saved, "wb");
+	if (fp == NULL)
+		return -1;
+	
+	phdr.magic_number = PCAP_MAGIC;
+	phdr.version_major = 2;
+	phdr.version_minor = 4;
+	phdr.thiszone =  0;
+	phdr.sigfigs = 0;
+	phdr.snaplen = CAP_SNAPLEN;
+	phdr.network = 1;
 	fwrite(&phdr, sizeof(phdr), 1, fp);
-	fwrite(m, len, 1, fp);
-	fflush(fp);
 	
-	return 0;	
+	t = __atomic_load_n(&cr->tail, __ATOMIC_ACQUIRE);
+	i = (t > CAP_FRAMES) ? t - CAP_FRAMES : 0;
+	for (; i != t; i++) {
+		r = &cr->recs[i & (CAP_FRAMES - 1)];
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		if (seq != i + 1)
+			continue;
+		memcpy(&rec, r, sizeof(rec));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		/* overwritten while being copied */
+		if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		
+		rhdr.ts_sec = rec.ts.tv_sec;
+		rhdr.ts_usec = rec.ts.tv_usec;
+		rhdr.incl_len = rec.caplen;
+		rhdr.orig_len = rec.len;
+		fwrite(&rhdr, sizeof(rhdr), 1, fp);
+		fwrite(rec.data, rec.caplen, 1, fp);
+		n++;
+	}
+	fclose(fp);
 	
+	return n;
 }
+
+/* end of file */
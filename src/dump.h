@@ -28,7 +28,10 @@
 #define _DUMP_H_
 
 #include <sys/types.h>
-
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 #include "queue.h"
 
@@ -49,11 +52,125 @@ typedef struct pcaprec_hdr_s {
         u_int orig_len;       /* actual length of packet */
 } pcaprec_hdr_t;
 
+#define PCAP_MAGIC	0xa1b2c3d4
+#define PCAP_MAGIC_NS	0xa1b23c4d	/* ts_usec holds nanoseconds */
+
+/*
+ * record ring
+ *
+ * The readers and the writers of the VPCs copy the frames into a ring of
+ * records and go on, a record is claimed by a ticket, no lock is taken.
+ * A frame is dropped and counted if the ring is full, the data plane 
+ * never waits for the consumer thread.
+ */
+struct dmprec {
+	u_int seq;			/* ticket */
+	int len;			/* of the frame */
+	int caplen;			/* saved */
+	int flag;			/* DMP_xxx, console */
+	struct timespec ts;
+	char data[0];
+};
+
+struct dmpring {
+	u_int head __attribute__((aligned(CACHELINE_SIZE)));	/* consumer */
+	u_int tail __attribute__((aligned(CACHELINE_SIZE)));	/* producers */
+	u_int drops;			/* ring full, or no file */
+	
+	char *recs __attribute__((aligned(CACHELINE_SIZE)));
+	int nrec;			/* a power of 2 */
+	int recsize;
+	int waiting;			/* the consumer sleeps on cond */
+	pthread_mutex_t locker;
+	pthread_cond_t cond;
+};
+
+#define DMP_WAIT	100		/* msec, the consumers sleep at most */
+
+/*
+ * pcap file writer
+ *
+ * The writer thread of the file drains its ring into a large stdio 
+ * buffer, which is flushed when it is full or the ring has been idle 
+ * for DMP_FLUSH seconds. The file is rotated when it grows over maxsize
+ * MB or gets older than maxtime seconds.
+ */
+#define DMP_RING	512		/* records */
+#define DMP_RECSIZE	2048
+#define DMP_BUFSIZE	(1 << 20)	/* stdio buffer */
+#define DMP_FLUSH	1		/* sec */
+
+#define DMP_SNAPLEN	(DMP_RECSIZE - (int)sizeof(struct dmprec))
+
+struct dmpfile {
+	struct dmpring ring;
+	int stop;
+	pthread_t tid;
+	
+	char prefix[64];
+	char fname[128];		/* the current file */
+	FILE *fp;
+	int nsec;			/* nanosecond timestamps */
+	u_int maxsize;			/* MB, 0 no limit */
+	u_int maxtime;			/* sec, 0 no limit */
+	
+	/* the writer's */
+	time_t opened;
+	time_t lastflush;
+	u_long size;			/* of the current file */
+	u_long frames;			/* saved */
+	u_int files;			/* rotated */
+	int dirty;
+};
+
+/*
+ * console dump
+ *
+ * dmp_packet only takes a snapshot of the frame into one ring shared by
+ * all the VPCs, the decoder thread formats and prints them at a low
+ * priority. The frames are skipped if the terminal falls behind, the 
+ * count is printed when it catches up.
+ */
+#define DMP_CONRING	256		/* records */
+#define DMP_CONRECSIZE	2048		/* a frame of PKT_MAXSIZE fits */
+
+/*
+ * flight recorder
+ *
+ * Every VPC and the relay keep the last CAP_FRAMES frames, the first 
+ * CAP_SNAPLEN bytes of each, all the time. The slots are overwritten in 
+ * turn without any lock, 'dump flush' saves them to a pcap file. The ring
+ * of a VPC is set up by its first frame and freed by 'dump off'.
+ */
+#define CAP_FRAMES	1024		/* a power of 2 */
+#define CAP_SNAPLEN	256
+
+struct caprec {
+	u_int seq;			/* ticket + 1, 0 being written */
+	int len;
+	int caplen;
+	struct timeval ts;
+	char data[CAP_SNAPLEN];
+};
+
+struct capring {
+	u_int tail;			/* tickets */
+	struct caprec recs[CAP_FRAMES];
+};
+
+struct capring *cap_open(void);
+void cap_close(struct capring *cr);
+void cap_packet(struct capring *cr, const struct packet *m);
+void cap_buffer(struct capring *cr, const char *buf, int len);
+int cap_count(struct capring *cr);
+int cap_flush(struct capring *cr, const char *fname, char *saved, int size);
+
 int dmp_packet(const struct packet *m, const int flag);
+u_int dmp_skipped(void);
 
-FILE *open_dmpfile(const char *fname);
-void close_dmpfile(FILE *fp);
-int dmp_packet2file(const struct packet *m, FILE *fp);
-int dmp_buffer2file(const char *m, int len, FILE *fp);
+struct dmpfile *open_dmpfile(const char *fname, int nsec);
+void close_dmpfile(struct dmpfile *df);
+int dmp_packet2file(const struct packet *m, struct dmpfile *df);
+int dmp_buffer2file(const char *m, int len, struct dmpfile *df);
 
 #endif
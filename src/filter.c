@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "ip.h"
+#include "filter.h"
+#include "utils.h"
+
+enum {
+	FLT_ETHER = 1,			/* ethertype */
+	FLT_L4,				/* ip/ip6 next protocol */
+	FLT_HOST4,
+	FLT_HOST6,
+	FLT_NET4,
+	FLT_PORT,			/* tcp or udp */
+};
+
+#define FLT_SRC		0x1
+#define FLT_DST		0x2
+#define FLT_ANY		(FLT_SRC | FLT_DST)
+
+#define FLT_MAXTOK	64
+#define FLT_TOKLEN	48
+
+/* the parse tree, only while compiling */
+enum { N_LEAF, N_AND, N_OR, N_NOT };
+
+struct fltnode {
+	int type;
+	int l, r;			/* children, index */
+	struct fltins ins;		/* N_LEAF */
+};
+
+struct fltparser {
+	char tok[FLT_MAXTOK][FLT_TOKLEN];
+	int ntok;
+	int pos;
+	struct fltnode node[2 * FLT_MAXINS];
+	int nnode;
+	struct dmpfilter *flt;
+	char *err;
+	int errlen;
+};
+
+/* the fields of a frame the tests look at, taken once */
+struct fltpkt {
+	int type;			/* ethertype */
+	int proto;			/* l4, -1 if none */
+	u_int src4, dst4;
+	const ip6 *src6, *dst6;
+	int ports;			/* the ports below are valid */
+	u_short sport, dport;
+};
+
+static struct {
+	const char *name;
+	int op;
+	int arg;
+} protos[] = {
+	{"arp",		FLT_ETHER,	ETHERTYPE_ARP},
+	{"ip",		FLT_ETHER,	ETHERTYPE_IP},
+	{"ip6",		FLT_ETHER,	ETHERTYPE_IPV6},
+	{"tcp",		FLT_L4,		IPPROTO_TCP},
+	{"udp",		FLT_L4,		IPPROTO_UDP},
+	{"icmp",	FLT_L4,		IPPROTO_ICMP},
+	{"icmp6",	FLT_L4,		IPPROTO_ICMPV6},
+	{NULL,		0,		0}
+};
+
+static int expr(struct fltparser *p);
+
+static int flt_error(struct fltparser *p, const char *msg, const char *tok)
+{
+	if (p->err[0] == '\0')
+		snprintf(p->err, p->errlen, "%s%s%s%s", msg, 
+		    tok ? " '" : "", tok ? tok : "", tok ? "'" : "");
+	return -1;
+}
+
+/* split the words, the parentheses and ! stand alone */
+static int flt_lex(struct fltparser *p, const char *s)
+{
+	int n;
+	
+	p->ntok = 0;
+	while (*s) {
+		if (isspace((u_char)*s)) {
+			s++;
+			continue;
+		}
+		if (p->ntok == FLT_MAXTOK)
+			return flt_error(p, "expression too long", NULL);
+		
+		n = 0;
+		if (*s == '(' || *s == ')' || (*s == '!' && s[1] != '=')) {
+			p->tok[p->ntok][n++] = *s++;
+		} else if ((s[0] == '&' && s[1] == '&') || 
+		    (s[0] == '|' && s[1] == '|')) {
+			p->tok[p->ntok][n++] = *s++;
+			p->tok[p->ntok][n++] = *s++;
+		} else {
+			while (*s && !isspace((u_char)*s) && *s != '(' && 
+			    *s != ')' && *s != '!' && *s != '&' && *s != '|') {
+				if (n == FLT_TOKLEN - 1)
+					return flt_error(p, "word too long", NULL);
+				p->tok[p->ntok][n++] = *s++;
+			}
+			if (n == 0)
+				return flt_error(p, "unexpected", s);
+		}
+		p->tok[p->ntok++][n] = '\0';
+	}
+	
+	return 0;
+}
+
+static const char *peek(struct fltparser *p)
+{
+	return (p->pos < p->ntok) ? p->tok[p->pos] : NULL;
+}
+
+static int accept_tok(struct fltparser *p, const char *a, const char *b)
+{
+	const char *t = peek(p);
+	
+	if (t == NULL || (strcmp(t, a) && (b == NULL || strcmp(t, b))))
+		return 0;
+	p->pos++;
+	
+	return 1;
+}
+
+static int new_node(struct fltparser *p, int type, int l, int r)
+{
+	struct fltnode *n;
+	
+	if (p->nnode == 2 * FLT_MAXINS)
+		return flt_error(p, "expression too long", NULL);
+	n = &p->node[p->nnode];
+	memset(n, 0, sizeof(struct fltnode));
+	n->type = type;
+	n->l = l;
+	n->r = r;
+	
+	return p->nnode++;
+}
+
+static int leaf(struct fltparser *p, int op, int dir)
+{
+	int i = new_node(p, N_LEAF, -1, -1);
+	
+	if (i < 0)
+		return -1;
+	p->node[i].ins.op = op;
+	p->node[i].ins.dir = dir;
+	
+	return i;
+}
+
+/* [src|dst] host addr | [src|dst] port num | [src|dst] net addr/len */
+static int qualified(struct fltparser *p)
+{
+	const char *t, *v;
+	char addr[FLT_TOKLEN], *slash;
+	int dir = FLT_ANY;
+	int i, len;
+	
+	if (accept_tok(p, "src", NULL))
+		dir = FLT_SRC;
+	else if (accept_tok(p, "dst", NULL))
+		dir = FLT_DST;
+	
+	t = peek(p);
+	if (t == NULL)
+		return flt_error(p, "missing host, net or port", NULL);
+	if (!strcmp(t, "host") || !strcmp(t, "net") || !strcmp(t, "port"))
+		p->pos++;
+	else if (dir != FLT_ANY)
+		t = "host";			/* src 10.1.1.1 */
+	else
+		return flt_error(p, "unknown primitive", t);
+	
+	v = peek(p);
+	if (v == NULL)
+		return flt_error(p, "missing value of", t);
+	p->pos++;
+	
+	if (!strcmp(t, "port")) {
+		if (!digitstring(v) || atoi(v) > 65535)
+			return flt_error(p, "invalid port", v);
+		if ((i = leaf(p, FLT_PORT, dir)) < 0)
+			return -1;
+		p->node[i].ins.a32[0] = htons(atoi(v));
+		return i;
+	}
+	
+	if (!strcmp(t, "net")) {
+		snprintf(addr, sizeof(addr), "%s", v);
+		len = 32;
+		if ((slash = strchr(addr, '/')) != NULL) {
+			*slash++ = '\0';
+			if (!digitstring(slash) || atoi(slash) > 32)
+				return flt_error(p, "invalid prefix length", v);
+			len = atoi(slash);
+		} else if ((t = peek(p)) != NULL && digitstring(t) && 
+		    atoi(t) <= 32) {
+			/* the console splits 10.1.1.0/24 in two */
+			len = atoi(t);
+			p->pos++;
+		}
+		if ((i = leaf(p, FLT_NET4, dir)) < 0)
+			return -1;
+		if (inet_pton(AF_INET, addr, p->node[i].ins.a32) != 1)
+			return flt_error(p, "invalid network", v);
+		p->node[i].ins.mask = len ? htonl(0xffffffff << (32 - len)) : 0;
+		p->node[i].ins.a32[0] &= p->node[i].ins.mask;
+		return i;
+	}
+	
+	if (strchr(v, ':') != NULL) {
+		if ((i = leaf(p, FLT_HOST6, dir)) < 0)
+			return -1;
+		if (inet_pton(AF_INET6, v, p->node[i].ins.a32) != 1)
+			return flt_error(p, "invalid address", v);
+	} else {
+		if ((i = leaf(p, FLT_HOST4, dir)) < 0)
+			return -1;
+		if (inet_pton(AF_INET, v, p->node[i].ins.a32) != 1)
+			return flt_error(p, "invalid address", v);
+	}
+	
+	return i;
+}
+
+/* proto | [proto] qualified */
+static int primitive(struct fltparser *p)
+{
+	const char *t = peek(p);
+	int i, l, r;
+	
+	if (t == NULL)
+		return flt_error(p, "unexpected end", NULL);
+	
+	for (i = 0; protos[i].name != NULL; i++) {
+		if (strcmp(t, protos[i].name))
+			continue;
+		p->pos++;
+		if ((l = leaf(p, protos[i].op, FLT_ANY)) < 0)
+			return -1;
+		p->node[l].ins.a32[0] = protos[i].arg;
+		
+		/* tcp port 80 is tcp and port 80 */
+		t = peek(p);
+		if (t == NULL || (strcmp(t, "src") && strcmp(t, "dst") &&
+		    strcmp(t, "host") && strcmp(t, "net") && strcmp(t, "port")))
+			return l;
+		if ((r = qualified(p)) < 0)
+			return -1;
+		return new_node(p, N_AND, l, r);
+	}
+	
+	return qualified(p);
+}
+
+static int factor(struct fltparser *p)
+{
+	int l;
+	
+	if (accept_tok(p, "not", "!")) {
+		if ((l = factor(p)) < 0)
+			return -1;
+		return new_node(p, N_NOT, l, -1);
+	}
+	if (accept_tok(p, "(", NULL)) {
+		if ((l = expr(p)) < 0)
+			return -1;
+		if (!accept_tok(p, ")", NULL))
+			return flt_error(p, "missing )", NULL);
+		return l;
+	}
+	
+	return primitive(p);
+}
+
+static int term(struct fltparser *p)
+{
+	int l, r;
+	
+	if ((l = factor(p)) < 0)
+		return -1;
+	while (accept_tok(p, "and", "&&")) {
+		if ((r = factor(p)) < 0)
+			return -1;
+		if ((l = new_node(p, N_AND, l, r)) < 0)
+			return -1;
+	}
+	
+	return l;
+}
+
+static int expr(struct fltparser *p)
+{
+	int l, r;
+	
+	if ((l = term(p)) < 0)
+		return -1;
+	while (accept_tok(p, "or", "||")) {
+		if ((r = term(p)) < 0)
+			return -1;
+		if ((l = new_node(p, N_OR, l, r)) < 0)
+			return -1;
+	}
+	
+	return l;
+}
+
+/*
+ * emit the tests of node n, which go on to t if it holds, to f if not.
+ * the second operand is emitted first, so every jump goes backward to
+ * a test already in place, return the entry.
+ */
+static int gen(struct fltparser *p, int n, int t, int f)
+{
+	struct fltnode *nd = &p->node[n];
+	struct dmpfilter *flt = p->flt;
+	int e;
+	
+	switch (nd->type) {
+		case N_AND:
+			if ((e = gen(p, nd->r, t, f)) == -100)
+				return e;
+			return gen(p, nd->l, e, f);
+		case N_OR:
+			if ((e = gen(p, nd->r, t, f)) == -100)
+				return e;
+			return gen(p, nd->l, t, e);
+		case N_NOT:
+			return gen(p, nd->l, f, t);
+	}
+	
+	if (flt->ninsn == FLT_MAXINS) {
+		flt_error(p, "expression too long", NULL);
+		return -100;
+	}
+	flt->insn[flt->ninsn] = nd->ins;
+	flt->insn[flt->ninsn].jt = t;
+	flt->insn[flt->ninsn].jf = f;
+	
+	return flt->ninsn++;
+}
+
+struct dmpfilter *filter_compile(int argc, char **argv, char *err, 
+    int errlen)
+{
+	struct fltparser *p;
+	struct dmpfilter *flt;
+	int i, n, off = 0;
+	
+	err[0] = '\0';
+	flt = calloc(1, sizeof(struct dmpfilter));
+	p = calloc(1, sizeof(struct fltparser));
+	if (flt == NULL || p == NULL) {
+		snprintf(err, errlen, "out of memory");
+		goto err;
+	}
+	p->err = err;
+	p->errlen = errlen;
+	p->flt = flt;
+	
+	for (i = 0; i < argc; i++) {
+		n = snprintf(flt->text + off, FLT_MAXTEXT - off, "%s%s", 
+		    i ? " " : "", argv[i]);
+		if (n >= FLT_MAXTEXT - off) {
+			snprintf(err, errlen, "expression too long");
+			goto err;
+		}
+		off += n;
+	}
+	
+	if (flt_lex(p, flt->text) < 0)
+		goto err;
+	if (p->ntok == 0) {
+		snprintf(err, errlen, "empty expression");
+		goto err;
+	}
+	if ((n = expr(p)) < 0)
+		goto err;
+	if (p->pos != p->ntok) {
+		flt_error(p, "unexpected", p->tok[p->pos]);
+		goto err;
+	}
+	flt->entry = gen(p, n, FLT_ACCEPT, FLT_REJECT);
+	if (flt->entry == -100)
+		goto err;
+	
+	free(p);
+	return flt;
+	
+err:
+	free(p);
+	free(flt);
+	return NULL;
+}
+
+void filter_free(struct dmpfilter *flt)
+{
+	free(flt);
+}
+
+static void flt_fields(const struct packet *m, struct fltpkt *fp)
+{
+	const ethdr *eh = (const ethdr *)m->data;
+	const u_short *ports = NULL;
+	int hlen = 0;
+	
+	memset(fp, 0, sizeof(struct fltpkt));
+	fp->proto = -1;
+	if (m->len < (int)sizeof(ethdr))
+		return;
+	fp->type = ntohs(eh->type);
+	
+	if (fp->type == ETHERTYPE_IP && 
+	    m->len >= (int)(sizeof(ethdr) + sizeof(iphdr))) {
+		const iphdr *ip = (const iphdr *)(eh + 1);
+		
+		fp->proto = ip->proto;
+		fp->src4 = ip->sip;
+		fp->dst4 = ip->dip;
+		hlen = ip->ihl << 2;
+		/* the later fragments have no ports */
+		if (!(ntohs(ip->frag) & IP_OFFMASK))
+			ports = (const u_short *)((const char *)ip + hlen);
+		hlen += sizeof(ethdr);
+	} else if (fp->type == ETHERTYPE_IPV6 && 
+	    m->len >= (int)(sizeof(ethdr) + sizeof(ip6hdr))) {
+		const ip6hdr *ip = (const ip6hdr *)(eh + 1);
+		
+		fp->proto = ip->ip6_nxt;
+		fp->src6 = &ip->src;
+		fp->dst6 = &ip->dst;
+		ports = (const u_short *)(ip + 1);
+		hlen = sizeof(ethdr) + sizeof(ip6hdr);
+	} else if (fp->type == ETHERTYPE_ARP && 
+	    m->len >= (int)(sizeof(ethdr) + sizeof(vpcs_arphdr))) {
+		const vpcs_arphdr *ah = (const vpcs_arphdr *)(eh + 1);
+		
+		memcpy(&fp->src4, ah->sip, 4);
+		memcpy(&fp->dst4, ah->dip, 4);
+	}
+	
+	if (ports != NULL && (fp->proto == IPPROTO_TCP || 
+	    fp->proto == IPPROTO_UDP) && m->len >= hlen + 4) {
+		fp->ports = 1;
+		fp->sport = ports[0];
+		fp->dport = ports[1];
+	}
+}
+
+static int flt_test(const struct fltins *ins, const struct fltpkt *fp)
+{
+	int v4 = (fp->type == ETHERTYPE_IP || fp->type == ETHERTYPE_ARP);
+	
+	switch (ins->op) {
+		case FLT_ETHER:
+			return (fp->type == ins->a32[0]);
+		case FLT_L4:
+			return (fp->proto == ins->a32[0]);
+		case FLT_HOST4:
+			return v4 && (((ins->dir & FLT_SRC) && 
+			    fp->src4 == ins->a32[0]) || 
+			    ((ins->dir & FLT_DST) && fp->dst4 == ins->a32[0]));
+		case FLT_NET4:
+			return v4 && (((ins->dir & FLT_SRC) && 
+			    (fp->src4 & ins->mask) == ins->a32[0]) || 
+			    ((ins->dir & FLT_DST) && 
+			    (fp->dst4 & ins->mask) == ins->a32[0]));
+		case FLT_HOST6:
+			return (fp->src6 != NULL) && (((ins->dir & FLT_SRC) && 
+			    !memcmp(fp->src6, ins->a32, 16)) || 
+			    ((ins->dir & FLT_DST) && 
+			    !memcmp(fp->dst6, ins->a32, 16)));
+		case FLT_PORT:
+			return fp->ports && (((ins->dir & FLT_SRC) && 
+			    fp->sport == ins->a32[0]) || 
+			    ((ins->dir & FLT_DST) && fp->dport == ins->a32[0]));
+	}
+	
+	return 0;
+}
+
+/* run the tests from the entry till a verdict */
+int filter_match(const struct dmpfilter *flt, const struct packet *m)
+{
+	const struct fltins *ins;
+	struct fltpkt fp;
+	int pc;
+	
+	flt_fields(m, &fp);
+	for (pc = flt->entry; pc >= 0; ) {
+		ins = &flt->insn[pc];
+		pc = flt_test(ins, &fp) ? ins->jt : ins->jf;
+	}
+	
+	return (pc == FLT_ACCEPT);
+}
+
+/* end of file */
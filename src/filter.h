@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include "queue.h"
+
+/*
+ * dump filter
+ *
+ * A subset of the pcap filter language:
+ *
+ *   expr   := term {or term}
+ *   term   := factor {and factor}
+ *   factor := not factor | ( expr ) | prim
+ *   prim   := [proto] [src|dst] host addr | [proto] [src|dst] port num
+ *           | [src|dst] net addr/len | proto
+ *   proto  := ether|arp|ip|ip6|tcp|udp|icmp|icmp6
+ *
+ * 'and', 'or' and 'not' may be written as &&, || and !. The expression
+ * is compiled into a list of tests, every test jumps to the next one 
+ * (or to the verdict) by its outcome, as the BPF does, so a frame runs
+ * only the tests it needs.
+ */
+#define FLT_MAXINS	64		/* tests of an expression */
+#define FLT_MAXTEXT	256
+
+#define FLT_ACCEPT	(-1)
+#define FLT_REJECT	(-2)
+
+struct fltins {
+	int op;
+	int dir;			/* FLT_SRC, FLT_DST or both */
+	u_int a32[4];			/* address, port or ethertype */
+	u_int mask;			/* net, ipv4 */
+	int jt;				/* next test if true */
+	int jf;				/* next test if false */
+};
+
+struct dmpfilter {
+	int entry;
+	int ninsn;
+	struct fltins insn[FLT_MAXINS];
+	char text[FLT_MAXTEXT];
+};
+
+struct dmpfilter *filter_compile(int argc, char **argv, char *err, 
+    int errlen);
+int filter_match(const struct dmpfilter *flt, const struct packet *m);
+void filter_free(struct dmpfilter *flt);
+
+#endif
+
+/* end of file */
@@ -30,36 +30,13 @@
 #include <string.h>
 
 #include "queue.h"
+#include "timer.h"
+#include "reass.h"
 #include "frag.h"
 
-extern u_int time_tick;
-
-static struct fraglink *fraglink_head = NULL;
-static pthread_mutex_t fraglink_locker;
-
-#define LIST_LOCK_INIT pthread_mutex_init(&fraglink_locker, NULL)
-#define LIST_LOCK pthread_mutex_lock(&fraglink_locker)
-#define LIST_UNLOCK pthread_mutex_unlock(&fraglink_locker)
-#define LIST_FOREACH(nq) \
-	for ((nq) = fraglink_head; (nq) != NULL; (nq) = (nq)->next)
-
-#define FREE_NODE(n) do { 				\
-	if (n) {					\
-		if ((n) == fraglink_head) 		\
-			fraglink_head = (n)->next;	\
-		else 					\
-			(n)->prev->next = (n)->next;	\
-		free(n);				\
-	} 						\
-} while (0);
-
-#define ADD_NODE(n) do {		\
-	(n)->next = fraglink_head;	\
-	fraglink_head = (n);		\
-} while (0);
-
-
-static struct packet *defrag(struct packet **m0);
+/* the payload starts right after a plain ip header in the datagram */
+#define FRAG_HDRLEN	((int)(sizeof(ethdr) + sizeof(iphdr)))
+#define FRAG_MAXDATA	(65535 - (int)sizeof(iphdr))
 
 struct packet *ipfrag(struct packet *m0, int mtu)
 {
@@ -71,7 +48,7 @@ struct packet *ipfrag(struct packet *m0, int mtu)
 	elen = sizeof(ethdr) + sizeof(iphdr);
 	
 	ip0 = (iphdr *)(m0->data + sizeof(ethdr));
-	if (ntohs(ip0->len) <= mtu)
+	if (ntohs(ip0->len) <= mtu || m0->gso_size)
 		return m0;
 		
 	hlen = ip0->ihl << 2;
@@ -134,185 +111,50 @@ ipfrag_err:
 }
 
 /* 
- * return NULL, the packet is a piece, expired, or invalid.
+ * return NULL, the packet is a piece, or invalid.
  * return packet, all of pieces have been arrived and reassembled.
  */
 struct packet *
-ipreass(struct packet *m)
+ipreass(struct reasstab *rt, struct packet *m)
 {
 	ethdr *eh = (ethdr *)(m->data);
 	iphdr *ip = (iphdr *)(eh + 1);
-	iphdr *ip0;
-	struct fraglink *nq = NULL;
-	struct packet *m0 = NULL, *m2 = NULL;
-	u_short off, off0;
-	int next;
-
-	ip->frag = ntohs(ip->frag);
+	struct packet *m0 = NULL;
+	u_char key[12];
+	int hlen, off, len, mf;
 	
-	LIST_LOCK;
-	LIST_FOREACH(nq) {
-		if (time_tick - nq->expired > 30) {
-			free_pkts(nq->m);
-			FREE_NODE(nq);
-			continue;
-		}
-		
-		if (ip->id != nq->id || ip->proto != nq->proto ||
-		    ip->sip != nq->sip || ip->dip != nq->dip)
-			continue;
-		
-		/* a fragment is existed */
-		if ((ip->frag & IP_MF) == IP_MF)
-			nq->flags |= FF_HEAD;
-		else if ((ip->frag & (~IP_OFFMASK)) == 0)
-			nq->flags |= FF_TAIL;
-
-		off = ip->frag << 3;
-		if (off == 0 && (ip->frag & IP_MF)) {
-			if (!ip->len || (ip->len & 0x7) != 0) {
-				del_pkt(m);
-				free_pkts(nq->m);
-				FREE_NODE(nq);
-				goto ret_null;
-			}
-			m->next = nq->m;
-			nq->m = m;
-		} else {
-			/* Find a segment, insertion sort on singly linked list
-			 */
-			m2 = NULL;
-			for (m0 = nq->m; m0; m2 = m0, m0 = m0->next) {
-				ip0 = (iphdr *)(m0->data + sizeof(ethdr));
-				off0 = ip0->frag << 3;
-				if (off0 > off)
-					break;	
-			}
-			if (m2) {
-				m->next = m2->next;
-				m2->next = m;
-			} else {
-				m->next = nq->m;
-				nq->m = m;
-			}
-		}	
-		nq->nfrags++;
-		/* too many fragments */
-		if (nq->nfrags > 16) {
-			free_pkts(nq->m);
-			FREE_NODE(nq);
-			goto ret_null;
-		}
-		/* the head and tail are arrived, scan the chain 
-		 * Note: overlap is invalid here.
-		 */
-		if (nq->flags == (FF_TAIL | FF_HEAD)) {		
-			for (next = 0, m0 = nq->m; m0; m0 = m0->next) {
-				ip0 = (iphdr *)(m0->data + sizeof(ethdr));
-				off0 = ip0->frag << 3;			
-				if (next < off0)
-					goto ret_null;			
-				/* the last fragment */
-				if ((ip0->len & 0x7) != 0) {					
-					m = nq->m;
-					FREE_NODE(nq);
-					/* copy to single packet buffer
-					 * free the old buffer
-					 */	
-					m = defrag(&m);
-					goto ret;
-				}
-				next += ip0->len;
-			}
-		}
-		goto ret_null;
-	}
-	/* new fragment */
-	nq = (struct fraglink *)malloc(sizeof(struct fraglink));
-	if (!nq)
-		goto ret;
-
-	memset(nq, 0, sizeof(struct fraglink));
-	
-	nq->expired = time_tick;
-	nq->nfrags = 1;
-	nq->proto = ip->proto;
-	nq->id = ip->id;
-	nq->sip = ip->sip;
-	nq->dip = ip->dip;
-	nq->m = m;
-	m->next = NULL;
-	if ((ip->frag & IP_MF) == IP_MF)
-		nq->flags = FF_HEAD;
-	else if ((ip->frag & (~IP_OFFMASK)) == 0)
-		nq->flags = FF_TAIL;
-		
-	ADD_NODE(nq);
+	hlen = ip->ihl << 2;
+	off = (ntohs(ip->frag) & IP_OFFMASK) << 3;
+	mf = ntohs(ip->frag) & IP_MF;
+	len = ntohs(ip->len) - hlen;
 	
+	if (hlen < sizeof(iphdr) || sizeof(ethdr) + hlen + len > m->len) {
+		__atomic_add_fetch(&rt->invalid, 1, __ATOMIC_RELAXED);
+		del_pkt(m);
+		return NULL;
+	}
 	
-ret_null:
-	LIST_UNLOCK;
-	return NULL;
-
-ret:
-	LIST_UNLOCK;
-	return m;	
-}
-
-static struct packet *defrag(struct packet **m0)
-{
-	struct packet *m, *mh, *m2;
-	iphdr *ip;
-	int len;
-	int elen;
-	int off;
+	memcpy(key, &ip->sip, 4);
+	memcpy(key + 4, &ip->dip, 4);
+	memcpy(key + 8, &ip->id, 2);
+	key[10] = ip->proto;
+	key[11] = 4;
 	
-	mh = *m0;	
-	len = 0;
-	while (mh) {
-		ip = (iphdr *)(mh->data + sizeof(ethdr));
-				
-		len += ntohs(ip->len) - sizeof(iphdr);
-		mh = mh->next;
-	}		
-	m = new_pkt(len + sizeof(iphdr) + sizeof(ethdr));
-	if (m == NULL)
-		return *m0;
-
-	mh = *m0;
-	memcpy(m->data, mh->data, mh->len);
-	ip = (iphdr *)(m->data + sizeof(ethdr));
-	ip->len = ntohs(len + sizeof(iphdr));
-	off = mh->len;
-	elen = sizeof(ethdr) + sizeof(iphdr);
-	m2 = mh;
-	mh = mh->next;
-	del_pkt(m2);
-	while (mh) {
-		len = mh->len - elen;
-		memcpy(m->data + off, mh->data + elen, len);
-		off += len;
-		m2 = mh;
-		mh = mh->next;
-		del_pkt(m2);
+	/* the headers of the datagram, without the options */
+	m0 = reass_add(rt, key, sizeof(key), m->data, FRAG_HDRLEN, off, 
+	    (char *)ip + hlen, len, mf, FRAG_MAXDATA);
+	if (m0 != NULL) {
+		m0->ts = m->ts;
+		ip = (iphdr *)(m0->data + sizeof(ethdr));
+		ip->ihl = sizeof(iphdr) >> 2;
+		ip->len = htons(m0->len - sizeof(ethdr));
+		ip->frag = 0;
+		ip->cksum = 0;
+		ip->cksum = cksum((u_short *)ip, sizeof(iphdr));
 	}
-	ip->frag = 0;
-	ip->cksum = 0;
-	ip->cksum = cksum((u_short *)ip, sizeof(iphdr));
+	del_pkt(m);
 	
-	return m;
-}
-
-void init_ipfrag(void)
-{
-	LIST_LOCK_INIT;
+	return m0;
 }
 
-/* */
-#undef LIST_LOCK_INIT
-#undef LIST_LOCK
-#undef LIST_UNLOCK
-#undef LIST_FOREACH
-#undef FREE_NODE_SAFE
-#undef ADD_NODE
 /* end of file */
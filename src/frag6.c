@@ -29,41 +29,12 @@
 #include <pthread.h>
 
 #include "queue.h"
+#include "timer.h"
 #include "ip.h"
 #include "packets6.h"
+#include "reass.h"
 #include "frag6.h"
 
-extern u_int time_tick;
-
-static struct frag6link *frag6link_head = NULL;
-static pthread_mutex_t frag6link_locker;
-
-#define LIST_LOCK_INIT pthread_mutex_init(&frag6link_locker, NULL)
-#define LIST_LOCK pthread_mutex_lock(&frag6link_locker)
-#define LIST_UNLOCK pthread_mutex_unlock(&frag6link_locker)
-#define LIST_FOREACH(nq) \
-	for ((nq) = frag6link_head; (nq) != NULL; (nq) = (nq)->next)
-
-#define FREE_NODE(n) do { 					\
-	if ((n) == frag6link_head) frag6link_head = (n)->next;	\
-	else (n)->prev->next = (n)->next;			\
-	free(n);						\
-} while (0);
-
-#define ADD_NODE(n) do {		\
-	(n)->next = frag6link_head;	\
-	frag6link_head = (n);		\
-} while (0);
-	
-
-static struct packet *defrag6(struct packet **m0);
-
-void
-init_ip6frag(void)
-{
-	LIST_LOCK_INIT;
-}
-
 struct packet *
 ipfrag6(struct packet *m0, int mtu)
 {
@@ -166,17 +137,39 @@ ipfrag6_err:
 	return m0;
 }
 
+/* the next header field pointing to the header at hoff */
+static u_int8_t *ip6nxtfield(ip6hdr *ip, int hoff)
+{
+	u_int8_t *p = &ip->ip6_nxt;
+	ip6eh *eh;
+	int off = sizeof(ip6hdr);
+	
+	while (off < hoff) {
+		eh = (ip6eh *)((char *)ip + off);
+		if (*p == IPPROTO_AH)
+			off += (eh->len + 2) << 2;
+		else
+			off += (eh->len + 1) << 3;
+		p = &eh->nxt;
+	}
+	
+	return p;
+}
+
+/* 
+ * return NULL, the packet is a piece, or invalid.
+ * return packet, all of pieces have been arrived and reassembled.
+ */
 struct packet *
-ipreass6(struct packet *m)
+ipreass6(struct reasstab *rt, struct packet *m)
 {
 	ethdr *eh = (ethdr *)(m->data);
 	ip6hdr *ip = (ip6hdr *)(eh + 1);
-	ip6hdr *ip0;
-	struct frag6link *nq;
-	struct ip6frag *fg = NULL, *fg0 = NULL;
-	struct packet *m0 = NULL, *m2 = NULL;
-	u_short off, off0;
-	int hoff;
+	struct ip6frag *fg;
+	struct packet *m0;
+	u_char key[38];
+	int hoff, off, len, more;
+	u_int8_t nxt;
 	
 	if (ip->ip6_plen == 0)
 		return m;
@@ -187,157 +180,39 @@ ipreass6(struct packet *m)
 	
 	fg = (struct ip6frag *)((char *)ip + hoff);
 	off = ntohs((fg->offlg & IP6F_OFF_MASK));
-	
-	LIST_LOCK;
-	LIST_FOREACH(nq) {
-		if (time_tick - nq->expired > 30) {
-			free_pkts(nq->m);
-			FREE_NODE(nq);
-			continue;
-		}
-		if (fg->ident != nq->id || 
-		    fg->nxt != nq->proto ||
-		    !IP6EQ(&ip->src, &nq->sip) || 
-		    !IP6EQ(&ip->dst, &nq->dip)) {
-			continue;
-		}
-
-		if ((fg->offlg & IP6F_MORE_FRAG) && 
-		    (fg->offlg & IP6F_OFF_MASK) == 0) {
-			nq->flags |= FF_HEAD;
-		}else if ((fg->offlg & IP6F_MORE_FRAG) == 0)
-			nq->flags |= FF_TAIL;
-		
-		/* find a position and insert */
-		m2 = NULL;
-		for (m0 = nq->m; m0; m2 = m0, m0 = m0->next) {
-			ip0 = (ip6hdr *)(m0->data + sizeof(ethdr));
-			hoff = ip6ehdr(ip0, m->len - sizeof(ethdr), 
-			    IPPROTO_FRAGMENT);
-			
-			if (hoff == 0)
-				goto ret;
-	
-			fg0 = (struct ip6frag *)((char *)ip0 + hoff);
-			
-			off0 = ntohs((fg0->offlg & IP6F_OFF_MASK));
-			if (off0 > off)
-				break;	
-		}
-		if (m2) {
-			m->next = m2->next;
-			m2->next = m;
-		} else {
-			m->next = nq->m;
-			nq->m = m;
-		}
-				
-		nq->nfrags++;
-		/* too many fragments */
-		if (nq->nfrags > 16) {
-			free_pkts(nq->m);
-			FREE_NODE(nq);
-			goto ret_null;
-		}
-		/* the head and tail are arrived, scan the chain 
-		 * Note: overlap is invalid here.
-		 */
-		if (nq->flags == (FF_TAIL | FF_HEAD)) {
-			m = nq->m;
-			FREE_NODE(nq);
-			m = defrag6(&m);
-			goto ret;
-		} else
-			goto ret_null;
-	}
-	
-	/* new fragment */
-	nq = (struct frag6link *)malloc(sizeof(struct frag6link));
-	if (!nq)
-		goto ret;
-
-	memset(nq, 0, sizeof(struct frag6link));
-	
-	nq->expired = time_tick;
-	nq->nfrags = 1;
-	nq->proto = fg->nxt;
-	nq->id = fg->ident;
-	memcpy(nq->sip.addr8, ip->src.addr8, sizeof(ip->src.addr8));
-	memcpy(nq->dip.addr8, ip->dst.addr8, sizeof(ip->dst.addr8));
-	nq->m = m;
-	m->next = NULL;
-
-	if ((fg->offlg & IP6F_MORE_FRAG) && (fg->offlg & IP6F_OFF_MASK) == 0)
-		nq->flags = FF_HEAD;
-	else if ((fg->offlg & IP6F_MORE_FRAG) == 0)
-		nq->flags = FF_TAIL;
-	
-	ADD_NODE(nq);
-
-ret_null:
-	LIST_UNLOCK;
-	return NULL;
-
-ret:
-	LIST_UNLOCK;
-	return m;
-}
-
-struct packet *defrag6(struct packet **m0)
-{
-	struct packet *m, *mh, *m2;
-	struct ip6frag *fg = NULL;
-	ip6hdr *ip;
-	int len;
-	int hoff, doff, off;
-	u_int8_t nxt;
-
-	/* calculate the payload size */
-	mh = *m0;
-	ip = (ip6hdr *)(mh->data + sizeof(ethdr));
-	hoff = ip6ehdr(ip, mh->len - sizeof(ethdr), IPPROTO_FRAGMENT);
-	doff = hoff + sizeof(struct ip6frag);
-	fg = (struct ip6frag *)((char *)ip + hoff);
+	more = (fg->offlg & IP6F_MORE_FRAG) != 0;
+	len = ntohs(ip->ip6_plen) + sizeof(ip6hdr) - hoff - sizeof(struct ip6frag);
 	nxt = fg->nxt;
 	
-	len = 0;
-	while (mh) {
-		ip = (ip6hdr *)(mh->data + sizeof(ethdr));
-		len = len + ntohs(ip->ip6_plen) + sizeof(ip6hdr) - doff;
-		
-		mh = mh->next;
+	if (sizeof(ethdr) + sizeof(ip6hdr) + ntohs(ip->ip6_plen) > m->len) {
+		__atomic_add_fetch(&rt->invalid, 1, __ATOMIC_RELAXED);
+		del_pkt(m);
+		return NULL;
 	}
-
-	m = new_pkt(len + hoff + sizeof(ethdr));
-	if (m == NULL)
-		return *m0;
-
-	/* copy the first header */
-	mh = *m0;
-	memcpy(m->data, mh->data, hoff + sizeof(ethdr));
-	ip = (ip6hdr *)(m->data + sizeof(ethdr));
-	ip->ip6_nxt = nxt;
-	ip->ip6_plen = htons(len + hoff - sizeof(ip6hdr));
-	off = hoff + sizeof(ethdr);
 	
-	/* copy the payload */
-	while (mh) {
-		ip = (ip6hdr *)(mh->data + sizeof(ethdr));
-		len = ntohs(ip->ip6_plen) + sizeof(ip6hdr) - doff;
-		memcpy(m->data + off, mh->data + sizeof(ethdr) + doff, len);
-		off += len;
-		m2 = mh;
-		mh = mh->next;
-		del_pkt(m2);
+	memcpy(key, ip->src.addr8, 16);
+	memcpy(key + 16, ip->dst.addr8, 16);
+	memcpy(key + 32, &fg->ident, 4);
+	key[36] = nxt;
+	key[37] = 6;
+	
+	/* 
+	 * the unfragmentable part goes before the payload, the payload 
+	 * length covers both
+	 */
+	m0 = reass_add(rt, key, sizeof(key), m->data, sizeof(ethdr) + hoff, 
+	    off, (char *)fg + sizeof(struct ip6frag), len, more, 
+	    REASS_MAXDATA - (hoff - (int)sizeof(ip6hdr)));
+	if (m0 != NULL) {
+		m0->ts = m->ts;
+		ip = (ip6hdr *)(m0->data + sizeof(ethdr));
+		/* the fragment header may follow the extension headers */
+		*ip6nxtfield(ip, hoff) = nxt;
+		ip->ip6_plen = htons(m0->len - sizeof(ethdr) - sizeof(ip6hdr));
 	}
-	return m;
+	del_pkt(m);
+	
+	return m0;
 }
 
-/* */
-#undef LIST_LOCK_INIT
-#undef LIST_LOCK
-#undef LIST_UNLOCK
-#undef LIST_FOREACH
-#undef FREE_NODE
-#undef ADD_NODE
 /* end of file */
@@ -33,23 +33,9 @@
 
 #include "ip.h"
 
-struct frag6link {
-	struct frag6link *prev;
-	struct frag6link *next;
-	struct packet *m;	/* to ip headers of fragments */
-	u_int  expired;
-	u_int  flags:4,		/* first and last fragments */
-	       nfrags:4;	/* count of fragments */
-#define FF_HEAD 1
-#define FF_TAIL  2
-	u_char  proto;		/* protocol of this fragment */
-	u_int32_t id;		/* sequence id for reassembly */
-	ip6 sip;
-	ip6 dip;
-};
+struct reasstab;
 
-void init_ip6frag(void);
 struct packet *ipfrag6(struct packet *m0, int mtu);
-struct packet *ipreass6(struct packet *m);
+struct packet *ipreass6(struct reasstab *rt, struct packet *m);
 
 #endif
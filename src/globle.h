@@ -33,6 +33,9 @@
 #ifndef DEV_UDP
 #define DEV_UDP	2
 #endif
+#ifndef DEV_PACKET
+#define DEV_PACKET	3
+#endif
 
 #define DEBUG 1
 
@@ -44,7 +47,8 @@
 #define false 0
 #endif
 
-#define MAX_NUM_PTHS 9
+#define MAX_NUM_PTHS 8192	/* upper limit of -i */
+#define DEF_NUM_PTHS 9
 
 #ifndef IFNAMESIZ
 #define IFNAMESIZ 12
@@ -28,6 +28,8 @@
 #include <string.h>
 #include "help.h"
 #include "utils.h"
+#include "agg.h"
+#include "dump.h"
 
 extern int num_pths;
 
@@ -40,6 +42,20 @@ int help_clear(int argc, char **argv)
 }
 
 
+int help_dump(int argc, char **argv)
+{
+	esc_prn("\n{Hdump flush} [{UFILENAME}]\n"
+		"  Save the last frames of the VPC, kept all the time by the flight\n"
+		"  recorder, to {UFILENAME}_{Utimestamp}.pcap, default {Hvpcs}{Udigit}. Only the\n"
+		"  first %d bytes of each frame are kept. See {Hshow capture}\n"
+		"\n{Hdump} {Hon}|{Hoff}\n"
+		"  Turn on or off the flight recorder of the VPC, on by default.\n"
+		"  {Hoff} frees the frames held\n", 
+		CAP_SNAPLEN);
+
+	return 1;
+}
+
 int help_relay(int argc, char **argv)
 {
 	char *s[2] = {
@@ -64,6 +80,7 @@ int help_relay(int argc, char **argv)
 		"     {Hdel} %s   Delete the relay rule\n"
 		"     {Hdel} {Uid}                        Delete the relay rule\n"
 		"     {Hdump} [{Hon}|{Hoff}]                 Dump relay packets to file\n"
+		"     {Hdump flush} [{UFILENAME}]            Save the last relay packets to file\n"
 		"     {Hport} {Uport}                     Set relay hub port\n"
 		"     {Hshow}                          Show the relay rules\n"
 		"  Note: %s are 127.0.0.1 by default\n",
@@ -229,7 +246,7 @@ int help_set(int argc, char **argv)
 {
 	if (argc == 3 && !strncmp(argv[1], "dump", strlen(argv[1])) && 
 	    (!strcmp(argv[2], "?") || !strncmp(argv[2], "help", strlen(argv[2])))) {
-		esc_prn("\n{Hset dump} {Hall}|{Hdetail}|{Hfile}|{Hoff}|{Hmac}|{Hraw}\n"
+		esc_prn("\n{Hset dump} {Hall}|{Hdetail}|{Hfile}|{Hoff}|{Hmac}|{Hraw}|{Hnsec}|{Hsize} {UMB}|{Htime} {Usec}\n"
 			"  Set the packet dump flags for this VPC\n"
 			"    {Hall}             All the packets including incoming\n"
 			"                    must use {Udetail}|{Umac}|{Uraw} as well as 'all'\n"
@@ -237,7 +254,14 @@ int help_set(int argc, char **argv)
 			"    {Hfile}            Dump packets to file 'vpcs[id]_yyyymmddHHMMSS.pcap'\n"
 			"    {Hmac}             Print harware MAC address\n"
 			"    {Hoff}             Clear all the flags\n"
-			"    {Hraw}             Print the first 40 bytes\n");
+			"    {Hraw}             Print the first 40 bytes\n"
+			"    {Hnsec}            Nanosecond timestamps in the new file\n"
+			"    {Hsize} {UMB}        Start a new file when it grows over {UMB} megabytes\n"
+			"    {Htime} {Usec}       Start a new file every {Usec} seconds, 0 never\n"
+			"    {Hfilter} [{UEXPR}]  Dump only the packets matching {UEXPR}, the rest of\n"
+			"                    the line, none to dump all. e.g. 'tcp port 80 and\n"
+			"                    host 10.0.0.2'. {UEXPR} is made of {Harp} {Hip} {Hip6} {Htcp} {Hudp}\n"
+			"                    {Hicmp} {Hicmp6}, [{Hsrc}|{Hdst}] {Hhost}|{Hnet}|{Hport}, {Hand} {Hor} {Hnot} ( )\n");
 	
 		return 1;
 	}
@@ -261,9 +285,32 @@ int help_set(int argc, char **argv)
 		return 1;
 	}
 
+	if (argc == 3 && !strncmp(argv[1], "reassembly", strlen(argv[1])) && 
+	    (!strcmp(argv[2], "?") || !strncmp(argv[2], "help", strlen(argv[2])))) {
+		esc_prn("\n{Hset reassembly} {UKB}\n"
+			"  Set the memory for the IPv4/IPv6 datagrams being reassembled, 128 to\n"
+			"  65536 {UKB}, default %d. The least recently used datagram is dropped\n"
+			"  to make room. See {Hshow pool}\n", REASS_BUDGET);
+
+		return 1;
+	}
+
+	if (argc == 3 && !strncmp(argv[1], "aggregate", strlen(argv[1])) && 
+	    (!strcmp(argv[2], "?") || !strncmp(argv[2], "help", strlen(argv[2])))) {
+		esc_prn("\n{Hset aggregate} {Hon} [{Uusec}]|{Hoff}\n"
+			"  Pack several frames in one UDP datagram if the remote peer is\n"
+			"  also a VPCS (directly or through the VPCS relay) and has turned it\n"
+			"  on. A bundle waits at most {Uusec} microseconds (default %d) for\n"
+			"  more frames. The other peers keep getting one frame per datagram.\n",
+			AGG_DELAY);
+
+		return 1;
+	}
+
 	esc_prn("\n{Hset} {UARG} ...\n"
 		"  Set hostname, connection port, ipfrag state, dump options and echo options\n"
 		"    ARG:\n"
+		"    {Haggregate} {Hon}|{Hoff}          Frame aggregation, see {Hset aggregate ?}\n"
 		"    {Hdump} {UFLAG} [[{UFLAG}]...]    Set the packet dump flags for this VPC. \n"
 		"         FLAG:\n"
 		"             {Hall}             All the packets including incoming.\n"
@@ -273,12 +320,16 @@ int help_set(int argc, char **argv)
 		"             {Hoff}             Clear all the flags\n"		
 		"             {Hmac}             Print hardware MAC address\n"
 		"             {Hraw}             Print the first 40 bytes\n"
+		"             {Hnsec}|{Hsize}|{Htime}  File options, see {Hset dump ?}\n"
+		"             {Hfilter} {UEXPR}      Dump only the matching packets\n"
 		"    {Hecho} {Hon}|{Hoff}|{Ucolor} ...    Set echoing options. See {Hset echo ?}\n"
 		"    {Hlport} {Uport}               Local port\n"
 		"    {Hmtu} {Uvalue}                Set the maximum transmission unit of the interface\n"
 		"    {Hpcname} {UNAME}              Set the hostname of the current VPC to {UNAME}\n"
+		"    {Hreassembly} {UKB}            Memory for the fragment reassembly\n"
 		"    {Hrport} {Uport}               Remote peer port\n"
-		"    {Hrhost} {Uip}                 Remote peer host IPv4 address\n");
+		"    {Hrhost} {Uip}                 Remote peer host IPv4 address\n"
+		"  Only the frames from {Hrhost}:{Hrport} are received in the udp mode\n");
 	
 	return 1;
 }
@@ -295,6 +346,11 @@ int help_show(int argc, char **argv)
 		"  Show dump flags for VPC {Udigit} (default this VPC) or all VPCs\n",
 		"\n{Hshow dump}\n"
 		"  Show dump flags\n"};
+	char *hcap[2] = {
+		"\n{Hshow capture} [{Udigit}|{Hall}]\n"
+		"  Show the flight recorder of VPC {Udigit} (default this VPC) or all VPCs\n",
+		"\n{Hshow capture}\n"
+		"  Show the flight recorder\n"};
 	char *hip[2] = {
 		"\n{Hshow ip} [{Udigit}|{Hall}]\n"
 		"  Show IPv4 details for VPC {Udigit} (default this VPC) or all VPCs, including\n"
@@ -322,6 +378,7 @@ int help_show(int argc, char **argv)
 		"  Show information for ARG\n"
 		"    ARG:\n",
 		"       {Harp} [{Udigit}|{Hall}]    Show arp table for VPC {Udigit} or all VPCs\n"
+		"       {Hcapture} [{Udigit}|{Hall}] Show the flight recorder for VPC {Udigit} or all VPCs\n"
 		"       {Hdump} [{Udigit}|{Hall}]   Show dump flags for VPC {Udigit} or all VPCs\n"
 		"       {Hecho}               Show the status of the echo flag. See {Hset echo ?}\n"
 		"       {Hhistory}            List the command history\n"
@@ -332,12 +389,15 @@ int help_show(int argc, char **argv)
 		"                          shows VPC Name, IPv6 addresses/mask, gateway, MAC,\n"
 		"                          lport, rhost:rport and MTU\n"
 		"       {Hmtu6} [{Udigit}|{Hall}]   Show IPv6 mtu table for VPC {Udigit} or all VPCs\n"
+		"       {Hpool}               Show packet buffer pool, queue drop and reassembly\n"
+		"                          counters\n"
 		"       {Hversion}            Show the version information\n\n"
 		"  Notes: \n"
 		"  1. If no parameter is given, the key information of all VPCs will be displayed\n"
 		"  2. If no parameter is given for {Harp}/{Hdump}/{Hip}/{Hipv6} information for the\n"
 		"     current VPC will be displayed.\n",
 		"       {Harp}                Show arp table\n"
+		"       {Hcapture}            Show the flight recorder\n"
 		"       {Hdump}               Show dump flags \n"
 		"       {Hecho}               Show the status of the echo flag. See {Hset echo ?}\n"
 		"       {Hhistory}            List the command history\n"
@@ -347,6 +407,8 @@ int help_show(int argc, char **argv)
 		"       {Hipv6} [{Hall}]         Show IPv6 details\n"
 		"                          Shows VPC Name, IPv6 addresses/mask, gateway, MAC,\n"
 		"                          lport, rhost:rport and MTU\n"
+		"       {Hpool}               Show packet buffer pool, queue drop and reassembly\n"
+		"                          counters\n"
 		"       {Hversion}            Show the version information\n\n"
 		"  Notes: \n"
 		"  1. If no parameter is given, the key information of the current VPC will be\n"
@@ -361,6 +423,13 @@ int help_show(int argc, char **argv)
 		return 1;
 	}
 	
+	if (argc == 3 && !strncmp(argv[1], "capture", strlen(argv[1])) && 
+	    (!strcmp(argv[2], "?") || !strncmp(argv[2], "help", strlen(argv[2])))) {
+		esc_prn("%s", num_pths > 1 ? hcap[0] : hcap[1]);
+
+		return 1;
+	}
+	
 	if (argc == 3 && !strncmp(argv[1], "dump", strlen(argv[1])) && 
 	    (!strcmp(argv[2], "?") || !strncmp(argv[2], "help", strlen(argv[2])))) {
 		esc_prn("%s", num_pths > 1 ? hdump[0] : hdump[1]);
@@ -416,7 +485,9 @@ int help_test(int argc, char **argv)
 	esc_prn("\n{Htest} [{Uarg1}] [{Uarg2}] ...\n"
 		"  Execute a test command with optional arguments.\n"
 		"  This is a demonstration command that shows how to add new commands to VPCS.\n"
-		"  The command will display all arguments passed to it.\n");
+		"  The command will display all arguments passed to it.\n"
+		"\n{Htest cksum} [{Usize}]\n"
+		"  Benchmark the checksum kernels over {Usize} bytes, default 1500.\n");
 
 	return 1;
 }
@@ -477,6 +548,7 @@ int run_help(int argc, char **argv)
 	esc_prn("{Hclear} {UARG}                Clear IPv4/IPv6, arp/neighbor cache, command history\n"
 		"{Hdhcp} [{UOPTION}]            Shortcut for: {Hip dhcp}. Get IPv4 address via DHCP\n"
 		"{Hdisconnect}               Exit the telnet session (daemon mode)\r\n"
+		"{Hdump flush} [{UFILENAME}]    Save the last frames of the VPC to a pcap file\n"
 		"{Hecho} {UTEXT}                Display {UTEXT} in output. See also  {Hset echo ?}\n"
 		"{Hhelp}                     Print help\n"
 		"{Hhistory}                  Shortcut for: {Hshow history}. List the command history\n"
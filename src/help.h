@@ -30,6 +30,7 @@
 int run_help(int argc, char **argv);
 
 int help_clear(int argc, char **argv);
+int help_dump(int argc, char **argv);
 int help_echo(int argc, char **argv);
 int help_help(int argc, char **argv);
 int help_hist(int argc, char **argv);
@@ -165,12 +165,12 @@ void httpd_handle_request(int port, const char *data, int data_len, char *respon
 int httpd_client_get(const char *host, int port, const char *path)
 {
     extern int pcid;
-    extern pcs vpc[];
     
     pcs *pc = &vpc[pcid];
     struct in_addr addr;
     char request[512];
-    int k;
+    char buf[1024];
+    int k, n, len, wait;
     struct timeval ts, ts0;
     int usec;
     int gip;
@@ -279,14 +279,16 @@ int httpd_client_get(const char *host, int port, const char *path)
     
     printf("HTTP request sent (time=%.3f ms)\n", usec / 1000.0);
     
-    /* The server will respond with ACK+PUSH+DATA, which tcp_send already handled */
-    /* Check if we received response data */
-    if (k == 1 && pc->mscb.rdsize > 0 && pc->mscb.data != NULL) {
-        printf("\n--- HTTP Response (%d bytes) ---\n", pc->mscb.rdsize);
+    /* Read the response as it comes, until the server closes or goes quiet */
+    n = 0;
+    wait = pc->mscb.waittime;
+    while ((len = tcp_recv(pc, 4, buf, sizeof(buf), wait)) > 0) {
+        if (n == 0)
+            printf("\n--- HTTP Response ---\n");
         
         /* Print response with proper character handling */
-        for (int i = 0; i < pc->mscb.rdsize && i < 4096; i++) {
-            char c = pc->mscb.data[i];
+        for (int i = 0; i < len && n + i < 4096; i++) {
+            char c = buf[i];
             if (c >= 32 && c <= 126) {
                 printf("%c", c);
             } else if (c == '\r') {
@@ -297,11 +299,15 @@ int httpd_client_get(const char *host, int port, const char *path)
                 printf("\\x%02x", (unsigned char)c);
             }
         }
-        printf("\n--- End of HTTP Response ---\n");
-    } else {
-        printf("No HTTP response received\n");
+        n += len;
+        wait = HTTPD_CLIENT_IDLE;
     }
     
+    if (n > 0)
+        printf("\n--- End of HTTP Response (%d bytes) ---\n", n);
+    else
+        printf("No HTTP response received\n");
+    
     /* Close connection */
     delay_ms(100);
     gettimeofday(&ts, NULL);
@@ -30,6 +30,7 @@
 #define HTTPD_MAX_REQUEST_SIZE 4096
 #define HTTPD_MAX_RESPONSE_SIZE 8192
 #define HTTPD_MAX_SERVERS 4
+#define HTTPD_CLIENT_IDLE 500 /* ms, the response is over if nothing more comes */
 
 typedef struct {
     int enabled;
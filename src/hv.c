@@ -70,6 +70,7 @@
 
 #include <syslog.h>
 
+#include "globle.h"
 #include "hv.h"
 #include "utils.h"
 #include "readline.h"
@@ -92,6 +93,8 @@ static int run_disconnect(int ac, char **av);
 static int run_stop(int ac, char **av);
 static int run_help(int ac, char **av);
 static int run_rlogin(int ac, char **av);
+static int span(struct list *pv);
+static int overlapped(int a, int na, int b, int nb);
 extern void usage(void);
 
 static struct list vpcs_list[MAX_DAEMONS];
@@ -398,7 +401,8 @@ run_vpcs(int ac, char **av)
 #if ((!defined(GNUkFreeBSD) && (defined(FreeBSD) || defined(OpenBSD))) || defined(Darwin))
 	optreset = 1;
 #endif	
-	while ((c = getopt(ac, av, "p:m:s:c:")) != -1) {
+	pv->vnum = DEF_NUM_PTHS;
+	while ((c = getopt(ac, av, "p:m:s:c:i:")) != -1) {
 		switch (c) {
 			case 'p':
 				pv->vport = atoi(optarg);
@@ -409,7 +413,7 @@ run_vpcs(int ac, char **av)
 				break;
 			case 'm':
 				pv->vmac = atoi(optarg);
-				if (pv->vmac == 0) {
+				if (pv->vmac == 0 || pv->vmac > MAX_VMAC) {
 					ERR(fptys, "Invalid ether address\r\n");
 					return 1;
 				}
@@ -427,7 +431,14 @@ run_vpcs(int ac, char **av)
 					ERR(fptys, "Invalid remote port\r\n");
 					return 1;
 				}
-				break;				
+				break;
+			case 'i':
+				pv->vnum = atoi(optarg);
+				if (pv->vnum < 1 || pv->vnum > MAX_NUM_PTHS) {
+					ERR(fptys, "Invalid number of VPCs\r\n");
+					return 1;
+				}
+				break;
 		}
 	}
 	
@@ -458,32 +469,25 @@ run_vpcs(int ac, char **av)
 	
 	/* set the new mac */
 	if (pv->vmac == 0) {
+		/* next to the last one, 0 if none */
 		j = 0;
-		c = 0;
 		for (i = 0; i < MAX_DAEMONS; i++) {
 			if (vpcs_list[i].pid == 0)
 				continue;
-			if (vpcs_list[i].vmac > j)
-				j = vpcs_list[i].vmac;
-			c = 1;
+			if (vpcs_list[i].vmac + span(&vpcs_list[i]) > j)
+				j = vpcs_list[i].vmac + span(&vpcs_list[i]);
+		}
+		pv->vmac = j;
+		if (pv->vmac > MAX_VMAC) {
+			ERR(fptys, "No free ether address\r\n");
+			return 1;
 		}
-		if (j == 0) {
-			/* there's vpcs which ether address start from 0 */
-			if (c == 1)
-				pv->vmac = STEP;
-			else
-				pv->vmac = 0;
-		} else
-			pv->vmac = j + STEP;
-		
 	} else {
 		for (i = 0; i < MAX_DAEMONS; i++) {
 			if (vpcs_list[i].pid == 0)
 				continue;
-			if (((pv->vmac >= vpcs_list[i].vmac) && 
-			    ((pv->vmac - vpcs_list[i].vmac) < STEP)) ||
-			    ((pv->vmac < vpcs_list[i].vmac) && 
-			    ((vpcs_list[i].vmac - pv->vmac) < STEP))) {
+			if (overlapped(pv->vmac, span(pv), 
+			    vpcs_list[i].vmac, span(&vpcs_list[i]))) {
 				ERR(fptys, "Ether address overlapped\r\n");
 				return 1;		
 			}
@@ -496,21 +500,19 @@ run_vpcs(int ac, char **av)
 		for (i = 0; i < MAX_DAEMONS; i++) {
 			if (vpcs_list[i].pid == 0)
 				continue;
-			if (vpcs_list[i].vsport > j)
-				j = vpcs_list[i].vsport;
+			if (vpcs_list[i].vsport + span(&vpcs_list[i]) > j)
+				j = vpcs_list[i].vsport + span(&vpcs_list[i]);
 		}
 		if (j == 0)
 			pv->vsport = DEFAULT_SPORT;
 		else
-			pv->vsport = j + STEP;
+			pv->vsport = j;
 	} else {
 		for (i = 0; i < MAX_DAEMONS; i++) {
 			if (vpcs_list[i].pid == 0)
 				continue;
-			if (((pv->vsport >= vpcs_list[i].vsport) && 
-			    ((pv->vsport - vpcs_list[i].vsport) < STEP)) ||
-			    ((pv->vsport < vpcs_list[i].vsport) && 
-			    ((vpcs_list[i].vsport - pv->vsport) < STEP))) {
+			if (overlapped(pv->vsport, span(pv), 
+			    vpcs_list[i].vsport, span(&vpcs_list[i]))) {
 				ERR(fptys, "Local udp port overlapped\r\n");
 				return 1;		
 			}
@@ -523,21 +525,19 @@ run_vpcs(int ac, char **av)
 		for (i = 0; i < MAX_DAEMONS; i++) {
 			if (vpcs_list[i].pid == 0)
 				continue;
-			if (vpcs_list[i].vcport > j)
-				j = vpcs_list[i].vcport;
+			if (vpcs_list[i].vcport + span(&vpcs_list[i]) > j)
+				j = vpcs_list[i].vcport + span(&vpcs_list[i]);
 		}
 		if (j == 0)
 			pv->vcport = DEFAULT_CPORT;
 		else
-			pv->vcport = j + STEP;
+			pv->vcport = j;
 	} else {
 		for (i = 0; i < MAX_DAEMONS; i++) {
 			if (vpcs_list[i].pid == 0)
 				continue;
-			if (((pv->vcport >= vpcs_list[i].vcport) && 
-			    ((pv->vcport - vpcs_list[i].vcport) < STEP)) ||
-			    ((pv->vcport < vpcs_list[i].vcport) && 
-			    ((vpcs_list[i].vcport - pv->vcport) < STEP))) {
+			if (overlapped(pv->vcport, span(pv), 
+			    vpcs_list[i].vcport, span(&vpcs_list[i]))) {
 				ERR(fptys,"Remote udp port overlapped\r\n");
 				return 1;		
 			}
@@ -601,6 +601,19 @@ run_vpcs(int ac, char **av)
 	return 0;
 }
 
+/* the ports/ether addresses taken by the vpcs */
+static int 
+span(struct list *pv)
+{
+	return (pv->vnum > STEP) ? pv->vnum : STEP;
+}
+
+static int 
+overlapped(int a, int na, int b, int nb)
+{
+	return (a < b + nb && b < a + na);
+}
+
 static int 
 run_list(int ac, char **av)
 {
@@ -48,7 +48,8 @@
 #define DEFAULT_PORT (21000)
 #define DEFAULT_SPORT (20000)
 #define DEFAULT_CPORT (30000)
-#define STEP (10)
+#define STEP (10)	/* the least range of each vpcs, -i takes more */
+#define MAX_VMAC (240)	/* the upper limit of vpcs -m */
 
 
 #define MAX_DAEMONS (10)
@@ -56,6 +57,7 @@ struct list {
 	pid_t pid;
 	int vport;
 	int vmac;
+	int vnum;	/* -i, vpcs in the process */
 	int vsport;
 	int vcport;
 	char *cmdline;
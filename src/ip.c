@@ -31,6 +31,7 @@
 #include "ip.h"
 #include "queue.h"
 #include "inet6.h"
+#include "cksum.h"
 
 u_long ip_masks[33] = {
 	0x0, 
@@ -65,22 +66,13 @@ void encap_ehead(char *mbuf, const u_char *sea, const u_char *dea, const u_short
 
 u_short cksum(register unsigned short *buffer, register int size) 
 { 
-	register unsigned long cksum = 0; 
-	
-	while (size > 1) { 
-	  cksum += *buffer++; 
-	  size -= sizeof(unsigned short); 
-	} 
-	 
-	if (size) 
-		cksum += *(unsigned char *) buffer; 
-	
-	cksum = (cksum >> 16) + (cksum & 0xffff); 
-	cksum += (cksum >> 16);
-	
-	return (unsigned short) (~cksum); 
+	return cksum_fold(cksum_add(buffer, size, 0));
 } 
 
+/*
+ * RFC 1624, the checksum after the 16-bit word old is replaced by new:
+ * HC' = ~(~HC + ~m + m'). The words are taken as they are in the packet.
+ */
 u_short cksum_fixup(u_short cksum, u_short old, u_short new, u_short udp)
 {
 	u_long l = 0;
@@ -88,9 +80,10 @@ u_short cksum_fixup(u_short cksum, u_short old, u_short new, u_short udp)
 	if (udp && !cksum) 
 		return (0x0000);
 	
-	l = cksum + old - new;
+	l = (u_short)~cksum + (u_short)~old + new;
 	l = (l >> 16) + (l & 0xffff);
-	l = l & 0xffff;
+	l = (l >> 16) + (l & 0xffff);
+	l = ~l & 0xffff;
 	
 	if (udp && !l) 
 		return (0xFFFF);
@@ -98,46 +91,36 @@ u_short cksum_fixup(u_short cksum, u_short old, u_short new, u_short udp)
 	return (l);
 }
 
-u_short cksum6(ip6hdr *ip, u_char nxt, int len)
+/* the sum of the ipv4 pseudo header, to be passed to cksum_add */
+u_int cksum_pseudo4(u_int sip, u_int dip, u_char proto, int len)
 {
-	int sum = 0;
-	u_short *w;
-	union {
-		u_short phs[4];
-		struct {
-			u_int	ph_len;
-			u_char	ph_zero[3];
-			u_char	ph_nxt;
-		} ph;
-	} uph;
-	
-	memset(&uph, 0, 8);
-	uph.ph.ph_len = htonl(len);
-	uph.ph.ph_nxt = nxt;
+	u_int ph[3];
 	
-	sum += uph.phs[0];  sum += uph.phs[1];
-	sum += uph.phs[2];  sum += uph.phs[3];
+	ph[0] = sip;
+	ph[1] = dip;
+	ph[2] = htonl((proto << 16) | len);
 	
-	w = (u_short *)&(ip->src);
-	sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-	sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
-	
-	w = (u_short *)&(ip->dst);
-	sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-	sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
-	
-	w = (u_short *)(ip + 1);
+	return cksum_add(ph, sizeof(ph), 0);
+}
 
-	while (len > 1) { 
-		sum += *w++; 
-		len -= sizeof(u_short); 
-	}
-	if (len) sum += *(unsigned char *) w;
+u_short cksum6(ip6hdr *ip, u_char nxt, int len)
+{
+	u_int sum;
+	struct {
+		u_int	ph_len;
+		u_char	ph_zero[3];
+		u_char	ph_nxt;
+	} ph;
+	
+	memset(&ph, 0, sizeof(ph));
+	ph.ph_len = htonl(len);
+	ph.ph_nxt = nxt;
 	
-	sum = (sum >> 16) + (sum & 0xffff); 
-	sum += (sum >> 16); 
+	/* pseudo header: the addresses, the length and next header */
+	sum = cksum_add(&(ip->src), 2 * sizeof(ip->src), 0);
+	sum = cksum_add(&ph, sizeof(ph), sum);
 	
-	return (u_short) (~sum);	
+	return cksum_fold(cksum_add(ip + 1, len, sum));
 }
 
 int sameNet(u_long ip1, u_long ip2, int cidr)
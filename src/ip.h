@@ -231,6 +231,8 @@ typedef struct tcpiphdr tcpiphdr;
 #define	ti_urp		ti_t.th_urp
 
 
+#define TCPOPT_EOL              0
+#define TCPOPT_NOP              1
 #define TCPOPT_MAXSEG           2
 #define TCPOLEN_MAXSEG          4
 #define TCPOPT_WINDOW           3
@@ -400,19 +402,6 @@ typedef struct {
 #define ICMP6_DST_UNREACH_NOPORT	4	/* port unreachable */
 #endif
 
-typedef struct tcpcb6 {
-	u_int timeout;
-	ip6	sip;
-	ip6 dip;
-	u_int sport;
-	u_int dport;
-	u_int ack;
-	u_int seq;
-	u_short winsize;
-	u_char	flags;  /* my flags */
-	u_char	rflags; /* remote tcp flags */
-} tcpcb6;
-
 #ifndef ND_ROUTER_SOLICIT
 #define ND_ROUTER_SOLICIT		133	/* router solicitation */
 #define ND_ROUTER_ADVERT		134	/* router advertisement */
@@ -453,6 +442,7 @@ typedef struct {
 #define DMP_FILE   0x1000
 
 struct packet; /* defined in queue.h */
+struct rcvbuf; /* defined in tcp.h */
 
 typedef struct sesscb {
 	int sock;
@@ -478,6 +468,9 @@ typedef struct sesscb {
 	u_int rack;
 	u_int rseq;
 	u_short winsize;
+	u_int rwin;	/* remote window, scaled */
+	u_char rwscale;	/* remote window shift */
+	u_char wscale;	/* my window shift, 0 if the remote has none */
 	u_char	flags;  /* my flags */
 	u_char	rflags; /* remote tcp flags */
 	u_char ttl;
@@ -489,6 +482,9 @@ typedef struct sesscb {
 	int mtu;
 	u_char frag;
 	char *data;
+	struct rcvbuf *rbuf;	/* the client receive buffer */
+	int hslot;	/* session table: bucket + 1, 0 if idle */
+	int hnext;	/* session table: next block + 1 */
 } sesscb;
 
 void encap_ehead(char *mbuf, const u_char *sea, const u_char *dea, const u_short type);
@@ -496,6 +492,7 @@ void swap_ehead(char *mbuf);
 
 u_short cksum(register unsigned short *buffer, register int size);
 u_short cksum_fixup(u_short cksum, u_short old, u_short new, u_short udp);
+u_int cksum_pseudo4(u_int sip, u_int dip, u_char proto, int len);
 u_short cksum6(ip6hdr *ip, u_char nxt, int len);
 
 int etherIsZero(u_char *mac);
@@ -35,6 +35,9 @@
 #include "packets.h"
 #include "vpcs.h"
 #include "utils.h"
+#include "cksum.h"
+#include "dev.h"
+#include "tcp.h"
 
 #define IPFRG_MAXHASH  (1 << 10)
 #define IPFRG_HASHMASK (IPFRG_MAXHASH - 1)
@@ -43,10 +46,8 @@
 
 u_char broadcast[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
         
-static struct packet *arp(pcs *pc, u_int dip);
-static struct packet *udpReply(struct packet *m0);
+static struct packet *udpReply(struct packet *m);
 static struct packet *icmpReply(struct packet *m0, char icmptype, char icmpcode);
-static void save_eaddr(pcs *pc, u_int addr, u_char *mac);
 extern int upv6(pcs *pc, struct packet **m);
 extern void send6(pcs *pc, struct packet *m);
 extern int tcp(pcs *pc, struct packet *m);
@@ -59,11 +60,9 @@ static struct packet *defrag_pkt(struct packet **);
 */
 
 // 1 : ok
-// 0 : error
+// 0 : held or dropped
 static int fix_dmac(pcs *pc, struct packet *m);
 
-extern u_int time_tick;
-
 /*
  * ipv4 stack
  *
@@ -105,8 +104,7 @@ int upv4(pcs *pc, struct packet **m0)
 
 			if (ntohs(ip->len) > pc->mtu) {
 				p = icmpReply(m, ICMP_UNREACH, ICMP_UNREACH_NEEDFRAG);
-				if (p) {
-					fix_dmac(pc, p);
+				if (p && fix_dmac(pc, p)) {
 					if (pc->ip4.flags & IPF_FRAG) {
 						p = ipfrag(p, pc->mtu);
 					}
@@ -116,7 +114,7 @@ int upv4(pcs *pc, struct packet **m0)
 			}
 
 			if (ntohs(ip->frag) & (IP_MF | IP_OFFMASK)) {
-				m = ipreass(m);
+				m = ipreass(&pc->reass, m);
 				if (m == NULL)
 					return PKT_ENQ;
 				else
@@ -164,18 +162,17 @@ int upv4(pcs *pc, struct packet **m0)
 				/* udp echo reply */
 				if (memcmp(data, eh->dst, ETH_ALEN) == 0)
 					return PKT_UP;
-				else {
-					if (ip->ttl == 1)
-						p = icmpReply(m, ICMP_UNREACH, ICMP_UNREACH_PORT);
-					else
-						p = udpReply(m);
-
-					if (p != NULL) {
+				
+				if (ip->ttl == 1) {
+					p = icmpReply(m, ICMP_UNREACH, ICMP_UNREACH_PORT);
+					if (p != NULL)
 						enq(&pc->bgoq, p);
-					}
+					return PKT_DROP;
 				}
-				/* anyway tell caller to drop this packet */
-				return PKT_DROP;
+				
+				/* echo it back in the incoming buffer */
+				enq(&pc->bgoq, udpReply(m));
+				return PKT_ENQ;
 			} else if (ip->proto == IPPROTO_TCP) {
 				if (ip->dip != pc->ip4.ip)
 					return PKT_DROP;
@@ -190,7 +187,7 @@ int upv4(pcs *pc, struct packet **m0)
 		/* arp reply */
 		if (ah->op == htons(ARPOP_REQUEST) && 
 		    di[0] == pc->ip4.ip) {
-			save_eaddr(pc, si[0], ah->sea);
+			arp_input(pc, si[0], ah->sea);
 				
 			ah->op = htons(ARPOP_REPLY);
 			memcpy(ah->dea, ah->sea, ETH_ALEN);
@@ -207,7 +204,7 @@ int upv4(pcs *pc, struct packet **m0)
 			return PKT_ENQ;
 		} else if (ah->op == htons(ARPOP_REPLY) && 	
 		    sameNet(di[0], pc->ip4.ip, pc->ip4.cidr)) {
-		    	save_eaddr(pc, si[0], ah->sea);
+		    	arp_input(pc, si[0], ah->sea);
 		}
 		
 		return PKT_DROP;
@@ -239,11 +236,9 @@ void send4(pcs *pc, struct packet *m)
 	    //    inet_ntoa(*(struct in_addr*)&ip->dip), 
 	    //    ip->proto);
 	
-	if( ! fix_dmac(pc, m) ){
-		// printf("DEBUG: send4 - fix_dmac failed\n");
-		del_pkt(m);
+	/* held by the arp cache till the gateway answers */
+	if( ! fix_dmac(pc, m) )
 		return;
-	}
 	
 	if (pc->ip4.flags & IPF_FRAG) {
 		m = ipfrag(m, pc->mtu);
@@ -325,74 +320,22 @@ int response(struct packet *m, sesscb *sesscb)
 		sesscb->rack = ntohl(ti->ti_ack);
 		sesscb->rflags = ti->ti_flags;
 		sesscb->rttl = ip->ttl;
-		sesscb->data = NULL;
 
 		n = sesscb->rdsize - (ip->ihl << 2) - (ti->ti_off << 2);
-		/* try to get MSS from options */
-		if (sesscb->flags == TH_SYN && sesscb->rflags == (TH_SYN | TH_ACK) && 
-			n > 0) {
-			int i = 0;
-
-			while ( i < sesscb->rdsize && data[i] == 0x1 ) i++;
-			
-			for (;i < n;) {
-				if (data[i] == TCPOPT_MAXSEG && 
-				    data[i + 1] == TCPOLEN_MAXSEG) {
-					sesscb->rmss = (data[i + 2] << 8) + data[i + 3];
-					break;
-				}
-				i += data[i + 1];
-			}
-		} else {
-			sesscb->rdsize = n;  /* Set received data size */
-			sesscb->data = ((char*)(ip + 1)) + (ti->ti_off << 2);
-		}
+		sesscb->rdsize = n;  /* Set received data size */
+		if (sesscb->flags == TH_SYN && 
+		    sesscb->rflags == (TH_SYN | TH_ACK)) {
+			/* the window of SYN is never scaled */
+			tcp_synopt(sesscb, (u_char *)data, 
+			    (ti->ti_off << 2) - sizeof(tcphdr));
+			sesscb->rwin = ntohs(ti->ti_win);
+		} else
+			sesscb->rwin = ntohs(ti->ti_win) << sesscb->rwscale;
 		return IPPROTO_TCP;
 	}
 	return 0;
 }
 
-int arpResolve(pcs *pc, u_int ip, u_char *dmac)
-{
-	int i, c;
-	struct packet *m;
-	int waittime = 1000;
-	struct timeval tv;
-		
-	c = 0;
-
-	for (i = 0; i < POOL_SIZE; i++) {
-		if (pc->ipmac4[i].ip == ip && 
-		    (time_tick - pc->ipmac4[i].timeout) <= 120 &&
-		    !etherIsZero(pc->ipmac4[i].mac)) {
-			memcpy(dmac, pc->ipmac4[i].mac, ETH_ALEN);
-			return 1;
-		}
-	}
-
-	while (c++ < 3){
-		m = arp(pc, ip);
-		if (m == NULL) {
-			printf("out of memory\n");
-			return 0;
-		}
-		enq(&pc->oq, m);
-		gettimeofday(&(tv), (void*)0);
-		while (!timeout(tv, waittime)) {
-			delay_ms(1);
-			for (i = 0; i < POOL_SIZE; i++) {
-				if (pc->ipmac4[i].ip == ip && 
-				    (time_tick - pc->ipmac4[i].timeout) <= 120 &&
-				    !etherIsZero(pc->ipmac4[i].mac)) {
-					memcpy(dmac, pc->ipmac4[i].mac, ETH_ALEN);
-					return 1;
-				}
-			}	
-		}
-	}
-	return 0;
-}
-
 struct packet *packet(pcs *pc)
 {
 	sesscb *sesscb = &pc->mscb;
@@ -423,10 +366,7 @@ struct packet *packet(pcs *pc)
 			} else {
 				dlen = dlen + 2 + 2 + 8;
 			}
-			if (sesscb->rmss != 0 && dlen > sesscb->rmss)
-				dlen = sesscb->rmss - sizeof(ethdr) - 
-				    sizeof(iphdr) - sizeof(tcphdr);
-			
+			/* tcp_send() cuts the data at the mss */
 			hdr_len = sizeof(iphdr) + sizeof(tcphdr);
 			break;
 	}
@@ -491,6 +431,13 @@ struct packet *packet(pcs *pc)
 		
 		bcopy(b, ((struct ipovly *)ip)->ih_x1, 9);
 		
+		/* no offload if it is to be fragmented */
+		if (dev_offload() && hdr_len + dlen <= sesscb->mtu) {
+			ui->ui_sum = ~cksum_fold(cksum_pseudo4(ip->sip, 
+			    ip->dip, IPPROTO_UDP, ntohs(ui->ui_ulen)));
+			m->flags |= PKT_F_CSUM;
+		}
+		
 	} else if (sesscb->proto == IPPROTO_TCP) {
 		tcpiphdr *ti = (tcpiphdr *)ip;
 		char *data = ((char*)(ti + 1));
@@ -507,11 +454,14 @@ struct packet *packet(pcs *pc)
 		ti->ti_flags = sesscb->flags;
 		
 		if (sesscb->flags == TH_SYN) {
-			/* mss 1460 */
+			u_short mss = sesscb->mtu - sizeof(iphdr) - 
+			    sizeof(tcphdr);
+			
+			/* mss, what the mtu holds */
 			*data++ = TCPOPT_MAXSEG;
 			*data++ = TCPOLEN_MAXSEG;
-			*data++ = 0x5;
-			*data++ = 0xb4;
+			*data++ = mss >> 8;
+			*data++ = mss & 0xff;
 			/* align */
 			*data++ = 0x1;
 			*data++ = 0x1;
@@ -524,7 +474,7 @@ struct packet *packet(pcs *pc)
 			*data++ = 0x1;
 			*data++ = TCPOPT_WINDOW;
 			*data++ = TCPOLEN_WINDOW;
-			*data++ = 1;
+			*data++ = TCP_WSCALE;
 		} else {
 			/* align */
 			*data++ = 0x1;
@@ -569,11 +519,23 @@ struct packet *packet(pcs *pc)
 			}
 		}
 		
-		bcopy(((struct ipovly *)ip)->ih_x1, b, 9);
-		bzero(((struct ipovly *)ip)->ih_x1, 9);
+		if (dev_offload()) {
+			int mss = sesscb->mtu - sizeof(iphdr) - sizeof(tcphdr);
+			
+			if (sesscb->rmss != 0 && sesscb->rmss < mss)
+				mss = sesscb->rmss;
+			ti->ti_sum = ~cksum_fold(cksum_pseudo4(ip->sip, 
+			    ip->dip, IPPROTO_TCP, ntohs(ti->ti_len)));
+			m->flags |= PKT_F_CSUM;
+			if (dlen > mss)
+				m->gso_size = mss - optlen;
+		} else {
+			bcopy(((struct ipovly *)ip)->ih_x1, b, 9);
+			bzero(((struct ipovly *)ip)->ih_x1, 9);
 		
-		ti->ti_sum = cksum((u_short*)ti, hdr_len + dlen);
-		bcopy(b, ((struct ipovly *)ip)->ih_x1, 9);
+			ti->ti_sum = cksum((u_short*)ti, hdr_len + dlen);
+			bcopy(b, ((struct ipovly *)ip)->ih_x1, 9);
+		}
 	}
 	
 	encap_ehead(m->data, sesscb->smac, sesscb->dmac, ETHERTYPE_IP);
@@ -588,51 +550,23 @@ struct packet *packet(pcs *pc)
 	return m;
 }
 
-struct packet *arp(pcs *pc, u_int dip)
+/* set the ttl of the reply, patch the header checksum */
+static void ttl_reset(iphdr *ip)
 {
-	ethdr *eh;
-	vpcs_arphdr *ah;
-	struct packet *m;
-	u_int *si, *di;
-	
-	m = new_pkt(ARP_PSIZE);
-	if (m == NULL)
-		return NULL;
-
-	eh = (ethdr *)(m->data);
-	ah = (vpcs_arphdr *)(eh + 1);
-
-	ah->hrd = htons(ARPHRD_ETHER);
-	ah->pro = htons(ETHERTYPE_IP);
-	ah->hln = 6;
-	ah->pln = 4;
-	ah->op = htons(ARPOP_REQUEST);
-	
-	si = (u_int *)ah->sip;
-	di = (u_int *)ah->dip;
-	si[0] = pc->ip4.ip;
-	di[0] = dip;
-
-	memcpy(ah->dea, broadcast, ETH_ALEN);
-	memcpy(ah->sea, pc->ip4.mac, ETH_ALEN);
-	
-	encap_ehead(m->data, pc->ip4.mac, broadcast, ETHERTYPE_ARP);
+	u_short w = *(u_short *)&ip->ttl;
 	
-	return m;
+	ip->ttl = TTL;
+	ip->cksum = cksum_fixup(ip->cksum, w, *(u_short *)&ip->ttl, 0);
 }
 
-struct packet *udpReply(struct packet *m0)
+/*
+ * turn the incoming datagram into the reply in place
+ */
+struct packet *udpReply(struct packet *m)
 {
 	ethdr *eh;
 	iphdr *ip;
 	udpiphdr *ui;
-	struct packet *m;
-	
-	m = new_pkt(m0->len);
-	if (m == NULL)
-		return NULL;
-	
-	copy_pkt(m, m0);
 	
 	eh = (ethdr *)(m->data);
 	ip = (iphdr *)(eh + 1);
@@ -646,8 +580,8 @@ struct packet *udpReply(struct packet *m0)
 	ui->ui_dport ^= ui->ui_sport;
 	ui->ui_sport ^= ui->ui_dport;
 	
-	ip->cksum = cksum_fixup(ip->cksum, ip->ttl, TTL, 0);
-	ip->ttl = TTL;
+	/* the swaps keep the sums, only the ttl is patched */
+	ttl_reset(ip);
 	
 	swap_ehead(m->data);
 	return m;	
@@ -667,24 +601,17 @@ struct packet *icmpReply(struct packet *m0, char icmptype, char icmpcode)
 		ip = (iphdr *)(eh + 1);
 		icmp = (icmphdr *)(ip + 1);
 			
-		u_short old_sum;
-		u_char old_ttl;
-		
-		old_ttl = ip->ttl;
-		old_sum = icmp->cksum;
+		u_short w;
 		
+		w = *(u_short *)icmp;
 		icmp->type = ICMP_ECHOREPLY;
-		icmp->cksum = cksum_fixup(icmp->cksum, ICMP_ECHO, ICMP_ECHOREPLY, 0);
+		icmp->cksum = cksum_fixup(icmp->cksum, w, *(u_short *)icmp, 0);
 
 		ip->dip ^= ip->sip;
 		ip->sip ^= ip->dip;
 		ip->dip ^= ip->sip;
 
-		ip->ttl = TTL;
-		
-		ip->cksum = cksum_fixup(cksum_fixup(cksum_fixup(ip->cksum, 
-		    old_ttl, ip->ttl, 0), ICMP_ECHO, ICMP_ECHOREPLY, 0),
-		    old_sum, icmp->cksum, 0);
+		ttl_reset(ip);
 	
 		swap_ehead(m->data);
 		
@@ -745,39 +672,12 @@ struct packet *icmpReply(struct packet *m0, char icmptype, char icmpcode)
 	return NULL;
 }
 
-static void 
-save_eaddr(pcs *pc, u_int addr, u_char *mac)
-{
-	int i;
-	
-	if (!sameNet(addr, pc->ip4.ip, pc->ip4.cidr))
-		return;
-	
-	i = 0;
-	while (i < POOL_SIZE) {
-		if (time_tick - pc->ipmac4[i].timeout <= 120 &&
-			pc->ipmac4[i].ip == addr) {
-			pc->ipmac4[i].timeout = time_tick;
-			break;
-		}
-		if (pc->ipmac4[i].timeout == 0 || 
-		    time_tick - pc->ipmac4[i].timeout > 120) {
-			pc->ipmac4[i].ip = addr;
-			memcpy(pc->ipmac4[i].mac, mac, ETH_ALEN);
-			pc->ipmac4[i].timeout = time_tick;
-			break;
-		}
-		i++;
-	}
-}
-
 // return 1 : ok
-// return 0 : error
+// return 0 : the packet is held till the gateway is resolved, or dropped
 int fix_dmac(pcs *pc, struct packet *m)
 {
 	ethdr *eh = NULL;
 	iphdr *ip = NULL;
-	u_char mac[6];
 	
 	eh = (ethdr *)(m->data);
 	ip = (iphdr *)(eh + 1);
@@ -785,16 +685,12 @@ int fix_dmac(pcs *pc, struct packet *m)
 	if (sameNet(ip->dip, pc->ip4.ip, pc->ip4.cidr))
 		return 1;
 
-	if( pc->ip4.gw == 0 ) // gw == 0.0.0.0
+	if( pc->ip4.gw == 0 ) { // gw == 0.0.0.0
+		del_pkt(m);
 		return 0;
-
-	if (arpResolve(pc, pc->ip4.gw, mac))
-	{
-		memcpy(eh->dst, mac, sizeof(mac));
-		return 1;
 	}
 
-	return 0;
+	return arp_output(pc, pc->ip4.gw, m);
 }
 
 
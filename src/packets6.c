@@ -43,9 +43,10 @@
 #include "utils.h"
 #include "ip.h"
 #include "frag6.h"
+#include "tcp.h"
 
 static struct packet *icmp6Reply(pcs *, struct packet *, char type, char code);
-static struct packet *udp6Reply(struct packet *m0);
+static struct packet *udp6Reply(struct packet *m);
 static void fix_dmac6(pcs *pc, struct packet *m);
 static struct packet* nb_sol(pcs *pc, ip6 *dst);
 static void save_mtu6(pcs *pc, struct packet *m);
@@ -59,7 +60,6 @@ static int save_nb_adv(pcs *pc, struct packet *m);
 /* static void xxpreh(char *e, int c); */
 extern int tcp6(pcs *pc, struct packet *m);
 
-extern u_int time_tick;
 /*
  * ipv6 stack
  *
@@ -99,7 +99,7 @@ int upv6(pcs *pc, struct packet **m0)
 	
 	/* fragment */
 	if (ip6ehdr(ip, m->len - sizeof(ethdr), IPPROTO_FRAGMENT) > 0) {
-		m = ipreass6(m);
+		m = ipreass6(&pc->reass, m);
 		if (m == NULL)
 			return PKT_ENQ;
 		else
@@ -115,12 +115,15 @@ int upv6(pcs *pc, struct packet **m0)
 			return sub_nbsol(pc, m);
 		
 		if (icmp->type == ICMP6_ECHO_REQUEST) {
+			u_short w;
+			
 			swap_ip6head(m);
 		
 			icmp = (icmp6hdr *)(ip + 1);
+			w = *(u_short *)icmp;
 			icmp->type = ICMP6_ECHO_REPLY;
 			icmp->cksum = cksum_fixup(icmp->cksum, 
-			    ICMP6_ECHO_REQUEST, ICMP6_ECHO_REPLY, 0);
+			    w, *(u_short *)icmp, 0);
 			swap_ehead(m->data);
 			
 			/* push m into the background output queue 
@@ -186,15 +189,18 @@ int sub_udp(pcs *pc, struct packet *m)
 	if (memcmp(data, eh->dst, 6) == 0)
 		return PKT_UP;
 	
-	p = (ip->ip6_hlim != 1) ? udp6Reply(m) :
-	    icmp6Reply(pc, m, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOPORT);
-		
-	/* push m into the background output queue 
+	/* push the reply into the background output queue 
 	   which is watched by pth_output */
+	if (ip->ip6_hlim != 1) {
+		/* echo it back in the incoming buffer */
+		enq(&pc->bgoq, udp6Reply(m));
+		return PKT_ENQ;
+	}
+	
+	p = icmp6Reply(pc, m, ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOPORT);
 	if (p != NULL)
 		enq(&pc->bgoq, p);
 
-	/* anyway tell caller to drop this packet */
 	return PKT_DROP;		
 }
 
@@ -311,8 +317,12 @@ int sub_nbadv(pcs *pc, struct packet *m)
 	 *      Length = 1
 	 *      Data: 16-bits reserved
 	 *            32-bits mtu
+	 *
+	 * the readers of all the tap queues may get one, pc->locker6 keeps 
+	 * them out of each other.
 	 */
 	
+	pthread_mutex_lock(&pc->locker6);
 	for (p = (char *)(ndr + 1);
 	    p < ((char*)icmp + ntohs(ip->ip6_plen));
 	    p += *(p + 1) * 8)
@@ -351,6 +361,7 @@ int sub_nbadv(pcs *pc, struct packet *m)
 		pc->mtu = mtu;
 	if (setMac != 0 && mac != NULL)
 		memcpy(pc->ip6.gmac, mac, 6);
+	pthread_mutex_unlock(&pc->locker6);
 
 	return PKT_DROP;	
 }
@@ -436,27 +447,16 @@ int response6(struct packet *m, sesscb *sesscb)
 		sesscb->rack = ntohl(th->th_ack);
 		sesscb->rflags = th->th_flags;
 		sesscb->rttl = ip->ip6_hlim;
-		sesscb->rdsize = ntohs(ip->ip6_plen) - sizeof(iphdr) - (th->th_off << 2);
-		sesscb->data = NULL;
+		sesscb->rdsize = ntohs(ip->ip6_plen) - (th->th_off << 2);
 
-		/* try to get MSS from options */
-		if (sesscb->flags == TH_SYN && sesscb->rdsize > 0 &&
+		if (sesscb->flags == TH_SYN && 
 		    sesscb->rflags == (TH_SYN | TH_ACK)) {
-			int i = 0;
-
-			while ( i < sesscb->rdsize && data[i] == 0x1 ) i++;
-			
-			for (;i < sesscb->rdsize;) {
-				if (data[i] == TCPOPT_MAXSEG && 
-				    data[i + 1] == TCPOLEN_MAXSEG) {
-					sesscb->rmss = (data[i + 2] << 8) + data[i + 3];
-					break;
-				}
-				i += data[i + 1];
-			}
-		} else {
-			sesscb->data = ((char*)(ip + 1)) + (th->th_off << 2);
-		}
+			/* the window of SYN is never scaled */
+			tcp_synopt(sesscb, (u_char *)data, 
+			    (th->th_off << 2) - sizeof(tcphdr));
+			sesscb->rwin = ntohs(th->th_win);
+		} else
+			sesscb->rwin = ntohs(th->th_win) << sesscb->rwscale;
 		
 		return IPPROTO_TCP;
 	}
@@ -495,11 +495,7 @@ struct packet *packet6(pcs *pc) //sesscb *sesscb)
 			} else {
 				dlen = dlen + 2 + 2 + 8;
 			}
-			
-			if (sesscb->rmss != 0 && dlen > sesscb->rmss)
-				dlen = sesscb->rmss - sizeof(ethdr) - 
-				    sizeof(iphdr) - sizeof(tcphdr);
-				
+			/* tcp_send() cuts the data at the mss */
 			len += sizeof(tcphdr) + dlen;
 				
 			break;
@@ -569,11 +565,14 @@ struct packet *packet6(pcs *pc) //sesscb *sesscb)
 		th->th_flags = sesscb->flags;
 		
 		if (sesscb->flags == TH_SYN) {
-			/* mss 1460 */
+			u_short mss = sesscb->mtu - sizeof(ip6hdr) - 
+			    sizeof(tcphdr);
+			
+			/* mss, what the mtu holds */
 			*data++ = TCPOPT_MAXSEG;
 			*data++ = TCPOLEN_MAXSEG;
-			*data++ = 0x5;
-			*data++ = 0xb4;
+			*data++ = mss >> 8;
+			*data++ = mss & 0xff;
 			/* align */
 			*data++ = 0x1;
 			*data++ = 0x1;
@@ -586,7 +585,7 @@ struct packet *packet6(pcs *pc) //sesscb *sesscb)
 			*data++ = 0x1;
 			*data++ = TCPOPT_WINDOW;
 			*data++ = TCPOLEN_WINDOW;
-			*data++ = 1;
+			*data++ = TCP_WSCALE;
 		} else {
 			/* align */
 			*data++ = 0x1;
@@ -602,11 +601,15 @@ struct packet *packet6(pcs *pc) //sesscb *sesscb)
 		th->th_off = (sizeof(tcphdr) + optlen) >> 2;
 		
 		/* fill the data */
-		for (i = optlen; i < dlen; i++) {
-			if ((i % 2) == 0)
-				*data++ = 0xd;
-			else
-				*data++ = 0xa;
+		if (sesscb->data != NULL && dlen > optlen)
+			memcpy(data, sesscb->data, dlen - optlen);
+		else {
+			for (i = optlen; i < dlen; i++) {
+				if ((i % 2) == 0)
+					*data++ = 0xd;
+				else
+					*data++ = 0xa;
+			}
 		}
 
 		th->th_sum = 0;
@@ -688,18 +691,14 @@ struct packet *icmp6Reply(pcs *pc, struct packet *m0, char icmptype, char icmpco
 	return m;
 }
 
-struct packet *udp6Reply(struct packet *m0)
+/*
+ * turn the incoming datagram into the reply in place
+ */
+struct packet *udp6Reply(struct packet *m)
 {
 	ethdr *eh;
 	ip6hdr *ip;
 	udphdr *ui;
-	struct packet *m;
-	
-	m = new_pkt(m0->len);
-	if (m == NULL)
-		return NULL;
-	
-	copy_pkt(m, m0);
 	
 	eh = (ethdr *)(m->data);
 	ip = (ip6hdr *)(eh + 1);
@@ -727,9 +726,28 @@ struct packet *udp6Reply(struct packet *m0)
  *   NULL, not found
  *
  */
-u_char *nbDiscovery(pcs *pc, ip6 *dst)
+/* 
+ * the entry of dst in the neighbor cache, -1 if none. An entry is not 
+ * reused for 120 seconds, the mac stays good for the caller.
+ */
+static int nb_lookup(pcs *pc, ip6 *dst)
 {
 	int i;
+	
+	pthread_mutex_lock(&pc->locker6);
+	for (i = 0; i < POOL_SIZE; i++) {
+		if (sameNet6((char *)pc->ipmac6[i].ip.addr8, 
+		    (char *)dst->addr8, 128))
+			break;
+	}
+	pthread_mutex_unlock(&pc->locker6);
+	
+	return (i < POOL_SIZE) ? i : -1;
+}
+
+u_char *nbDiscovery(pcs *pc, ip6 *dst)
+{
+	int i, k;
 	static u_char mac[ETH_ALEN] = {0x0, 0x0, 0x0, 0x0, 0x0, 0x0};	
 	int waittime = 1000;
 	struct timeval tv;
@@ -768,11 +786,8 @@ u_char *nbDiscovery(pcs *pc, ip6 *dst)
 		return NULL;
 	} else {
 		/* search neightbor cache */
-		for (i = 0; i < POOL_SIZE; i++) {
-			if (sameNet6((char *)pc->ipmac6[i].ip.addr8, 
-			    (char *)dst->addr8, 128))
-				return (pc->ipmac6[i].mac);
-		}
+		if ((i = nb_lookup(pc, dst)) >= 0)
+			return (pc->ipmac6[i].mac);
 	}
 	
 	/* find neighbor */
@@ -791,11 +806,8 @@ u_char *nbDiscovery(pcs *pc, ip6 *dst)
 		gettimeofday(&(tv), (void*)0);
 		while (!timeout(tv, waittime)) {
 			delay_ms(1);
-			for (i = 0; i < POOL_SIZE; i++) {
-				if (sameNet6((char *)pc->ipmac6[i].ip.addr8, 
-				    (char *)dst->addr8, 128))
-					return (pc->ipmac6[i].mac);
-			}
+			if ((k = nb_lookup(pc, dst)) >= 0)
+				return (pc->ipmac6[k].mac);
 		}
 	}
 	return NULL;
@@ -963,6 +975,7 @@ int save_nb_adv(pcs *pc, struct packet *m)
 	if (nsopt->type != 2)
 		return -1;
 
+	pthread_mutex_lock(&pc->locker6);
 	i = 0;
 	while (i < POOL_SIZE) {
 		if (IP6EQ(&pc->ipmac6[i].ip, &ip->src) &&
@@ -988,6 +1001,7 @@ int save_nb_adv(pcs *pc, struct packet *m)
 		memcpy(pc->ipmac6[i].ip.addr8, ip->src.addr8, 16);
 		pc->ipmac6[i].timeout = time_tick;
 	}
+	pthread_mutex_unlock(&pc->locker6);
 
 	return i;
 }
@@ -1020,7 +1034,7 @@ int ip6ehdr(ip6hdr *ip, int plen, int hdrtype)
 		eh = (ip6eh *)(((char *)ip) + off);
 		switch (nxt) {
 			case IPPROTO_AH:
-				off = (eh->len) << 2;
+				off += (eh->len + 2) << 2;
 				break;
 			default:
 				off += (eh->len + 1) << 3;
@@ -1052,10 +1066,12 @@ void save_mtu6(pcs *pc, struct packet *m)
 	ip0 = (ip6hdr *)(m->data + sizeof(ethdr) + 
 	    sizeof(ip6hdr) + sizeof(icmp6hdr));
 	
+	pthread_mutex_lock(&pc->locker6);
 	for (i = 0, n = -1; i < POOL_SIZE; i++) {
 		if (IP6EQ(&ip0->dst, &pc->ip6mtu[i].ip)) {
 			pc->ip6mtu[i].mtu = ntohl(icmp->icmp6_mtu);
 			pc->ip6mtu[i].timeout = time_tick;
+			pthread_mutex_unlock(&pc->locker6);
 			return;
 		}
 		if ((n < 0) && 
@@ -1068,19 +1084,25 @@ void save_mtu6(pcs *pc, struct packet *m)
 		pc->ip6mtu[n].timeout = time_tick;
 		memcpy(pc->ip6mtu[n].ip.addr8, ip0->dst.addr8, 16);
 	}
+	pthread_mutex_unlock(&pc->locker6);
 }
 
 int findmtu6(pcs *pc, ip6 *src)
 {
-	int i;
+	int i, mtu = pc->mtu;
 	
+	pthread_mutex_lock(&pc->locker6);
 	for (i = 0; i < POOL_SIZE; i++) {
 		if (time_tick - pc->ip6mtu[i].timeout > POOL_TIMEOUT)
 			continue;
-		if (IP6EQ(src, &pc->ip6mtu[i].ip))
-			return pc->ip6mtu[i].mtu;
+		if (IP6EQ(src, &pc->ip6mtu[i].ip)) {
+			mtu = pc->ip6mtu[i].mtu;
+			break;
+		}
 	}
-	return pc->mtu;
+	pthread_mutex_unlock(&pc->locker6);
+	
+	return mtu;
 }
 
 /* end of file */
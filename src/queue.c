@@ -30,6 +30,10 @@
 #include <time.h>
 #include "queue.h"
 
+#define LOAD_ACQ(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define MBARRIER()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 void
 free_pkts(struct packet *m)
 {
@@ -42,93 +46,374 @@ free_pkts(struct packet *m)
 	}
 }
 
-void del_pkt(struct packet *m)
+struct pktcache {
+	int n;
+	struct packet *slot[PKT_CACHE_SIZE];
+};
+
+static struct {
+	pthread_mutex_t locker;
+	struct packet *free;		/* depot */
+	u_int idle;
+	u_int total;
+	u_int exhausted;
+	u_int oversize;
+	u_int nomem;
+} pool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0};
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/* give back n slots of the cache to the depot */
+static void depot_put(struct pktcache *pc, int n)
 {
-	free(m);
+	struct packet *m;
+	
+	pthread_mutex_lock(&pool.locker);
+	while (n-- > 0 && pc->n > 0) {
+		m = pc->slot[--pc->n];
+		m->next = pool.free;
+		pool.free = m;
+		pool.idle++;
+	}
+	pthread_mutex_unlock(&pool.locker);
 }
 
-struct packet *new_pkt(int len)
+/* refill the cache with up to n slots, grow the pool if the depot is empty */
+static void depot_get(struct pktcache *pc, int n)
 {
-	struct packet *m = NULL;
+	struct packet *m;
+	char *p;
+	int i;
 	
-	m = (struct packet *)malloc(len + sizeof(struct packet));
-	if (m != NULL) {
-		memset(m, 0, len + sizeof(struct packet));
-		m->len = len;
-		return m;
-	} else
-		return NULL;
+	pthread_mutex_lock(&pool.locker);
+	if (pool.free == NULL && pool.total < PKT_POOL_MAX) {
+		p = malloc(PKT_CHUNK * PKT_SLOTSIZE);
+		if (p != NULL) {
+			for (i = 0; i < PKT_CHUNK; i++) {
+				m = (struct packet *)(p + i * PKT_SLOTSIZE);
+				m->next = pool.free;
+				pool.free = m;
+			}
+			pool.idle += PKT_CHUNK;
+			pool.total += PKT_CHUNK;
+		}
+	}
+	while (n-- > 0 && pool.free != NULL) {
+		m = pool.free;
+		pool.free = m->next;
+		pool.idle--;
+		pc->slot[pc->n++] = m;
+	}
+	pthread_mutex_unlock(&pool.locker);
 }
 
-struct packet *deq_impl(struct pq *pq, int cond)
+static void cache_destroy(void *arg)
 {
-	struct packet *m = NULL;
+	struct pktcache *pc = arg;
 	
-	lock_q(pq);
+	depot_put(pc, pc->n);
+	free(pc);
+}
+
+static void cache_init(void)
+{
+	pthread_key_create(&cache_key, cache_destroy);
+}
+
+static struct pktcache *get_cache(void)
+{
+	struct pktcache *pc;
+	
+	pthread_once(&cache_once, cache_init);
+	pc = pthread_getspecific(cache_key);
+	if (pc == NULL) {
+		pc = malloc(sizeof(struct pktcache));
+		if (pc == NULL)
+			return NULL;
+		pc->n = 0;
+		pthread_setspecific(cache_key, pc);
+	}
 	
-	if (cond && (pq->q == NULL))
-		pthread_cond_wait(&(pq->cond), &(pq->locker));
+	return pc;
+}
 
-	if (pq->q != NULL) {
-		m = pq->q;
-		pq->q = pq->q->next;
-		pq->size --;
-		m->next = NULL;
-	}	
+void del_pkt(struct packet *m)
+{
+	struct pktcache *pc;
 	
-	ulock_q(pq);
+	if (m == NULL)
+		return;
+		
+	if (!(m->flags & PKT_F_POOL)) {
+		free(m);
+		return;
+	}
+	
+	pc = get_cache();
+	if (pc == NULL) {
+		pthread_mutex_lock(&pool.locker);
+		m->next = pool.free;
+		pool.free = m;
+		pool.idle++;
+		pthread_mutex_unlock(&pool.locker);
+		return;
+	}
+	if (pc->n == PKT_CACHE_SIZE)
+		depot_put(pc, PKT_CACHE_SIZE / 2);
+	pc->slot[pc->n++] = m;
+}
 
+/*
+ * get a packet buffer, the data area is NOT initialized
+ */
+struct packet *alloc_pkt(int len)
+{
+	struct pktcache *pc;
+	struct packet *m = NULL;
+	
+	if (len <= PKT_BUFSIZE && (pc = get_cache()) != NULL) {
+		if (pc->n == 0)
+			depot_get(pc, PKT_CACHE_SIZE / 2);
+		if (pc->n > 0) {
+			m = pc->slot[--pc->n];
+			m->flags = PKT_F_POOL;
+		} else
+			__atomic_add_fetch(&pool.exhausted, 1, __ATOMIC_RELAXED);
+	} else if (len > PKT_BUFSIZE)
+		__atomic_add_fetch(&pool.oversize, 1, __ATOMIC_RELAXED);
+	
+	if (m == NULL) {
+		m = (struct packet *)malloc(len + sizeof(struct packet));
+		if (m == NULL) {
+			__atomic_add_fetch(&pool.nomem, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		m->flags = 0;
+	}
+	m->next = NULL;
+	m->len = len;
+	m->gso_size = 0;
+	m->ts.tv_sec = 0;
+	m->ts.tv_usec = 0;
+	
 	return m;
 }
 
-struct packet *deq(struct pq *pq)
+/*
+ * get a packet buffer, the first len octets are zeroed, 
+ * for the callers which build the frame field by field.
+ */
+struct packet *new_pkt(int len)
 {
-	return deq_impl(pq, 0);
+	struct packet *m;
+	
+	m = alloc_pkt(len);
+	if (m != NULL)
+		memset(m->data, 0, len);
+	
+	return m;
 }
 
-struct packet *waitdeq(struct pq *pq)
+void pktpool_stat(struct pktpool_stat *st)
 {
-	return deq_impl(pq, 1);
+	pthread_mutex_lock(&pool.locker);
+	st->total = pool.total;
+	st->idle = pool.idle;
+	pthread_mutex_unlock(&pool.locker);
+	st->exhausted = __atomic_load_n(&pool.exhausted, __ATOMIC_RELAXED);
+	st->oversize = __atomic_load_n(&pool.oversize, __ATOMIC_RELAXED);
+	st->nomem = __atomic_load_n(&pool.nomem, __ATOMIC_RELAXED);
 }
 
-struct packet *enq(struct pq *pq, struct packet *m)
+/* 
+ * wake up the consumer if it is sleeping in waitdeq,
+ * the fence pairs with the one in waitdeq_batch.
+ */
+static void wakeup(struct pq *pq)
 {
-	struct packet *q = NULL;
-	
-	if (pq->size == PKTQ_SIZE) {
-		printf("queue is full \n");
-		return NULL;
+	MBARRIER();
+	if (__atomic_load_n(&pq->waiting, __ATOMIC_RELAXED)) {
+		lock_q(pq);
+		pthread_cond_signal(&(pq->cond));
+		ulock_q(pq);
 	}
+}
 
-	lock_q(pq);
+/*
+ * put n packets into the ring, return the count of the queued packets.
+ * the packets which are not queued still belong to the caller.
+ */
+int enq_batch(struct pq *pq, struct packet **pkts, int n)
+{
+	u_int t, h;
+	int i;
+	
+	if (n <= 0)
+		return 0;
 
-	gettimeofday(&(m->ts), (void*)0);
+	if (pq->flags & PQ_MPROD)
+		pthread_mutex_lock(&(pq->plocker));
+	
+	t = pq->tail;
+	h = LOAD_ACQ(&pq->head);
+	if (n > PKTQ_SIZE - (int)(t - h))
+		n = PKTQ_SIZE - (t - h);
 	
-	if (pq->q == NULL)
-		pq->q = m;
-	else {
-		q = pq->q;
-		while (q->next != NULL) q = q->next;
-		q->next = m;	
+	for (i = 0; i < n; i++) {
+		pkts[i]->next = NULL;
+		if (pkts[i]->ts.tv_sec == 0)
+			gettimeofday(&(pkts[i]->ts), (void*)0);
+		pq->ring[(t + i) & PKTQ_MASK] = pkts[i];
 	}
+	if (n > 0)
+		STORE_REL(&pq->tail, t + n);
+		
+	if (pq->flags & PQ_MPROD)
+		pthread_mutex_unlock(&(pq->plocker));
+	
+	if (n > 0)
+		wakeup(pq);
+	
+	return n;
+}
 
-	while (m) {
-		pq->size ++;
-		m = m->next;
+/*
+ * get up to n packets from the ring, return the count.
+ */
+int deq_batch(struct pq *pq, struct packet **pkts, int n)
+{
+	u_int h, t;
+	int i;
+	
+	h = pq->head;
+	t = LOAD_ACQ(&pq->tail);
+	if (n > (int)(t - h))
+		n = t - h;
+	
+	for (i = 0; i < n; i++)
+		pkts[i] = pq->ring[(h + i) & PKTQ_MASK];
+	
+	if (n > 0)
+		STORE_REL(&pq->head, h + n);
+	
+	return n;
+}
+
+int waitdeq_batch(struct pq *pq, struct packet **pkts, int n)
+{
+	int k;
+	
+	while ((k = deq_batch(pq, pkts, n)) == 0) {
+		lock_q(pq);
+		__atomic_store_n(&pq->waiting, 1, __ATOMIC_RELAXED);
+		MBARRIER();
+		if (LOAD_ACQ(&pq->tail) == pq->head)
+			pthread_cond_wait(&(pq->cond), &(pq->locker));
+		__atomic_store_n(&pq->waiting, 0, __ATOMIC_RELAXED);
+		ulock_q(pq);
 	}
-	pthread_cond_signal(&(pq->cond));
+	
+	return k;
+}
 
+/*
+ * like waitdeq_batch, but give up after usec microseconds
+ */
+int timedwaitdeq_batch(struct pq *pq, struct packet **pkts, int n, int usec)
+{
+	struct timeval now;
+	struct timespec ts;
+	int k;
+	
+	if ((k = deq_batch(pq, pkts, n)) != 0 || usec <= 0)
+		return k;
+	
+	gettimeofday(&now, (void*)0);
+	now.tv_usec += usec;
+	ts.tv_sec = now.tv_sec + now.tv_usec / 1000000;
+	ts.tv_nsec = (now.tv_usec % 1000000) * 1000;
+	
+	lock_q(pq);
+	__atomic_store_n(&pq->waiting, 1, __ATOMIC_RELAXED);
+	MBARRIER();
+	if (LOAD_ACQ(&pq->tail) == pq->head)
+		pthread_cond_timedwait(&(pq->cond), &(pq->locker), &ts);
+	__atomic_store_n(&pq->waiting, 0, __ATOMIC_RELAXED);
 	ulock_q(pq);
 	
-	return q;
+	return deq_batch(pq, pkts, n);
+}
+
+struct packet *deq(struct pq *pq)
+{
+	struct packet *m = NULL;
+	
+	if (deq_batch(pq, &m, 1) == 1)
+		return m;
+	
+	return NULL;
+}
+
+struct packet *waitdeq(struct pq *pq)
+{
+	struct packet *m = NULL;
+	
+	waitdeq_batch(pq, &m, 1);
+	
+	return m;
+}
+
+/*
+ * enqueue a packet or a chain of packets (fragments), 
+ * the packets that do not fit are dropped.
+ * return NULL if any packet was dropped.
+ */
+struct packet *enq(struct pq *pq, struct packet *m)
+{
+	struct packet *pkts[PKTQ_SIZE];
+	struct packet *m0 = m;
+	int n, k, i;
+	
+	n = 0;
+	while (m && n < PKTQ_SIZE) {
+		pkts[n++] = m;
+		m = m->next;
+	}
+	
+	k = enq_batch(pq, pkts, n);
+	if (k == n && m == NULL)
+		return m0;
+
+	/* queue is full */
+	for (i = k; i < n; i++) {
+		pkts[i]->next = NULL;
+		del_pkt(pkts[i]);
+	}
+	for (n -= k; m; m = m0, n++) {
+		m0 = m->next;
+		del_pkt(m);
+	}
+	__atomic_add_fetch(&pq->drops, n, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+int qlen(struct pq *pq)
+{
+	return (LOAD_ACQ(&pq->tail) - LOAD_ACQ(&pq->head));
 }
 
-void init_queue(struct pq *pq)
+void init_queue(struct pq *pq, int flags)
 {
 	pthread_mutex_init(&(pq->locker), NULL);
+	pthread_mutex_init(&(pq->plocker), NULL);
 	pthread_cond_init(&(pq->cond), NULL);
-	pq->ip = 0;
-	pq->size = 0;
+	pq->head = 0;
+	pq->tail = 0;
+	pq->waiting = 0;
+	pq->drops = 0;
+	pq->flags = flags;
 }
 
 void lock_q(struct pq *pq)
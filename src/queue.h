@@ -31,7 +31,13 @@
 #include <pthread.h>		
 #include <sys/time.h>
 
-#define PKTQ_SIZE	(101)
+#define PKTQ_SIZE	(256)		/* ring slots, must be a power of 2 */
+#define PKTQ_MASK	(PKTQ_SIZE - 1)
+#define PKT_BURST	(32)		/* packets per batch */
+
+#ifndef CACHELINE_SIZE
+#define CACHELINE_SIZE	64
+#endif
 
 #define PKT_DROP	0	/* drop it */
 #define PKT_ENQ		1	/* enqueued */
@@ -40,17 +46,59 @@
 struct packet {
 	struct packet *next;
 	int len;
+	int flags;
+#define PKT_F_POOL	0x1		/* buffer belongs to the pool */
+#define PKT_F_CSUM	0x2		/* l4 checksum left to the device */
+	int gso_size;			/* mss, the device cuts the segment */
 	struct timeval ts;
 	char data[0];
 };
 
+/*
+ * packet buffer pool
+ *
+ * fixed size slots carved from big chunks, every thread keeps a small 
+ * cache of free slots and only touches the shared depot (under a lock)
+ * to refill or to give back half of the cache. The packets larger than
+ * PKT_BUFSIZE (reassembled datagrams, big tcp segments) and the packets 
+ * allocated when the pool is exhausted come from malloc.
+ */
+#define PKT_SLOTSIZE	(2048)
+#define PKT_BUFSIZE	(PKT_SLOTSIZE - (int)sizeof(struct packet))
+#define PKT_CHUNK	(256)		/* slots per chunk */
+#define PKT_POOL_MAX	(64 * PKT_CHUNK)	/* 32MB */
+#define PKT_CACHE_SIZE	(64)		/* per thread */
+
+struct pktpool_stat {
+	u_int total;			/* slots */
+	u_int idle;			/* slots in the depot */
+	u_int exhausted;		/* pool empty, fallback to malloc */
+	u_int oversize;			/* larger than PKT_BUFSIZE */
+	u_int nomem;			/* malloc failed */
+};
+
+/*
+ * bounded single-producer/single-consumer ring
+ *
+ * head is only written by the consumer, tail only by the producer, each 
+ * lives on its own cache line. The queues shared by several producers 
+ * (oq, bgoq) are created with PQ_MPROD, the producers are serialized by 
+ * plocker, the consumer side is always lock-free.
+ */
 struct pq {
-	int type;				/* for debug */
-	int ip;					/* pointer of the queue */
-	int size;				/* size of queue */
+	u_int head __attribute__((aligned(CACHELINE_SIZE)));	/* consumer */
+	int waiting;				/* consumer sleeps on cond */
+	
+	u_int tail __attribute__((aligned(CACHELINE_SIZE)));	/* producer */
+	u_int drops;				/* full, dropped */
+	pthread_mutex_t plocker;		/* producer lock if PQ_MPROD */
+	
+	int type __attribute__((aligned(CACHELINE_SIZE)));	/* for debug */
+	int flags;
+#define PQ_MPROD	0x1		/* multiple producers */
 	pthread_mutex_t locker;
 	pthread_cond_t cond;
-	struct packet *q;
+	struct packet *ring[PKTQ_SIZE];
 };
 
 #define copy_pkt(dst, src) { \
@@ -59,15 +107,22 @@ struct pq {
 	dst->ts = src->ts; \
 }
 
-void init_queue(struct pq*);
+void init_queue(struct pq*, int flags);
 struct packet *enq(struct pq*, struct packet *pkt);
 struct packet *deq(struct pq*);
 struct packet *waitdeq(struct pq *pq);
+int enq_batch(struct pq *pq, struct packet **pkts, int n);
+int deq_batch(struct pq *pq, struct packet **pkts, int n);
+int waitdeq_batch(struct pq *pq, struct packet **pkts, int n);
+int timedwaitdeq_batch(struct pq *pq, struct packet **pkts, int n, int usec);
+int qlen(struct pq *pq);
 void lock_q(struct pq*);
 void ulock_q(struct pq*);
 struct packet *new_pkt(int len);
+struct packet *alloc_pkt(int len);
 void del_pkt(struct packet *m);
 void free_pkts(struct packet *m);
+void pktpool_stat(struct pktpool_stat *st);
 
 #endif
 
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "queue.h"
+#include "timer.h"
+#include "reass.h"
+
+/* RFC 815, kept at the first byte of the hole, a hole is 8 bytes at least */
+struct hole {
+	u_short first;
+	u_short last;			/* inclusive */
+	u_short next;			/* the next hole, REASS_NOHOLE none */
+};
+
+#define REASS_NOHOLE	0xffff
+
+#define CHARGE(q)	((q)->hlen + (q)->size + (int)sizeof(struct reassq))
+
+static void reass_expire(void *arg);
+
+static u_int reass_hash(const u_char *key, int keylen)
+{
+	u_int h = 2166136261u;
+	int i;
+	
+	for (i = 0; i < keylen; i++) {
+		h ^= key[i];
+		h *= 16777619;
+	}
+	
+	return h & (REASS_HASHSIZE - 1);
+}
+
+static void hole_get(struct reassq *q, int off, struct hole *hd)
+{
+	memcpy(hd, q->m->data + q->hlen + off, sizeof(struct hole));
+}
+
+static void hole_put(struct reassq *q, int first, int last, int next)
+{
+	struct hole hd;
+	
+	hd.first = first;
+	hd.last = last;
+	hd.next = next;
+	memcpy(q->m->data + q->hlen + first, &hd, sizeof(struct hole));
+}
+
+static void lru_unlink(struct reasstab *rt, struct reassq *q)
+{
+	if (q->lprev)
+		q->lprev->lnext = q->lnext;
+	else
+		rt->lru = q->lnext;
+	if (q->lnext)
+		q->lnext->lprev = q->lprev;
+	else
+		rt->ltail = q->lprev;
+}
+
+static void lru_push(struct reasstab *rt, struct reassq *q)
+{
+	q->lprev = NULL;
+	q->lnext = rt->lru;
+	if (rt->lru)
+		rt->lru->lprev = q;
+	else
+		rt->ltail = q;
+	rt->lru = q;
+}
+
+/* take the datagram out of the table, the buffer is left to the caller */
+static void reass_unlink(struct reasstab *rt, struct reassq *q)
+{
+	struct reassq **pp;
+	
+	pp = &rt->hash[reass_hash(q->key, q->keylen)];
+	while (*pp != q)
+		pp = &(*pp)->next;
+	*pp = q->next;
+	
+	lru_unlink(rt, q);
+	rt->mem -= CHARGE(q);
+	rt->count--;
+}
+
+static void reass_drop(struct reasstab *rt, struct reassq *q)
+{
+	reass_unlink(rt, q);
+	del_pkt(q->m);
+	free(q);
+}
+
+/* make room for size bytes, the oldest datagrams but keep go first */
+static int reass_room(struct reasstab *rt, int size, struct reassq *keep)
+{
+	while (rt->mem + size > rt->budget) {
+		if (rt->ltail == NULL || rt->ltail == keep)
+			return 0;
+		reass_drop(rt, rt->ltail);
+		rt->evictions++;
+	}
+	
+	return 1;
+}
+
+/* the buffer for at least need bytes of the payload, by doubling */
+static int reass_bufsize(int size, int need)
+{
+	if (size < REASS_MINBUF)
+		size = REASS_MINBUF;
+	while (size < need)
+		size <<= 1;
+	if (size > REASS_MAXDATA + 1)
+		size = REASS_MAXDATA + 1;
+	
+	return size;
+}
+
+static int reass_grow(struct reasstab *rt, struct reassq *q, int need)
+{
+	struct packet *m;
+	int size;
+	
+	size = reass_bufsize(q->size, need);
+	if (!reass_room(rt, size - q->size, q))
+		return 0;
+	
+	m = alloc_pkt(q->hlen + size);
+	if (m == NULL)
+		return 0;
+	memcpy(m->data, q->m->data, q->hlen + q->size);
+	del_pkt(q->m);
+	q->m = m;
+	rt->mem += size - q->size;
+	q->size = size;
+	
+	return 1;
+}
+
+static struct reassq *reass_new(struct reasstab *rt, const void *key, 
+    int keylen, int hlen, int need, int maxdata)
+{
+	struct reassq *q;
+	int size, h;
+	
+	size = reass_bufsize(0, need);
+	if (!reass_room(rt, hlen + size + sizeof(struct reassq), NULL)) {
+		rt->evictions++;
+		return NULL;
+	}
+	
+	q = malloc(sizeof(struct reassq));
+	if (q == NULL)
+		return NULL;
+	q->m = alloc_pkt(hlen + size);
+	if (q->m == NULL) {
+		free(q);
+		return NULL;
+	}
+	
+	memcpy(q->key, key, keylen);
+	q->keylen = keylen;
+	q->expired = time_tick;
+	q->hlen = hlen;
+	q->head = 0;
+	q->total = -1;
+	q->size = size;
+	q->holes = 0;
+	hole_put(q, 0, maxdata - 1, REASS_NOHOLE);
+	
+	h = reass_hash(key, keylen);
+	q->next = rt->hash[h];
+	rt->hash[h] = q;
+	lru_push(rt, q);
+	rt->mem += CHARGE(q);
+	rt->count++;
+	
+	if (!timer_pending(&rt->timer))
+		timer_add(&rt->timer, (REASS_TIMEOUT + 1) * 1000);
+	
+	return q;
+}
+
+/* point the hole prev, or the list if none, to the hole link */
+static void hole_link(struct reassq *q, int prev, int link)
+{
+	struct hole hd;
+	
+	if (prev == REASS_NOHOLE) {
+		q->holes = link;
+		return;
+	}
+	hole_get(q, prev, &hd);
+	hole_put(q, hd.first, hd.last, link);
+}
+
+/* 
+ * fill the holes the fragment [first, last] covers, return the bytes 
+ * copied, less than the fragment if it overlaps
+ */
+static int reass_fill(struct reassq *q, int first, int last, 
+    const char *data, int more)
+{
+	struct hole hd;
+	int cur, prev, link, tail, lo, hi;
+	int n = 0;
+	
+	prev = REASS_NOHOLE;
+	for (cur = q->holes; cur != REASS_NOHOLE; cur = hd.next) {
+		hole_get(q, cur, &hd);
+		/* the holes after the last fragment are gone too */
+		if (first > hd.last || (last < hd.first && more)) {
+			prev = cur;
+			continue;
+		}
+		
+		lo = (first > hd.first) ? first : hd.first;
+		hi = (last < hd.last) ? last : hd.last;
+		if (lo <= hi) {
+			memcpy(q->m->data + q->hlen + lo, data + lo - first, 
+			    hi - lo + 1);
+			n += hi - lo + 1;
+		}
+		
+		/* the pieces left take the place of the hole */
+		link = hd.next;
+		tail = REASS_NOHOLE;
+		if (more && last < hd.last) {
+			hole_put(q, last + 1, hd.last, link);
+			link = tail = last + 1;
+		}
+		if (first > hd.first) {
+			hole_put(q, hd.first, first - 1, link);
+			link = hd.first;
+			if (tail == REASS_NOHOLE)
+				tail = link;
+		}
+		hole_link(q, prev, link);
+		if (tail != REASS_NOHOLE)
+			prev = tail;
+	}
+	
+	return n;
+}
+
+/*
+ * add the payload [off, off + len) of a fragment of the datagram key,
+ * hdr is the ether and ip headers before the payload, maxdata the
+ * largest payload the headers can carry. Return the 
+ * datagram when it is completed, the headers of the first fragment and
+ * the payload, the caller fixes the headers.
+ */
+struct packet *
+reass_add(struct reasstab *rt, const void *key, int keylen, 
+    const char *hdr, int hlen, int off, const char *data, int len, int more,
+    int maxdata)
+{
+	struct reassq *q;
+	struct packet *m = NULL;
+	int first, last, need, h;
+	
+	/* all but the last carry a multiple of 8 bytes */
+	if (len <= 0 || (off & 0x7) || (more && (len & 0x7)) || 
+	    off + len > maxdata || maxdata > REASS_MAXDATA || 
+	    keylen > REASS_KEYLEN) {
+		__atomic_add_fetch(&rt->invalid, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	first = off;
+	last = off + len - 1;
+	need = more ? last + 1 + sizeof(struct hole) : last + 1;
+	
+	h = reass_hash(key, keylen);
+	
+	pthread_mutex_lock(&rt->locker);
+	for (q = rt->hash[h]; q != NULL; q = q->next) {
+		if (q->keylen == keylen && !memcmp(q->key, key, keylen))
+			break;
+	}
+	if (q == NULL) {
+		q = reass_new(rt, key, keylen, hlen, need, maxdata);
+		if (q == NULL)
+			goto out;
+	} else {
+		lru_unlink(rt, q);
+		lru_push(rt, q);
+	}
+	
+	if (q->hlen != hlen) {
+		rt->invalid++;
+		goto out;
+	}
+	if (need > q->size && !reass_grow(rt, q, need)) {
+		reass_drop(rt, q);
+		rt->evictions++;
+		goto out;
+	}
+	
+	if (reass_fill(q, first, last, data, more) < len)
+		rt->overlaps++;
+	if (off == 0 && !q->head) {
+		memcpy(q->m->data, hdr, hlen);
+		q->head = 1;
+	}
+	if (!more)
+		q->total = last + 1;
+	
+	if (q->holes != REASS_NOHOLE || !q->head || q->total < 0)
+		goto out;
+	
+	reass_unlink(rt, q);
+	m = q->m;
+	m->len = q->hlen + q->total;
+	free(q);
+	rt->done++;
+	
+out:
+	pthread_mutex_unlock(&rt->locker);
+	
+	return m;
+}
+
+/* drop the datagrams which are not completed in REASS_TIMEOUT */
+static void reass_expire(void *arg)
+{
+	struct reasstab *rt = arg;
+	struct reassq *q, *next;
+	int t, wait = 0;
+	
+	pthread_mutex_lock(&rt->locker);
+	for (q = rt->lru; q != NULL; q = next) {
+		next = q->lnext;
+		if (time_tick - q->expired > REASS_TIMEOUT) {
+			reass_drop(rt, q);
+			rt->timeouts++;
+			continue;
+		}
+		t = REASS_TIMEOUT + 1 - (time_tick - q->expired);
+		if (wait == 0 || t < wait)
+			wait = t;
+	}
+	if (wait)
+		timer_add(&rt->timer, wait * 1000);
+	pthread_mutex_unlock(&rt->locker);
+}
+
+void reass_budget(struct reasstab *rt, u_int kb)
+{
+	pthread_mutex_lock(&rt->locker);
+	rt->budget = kb << 10;
+	reass_room(rt, 0, NULL);
+	pthread_mutex_unlock(&rt->locker);
+}
+
+void reass_init(struct reasstab *rt)
+{
+	memset(rt, 0, sizeof(struct reasstab));
+	rt->budget = REASS_BUDGET << 10;
+	pthread_mutex_init(&rt->locker, NULL);
+	timer_set(&rt->timer, reass_expire, rt);
+}
+
+/* end of file */
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+
+#ifndef _REASS_H_
+#define _REASS_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "queue.h"
+#include "timer.h"
+
+/*
+ * fragment reassembly, shared by ipv4 and ipv6
+ *
+ * A datagram is reassembled in one buffer, the payload right after the
+ * headers of its first fragment. The missing parts are tracked by the 
+ * hole descriptors of RFC 815, kept in the holes themselves, so any 
+ * fragment, overlapping or duplicated, touches only the holes it covers
+ * and the bytes already received are never overwritten. The buffer 
+ * grows by doubling up to the largest datagram.
+ *
+ * The buffers of a VPC are charged to its budget, the least recently 
+ * used datagram is evicted if a new fragment does not fit in.
+ */
+#define REASS_HASHSIZE	64		/* power of 2 */
+#define REASS_KEYLEN	40		/* ipv6 src, dst, ident */
+#define REASS_MAXDATA	65535		/* the largest payload, ipv6 */
+#define REASS_MINBUF	4096
+#define REASS_BUDGET	1024		/* KB per VPC, default */
+#define REASS_TIMEOUT	30		/* seconds */
+
+struct reassq {
+	struct reassq *next;		/* hash chain */
+	struct reassq *lprev;		/* lru, the head is the newest */
+	struct reassq *lnext;
+	u_int expired;			/* time_tick of the first fragment */
+	u_char key[REASS_KEYLEN];
+	int keylen;
+	int hlen;			/* ether and ip headers */
+	int head;			/* the first fragment arrived */
+	int total;			/* payload, -1 till the last arrives */
+	int holes;			/* the first hole, REASS_NOHOLE none */
+	int size;			/* of the payload buffer */
+	struct packet *m;
+};
+
+struct reasstab {
+	struct reassq *hash[REASS_HASHSIZE];
+	struct reassq *lru;		/* the newest */
+	struct reassq *ltail;		/* the oldest */
+	int count;			/* datagrams in progress */
+	u_int mem;			/* bytes charged */
+	u_int budget;			/* bytes */
+	pthread_mutex_t locker;		/* the readers of the queues, timer */
+	struct vtimer timer;		/* drops the expired datagrams */
+	
+	/* counters */
+	u_int done;			/* reassembled */
+	u_int timeouts;
+	u_int overlaps;			/* fragments overlapping, duplicated */
+	u_int evictions;		/* over the budget */
+	u_int invalid;
+};
+
+void reass_init(struct reasstab *rt);
+void reass_budget(struct reasstab *rt, u_int kb);
+struct packet *reass_add(struct reasstab *rt, const void *key, int keylen, 
+    const char *hdr, int hlen, int off, const char *data, int len, 
+    int more, int maxdata);
+
+#endif
+
+/* end of file */
@@ -35,6 +35,7 @@
 #include "dev.h"
 #include "relay.h"
 #include "dump.h"
+#include "agg.h"
 
 struct node {
 	u_int32_t ip;
@@ -50,8 +51,9 @@ struct peerlist {
 static struct peerlist *peerlist = NULL;
 static int relay_fd = 0;
 static int relay_port = 0;
-static FILE *relay_dumpfile = NULL;
+static struct dmpfile *relay_dumpfile = NULL;
 static int relaydump = 0;
+static struct capring *relay_capring = NULL;	/* flight recorder */
 extern int runRelay;
 
 int run_relay(int argc, char **argv)
@@ -68,6 +70,19 @@ int run_relay(int argc, char **argv)
 		return 0;
 	}
 	
+	if (argc >= 3 && argc <= 4 && !strcmp(argv[1], "dump") && 
+	    !strcmp(argv[2], "flush")) {
+		char fname[128];
+		
+		i = cap_flush(relay_capring, (argc == 4) ? argv[3] : "relay", 
+		    fname, sizeof(fname));
+		if (i < 0)
+			printf("Can not save the relay packets\n");
+		else
+			printf("%d frames saved to %s\n", i, fname);
+		return 0;
+	}
+	
 	if (argc == 3 && !strcmp(argv[1], "dump")) {
 		if (!strcasecmp(argv[2], "on"))
 			relaydump = 1;
@@ -311,6 +326,20 @@ void save_relay(FILE *fp)
 	}
 }
 
+static int dmp_frame(const char *frame, int len, void *fp)
+{
+	dmp_buffer2file(frame, len, (struct dmpfile *)fp);
+	
+	return 1;
+}
+
+static int cap_frame(const char *frame, int len, void *cr)
+{
+	cap_buffer((struct capring *)cr, frame, len);
+	
+	return 1;
+}
+
 void *pth_relay(void *dummy)
 {
 	char buf[1600];
@@ -324,10 +353,12 @@ void *pth_relay(void *dummy)
 	if (!runRelay)
 		return NULL;
 		
-	relay_port = vpc[0].lport + MAX_NUM_PTHS;
+	/* the first port after the block of the VPCs */
+	relay_port = vpc[0].lport + num_pths;
 	relay_fd = open_udp(relay_port);
 	if (relay_fd <= 0)
 		relay_fd = 0;
+	relay_capring = cap_open();
 
 	/* waiting hub enable */
 	while (!peerlist)
@@ -338,12 +369,21 @@ void *pth_relay(void *dummy)
 		n = recvfrom(relay_fd, buf, len, 0, 
 		    (struct sockaddr *)&peeraddr, &size);
 		
+		if (n > 0 && agg_isbundle(buf, n))
+			agg_unpack(buf, n, cap_frame, relay_capring);
+		else if (n > 0)
+			cap_buffer(relay_capring, buf, n);
+		
 		if (relaydump && relay_dumpfile == NULL)
-			relay_dumpfile = open_dmpfile("relay");
+			relay_dumpfile = open_dmpfile("relay", 0);
 
-		if (relaydump)
-			dmp_buffer2file(buf, n, relay_dumpfile);
-		else if (relay_dumpfile) {
+		if (relaydump && n > 0) {
+			/* the frames in a bundle are saved one by one */
+			if (agg_isbundle(buf, n))
+				agg_unpack(buf, n, dmp_frame, relay_dumpfile);
+			else
+				dmp_buffer2file(buf, n, relay_dumpfile);
+		} else if (!relaydump && relay_dumpfile) {
 			close_dmpfile(relay_dumpfile);
 			relay_dumpfile = NULL;
 		}
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+
+#ifdef Linux
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#ifdef Linux
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#endif
+
+#include "globle.h"
+#include "ring.h"
+
+extern int num_pths;
+extern char *ringname;
+
+#ifdef Linux
+
+struct ring {
+	int fd;
+	char *map;
+	int mapsize;
+	
+	/* rx, blocks of frames */
+	int blk;			/* the block in use */
+	int left;			/* frames not taken in the block */
+	struct tpacket3_hdr *ppd;	/* the next frame */
+	
+	/* tx, frames */
+	char *tx;
+	int txi;			/* the next free frame */
+	u_int drops;			/* too big for a frame */
+};
+
+static struct tpacket_block_desc *rx_block(struct ring *r, int i)
+{
+	return (struct tpacket_block_desc *)(r->map + i * RING_BLOCKSIZE);
+}
+
+static struct tpacket3_hdr *tx_frame(struct ring *r, int i)
+{
+	return (struct tpacket3_hdr *)(r->tx + i * RING_FRAMESIZE);
+}
+
+/*
+ * the kernel owns the block again, go on with the next one
+ */
+static void rx_release(struct ring *r)
+{
+	struct tpacket_block_desc *pbd = rx_block(r, r->blk);
+	
+	__atomic_store_n(&pbd->hdr.bh1.block_status, TP_STATUS_KERNEL, 
+	    __ATOMIC_RELEASE);
+	r->blk = (r->blk + 1) % RING_BLOCKS;
+	r->ppd = NULL;
+}
+
+/*
+ * take the frames of the current block, wait for it if the kernel has
+ * not retired it. return the count of the frames copied to pkts.
+ */
+int ring_readv(pcs *pc, struct packet **pkts, int n)
+{
+	struct ring *r = pc->ring;
+	struct tpacket_block_desc *pbd;
+	struct pollfd pfd;
+	int k = 0, len;
+	
+	while (r->ppd == NULL) {
+		pbd = rx_block(r, r->blk);
+		if (__atomic_load_n(&pbd->hdr.bh1.block_status, 
+		    __ATOMIC_ACQUIRE) & TP_STATUS_USER) {
+			r->left = pbd->hdr.bh1.num_pkts;
+			r->ppd = (struct tpacket3_hdr *)((char *)pbd + 
+			    pbd->hdr.bh1.offset_to_first_pkt);
+			if (r->left == 0)
+				rx_release(r);
+			break;
+		}
+		
+		pfd.fd = r->fd;
+		pfd.events = POLLIN | POLLERR;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return 0;
+	}
+	
+	while (r->ppd != NULL && k < n) {
+		struct sockaddr_ll *sll;
+		
+		sll = (struct sockaddr_ll *)((char *)r->ppd + 
+		    TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+		/* the echo of our own frames */
+		if (sll->sll_pkttype != PACKET_OUTGOING) {
+			len = r->ppd->tp_snaplen;
+			if (len > PKT_MAXSIZE)
+				len = PKT_MAXSIZE;
+			memcpy(pkts[k]->data, (char *)r->ppd + r->ppd->tp_mac, 
+			    len);
+			pkts[k]->len = len;
+			/* the kernel stamped it on arrival */
+			pkts[k]->ts.tv_sec = r->ppd->tp_sec;
+			pkts[k]->ts.tv_usec = r->ppd->tp_nsec / 1000;
+			k++;
+		}
+		
+		if (--r->left == 0)
+			rx_release(r);
+		else
+			r->ppd = (struct tpacket3_hdr *)((char *)r->ppd + 
+			    r->ppd->tp_next_offset);
+	}
+	
+	return k;
+}
+
+/*
+ * kick the queued frames out, wait for a free frame if full is set
+ */
+static int tx_kick(struct ring *r, int full)
+{
+	struct pollfd pfd;
+	
+	if (send(r->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN &&
+	    errno != EWOULDBLOCK && errno != ENOBUFS)
+		return -1;
+	if (!full)
+		return 0;
+	
+	pfd.fd = r->fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	
+	return (poll(&pfd, 1, 1000) > 0) ? 0 : -1;
+}
+
+/*
+ * copy the frames into the tx ring, one send for the batch. return the
+ * count of the frames queued, the ones too big for a frame are dropped 
+ * and counted, the socket sends through the ring only.
+ */
+int ring_writev(pcs *pc, struct packet **pkts, int n)
+{
+	struct ring *r = pc->ring;
+	struct tpacket3_hdr *ppd;
+	int i, queued = 0, total = 0;
+	
+	for (i = 0; i < n; i++) {
+		if (pkts[i]->len > RING_FRAMESIZE - TPACKET3_HDRLEN) {
+			__atomic_add_fetch(&r->drops, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		
+		ppd = tx_frame(r, r->txi);
+		while (__atomic_load_n(&ppd->tp_status, __ATOMIC_ACQUIRE) != 
+		    TP_STATUS_AVAILABLE) {
+			if (tx_kick(r, 1) < 0)
+				return total;
+			queued = 0;
+		}
+		
+		memcpy((char *)ppd + TPACKET3_HDRLEN - 
+		    sizeof(struct sockaddr_ll), pkts[i]->data, pkts[i]->len);
+		ppd->tp_len = pkts[i]->len;
+		ppd->tp_next_offset = 0;
+		__atomic_store_n(&ppd->tp_status, TP_STATUS_SEND_REQUEST, 
+		    __ATOMIC_RELEASE);
+		r->txi = (r->txi + 1) % RING_TXFRAMES;
+		queued++;
+		total++;
+	}
+	if (queued)
+		tx_kick(r, 0);
+	
+	return total;
+}
+
+/* the frames dropped by the tx ring */
+u_int ring_drops(pcs *pc)
+{
+	if (pc->ring == NULL)
+		return 0;
+	
+	return __atomic_load_n(&pc->ring->drops, __ATOMIC_RELAXED);
+}
+
+static int ring_setup(struct ring *r, int ifindex)
+{
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	struct packet_mreq mr;
+	int v = TPACKET_V3;
+	
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0)
+		return -1;
+	
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RING_BLOCKSIZE;
+	req.tp_block_nr = RING_BLOCKS;
+	req.tp_frame_size = RING_FRAMESIZE;
+	req.tp_frame_nr = RING_BLOCKSIZE / RING_FRAMESIZE * RING_BLOCKS;
+	req.tp_retire_blk_tov = RING_TIMEOUT;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, 
+	    sizeof(req)) < 0)
+		return -1;
+	
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RING_BLOCKSIZE;
+	req.tp_block_nr = RING_FRAMESIZE * RING_TXFRAMES / RING_BLOCKSIZE;
+	req.tp_frame_size = RING_FRAMESIZE;
+	req.tp_frame_nr = RING_TXFRAMES;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_TX_RING, &req, 
+	    sizeof(req)) < 0)
+		return -1;
+	
+	r->mapsize = RING_BLOCKSIZE * RING_BLOCKS + 
+	    RING_FRAMESIZE * RING_TXFRAMES;
+	r->map = mmap(NULL, r->mapsize, PROT_READ | PROT_WRITE, 
+	    MAP_SHARED | MAP_LOCKED | MAP_POPULATE, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		/* no right to lock the memory */
+		r->map = mmap(NULL, r->mapsize, PROT_READ | PROT_WRITE, 
+		    MAP_SHARED, r->fd, 0);
+		if (r->map == MAP_FAILED)
+			return -1;
+	}
+	r->tx = r->map + RING_BLOCKSIZE * RING_BLOCKS;
+	
+	/* the frames to the ether address of the VPC pass the nic */
+	memset(&mr, 0, sizeof(mr));
+	mr.mr_ifindex = ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, 
+	    sizeof(mr)) < 0)
+		return -1;
+	
+#ifdef PACKET_IGNORE_OUTGOING
+	v = 1;
+	setsockopt(r->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &v, sizeof(v));
+#endif
+	
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	
+	return bind(r->fd, (struct sockaddr *)&sll, sizeof(sll));
+}
+
+/*
+ * bind the VPC to the interface, ringname if only one VPC, or 
+ * ringname + id
+ */
+int open_ring(int id)
+{
+	struct ring *r;
+	char dev[IFNAMSIZ];
+	int ifindex;
+	
+	if (num_pths > 1)
+		snprintf(dev, sizeof(dev), "%s%d", ringname, id);
+	else
+		snprintf(dev, sizeof(dev), "%s", ringname);
+	
+	ifindex = if_nametoindex(dev);
+	if (ifindex == 0)
+		return -1;
+	
+	r = calloc(1, sizeof(struct ring));
+	if (r == NULL)
+		return -1;
+	
+	r->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (r->fd < 0) {
+		free(r);
+		return -1;
+	}
+	if (ring_setup(r, ifindex) < 0) {
+		if (r->map != NULL && r->map != MAP_FAILED)
+			munmap(r->map, r->mapsize);
+		close(r->fd);
+		free(r);
+		return -1;
+	}
+	vpc[id].ring = r;
+	
+	return r->fd;
+}
+
+#else
+
+int open_ring(int id)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int ring_readv(pcs *pc, struct packet **pkts, int n)
+{
+	return 0;
+}
+
+int ring_writev(pcs *pc, struct packet **pkts, int n)
+{
+	return 0;
+}
+
+u_int ring_drops(pcs *pc)
+{
+	return 0;
+}
+
+#endif
+
+/* end of file */
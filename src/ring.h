@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include "vpcs.h"
+
+/*
+ * AF_PACKET device
+ *
+ * The VPC is bound to an existing interface (a veth or a bridge port) by
+ * a packet socket with TPACKET_V3 rings mapped into the process. The 
+ * kernel fills the rx ring by blocks, a block is handed back only when 
+ * all its frames are taken, and no syscall is made while the ring has 
+ * frames. The tx frames are queued in the tx ring and sent by one kick 
+ * per batch.
+ */
+#define RING_BLOCKSIZE	(1 << 17)	/* 128k, a power of the page size */
+#define RING_BLOCKS	32		/* rx, 4M */
+#define RING_FRAMESIZE	2048
+#define RING_TXFRAMES	512		/* tx, 1M */
+#define RING_TIMEOUT	1		/* msec, retires a partly filled block */
+
+int open_ring(int id);
+int ring_readv(pcs *pc, struct packet **pkts, int n);
+int ring_writev(pcs *pc, struct packet **pkts, int n);
+u_int ring_drops(pcs *pc);
+
+#endif
+
+/* end of file */
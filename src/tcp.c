@@ -39,12 +39,19 @@
 #include "packets6.h"
 #include "utils.h"
 #include "httpd.h"
+#include "cksum.h"
+#include "dev.h"
 
 extern int pcid;
 extern int ctrl_c;
-extern u_int time_tick;
 extern int dmpflag;
 
+#define SEQ_LT(a, b)	((int)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b)	((int)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)	((int)((a) - (b)) > 0)
+
+static u_short tcp_rwnd(sesscb *cb);
+
 /*******************************************************
  *      client                  server
  *                 SYN  ->
@@ -76,6 +83,7 @@ int tcp_ack(pcs *pc, int ipv)
 		fpacket = packet;
 	
 	pc->mscb.flags = TH_ACK;
+	pc->mscb.winsize = tcp_rwnd(&pc->mscb);
 
 	m = fpacket(pc);
 	
@@ -91,6 +99,288 @@ int tcp_ack(pcs *pc, int ipv)
 	return 1;
 }
 
+/*
+ * the mss and the window scale offered by SYN or SYN|ACK. The window 
+ * is scaled only if both sides sent the option, my SYN always does, 
+ * the server never does.
+ */
+void tcp_synopt(sesscb *cb, const u_char *opt, int len)
+{
+	int i = 0;
+	
+	cb->rmss = 0;
+	cb->rwscale = 0;
+	cb->wscale = 0;
+	while (i < len && opt[i] != TCPOPT_EOL) {
+		if (opt[i] == TCPOPT_NOP) {
+			i++;
+			continue;
+		}
+		if (i + 1 >= len || opt[i + 1] < 2 || i + opt[i + 1] > len)
+			break;
+		if (opt[i] == TCPOPT_MAXSEG && opt[i + 1] == TCPOLEN_MAXSEG)
+			cb->rmss = (opt[i + 2] << 8) + opt[i + 3];
+		else if (opt[i] == TCPOPT_WINDOW && 
+		    opt[i + 1] == TCPOLEN_WINDOW) {
+			cb->rwscale = (opt[i + 2] > 14) ? 14 : opt[i + 2];
+			cb->wscale = TCP_WSCALE;
+		}
+		i += opt[i + 1];
+	}
+}
+
+/*
+ * the receive buffer of the client
+ *
+ * the segment at rcv_nxt (mscb.ack) goes into the ring, then the ones 
+ * of oooq it reaches. The segments ahead wait in oooq, sorted by seq, 
+ * if they are in the window. The window is the room left in the ring, 
+ * tcp_recv() opens it.
+ */
+static void rcv_reset(struct rcvbuf *rb)
+{
+	struct packet *m;
+	
+	while ((m = rb->oooq) != NULL) {
+		rb->oooq = m->next;
+		del_pkt(m);
+	}
+	rb->head = rb->tail = rb->wnd = 0;
+	rb->nooo = 0;
+	rb->fin = 0;
+}
+
+void tcp_release(sesscb *cb)
+{
+	if (cb->rbuf == NULL)
+		return;
+	rcv_reset(cb->rbuf);
+	free(cb->rbuf);
+	cb->rbuf = NULL;
+}
+
+/* the window to advertise, the room left in the ring */
+static u_short tcp_rwnd(sesscb *cb)
+{
+	struct rcvbuf *rb = cb->rbuf;
+	u_int room;
+	
+	if (rb == NULL)
+		return cb->winsize;
+	
+	room = TCP_RCVBUF - (rb->tail - rb->head);
+	rb->wnd = room;
+	room >>= cb->wscale;
+	
+	return (room > 0xffff) ? 0xffff : room;
+}
+
+/* the payload of the segment, its seq, length and FIN */
+static char *tcp_seg(struct packet *m, int ipv, u_int *seq, int *len, 
+    int *fin)
+{
+	tcphdr *th;
+	int plen;
+	
+	if (ipv == IPV6_VERSION) {
+		ip6hdr *ip = (ip6hdr *)(m->data + sizeof(ethdr));
+		
+		th = (tcphdr *)(ip + 1);
+		plen = ntohs(ip->ip6_plen);
+	} else {
+		iphdr *ip = (iphdr *)(m->data + sizeof(ethdr));
+		
+		th = (tcphdr *)((char *)ip + (ip->ihl << 2));
+		plen = ntohs(ip->len) - (ip->ihl << 2);
+	}
+	*seq = ntohl(th->th_seq);
+	*len = plen - (th->th_off << 2);
+	*fin = (th->th_flags & TH_FIN) != 0;
+	
+	return (char *)th + (th->th_off << 2);
+}
+
+/* copy the segment at or before rcv_nxt into the ring */
+static void rcv_take(sesscb *cb, u_int seq, const char *data, int len, 
+    int fin)
+{
+	struct rcvbuf *rb = cb->rbuf;
+	u_int off, room, i;
+	int n;
+	
+	/* what is here already */
+	off = cb->ack - seq;
+	if ((int)off > len || rb->fin)
+		return;
+	data += off;
+	len -= off;
+	
+	room = TCP_RCVBUF - (rb->tail - rb->head);
+	if (len > (int)room) {
+		len = room;
+		fin = 0;
+	}
+	i = rb->tail & (TCP_RCVBUF - 1);
+	n = TCP_RCVBUF - i;
+	if (n > len)
+		n = len;
+	memcpy(rb->buf + i, data, n);
+	memcpy(rb->buf, data + n, len - n);
+	rb->tail += len;
+	cb->ack += len;
+	
+	if (fin) {
+		cb->ack++;
+		rb->fin = 1;
+	}
+}
+
+/*
+ * take the segment, m is freed or queued.
+ * return 0 if nothing to ack, 1 if an ACK is due, 2 if it is out of 
+ * order, ACK at once for the fast retransmit of the remote.
+ */
+static int tcp_input(pcs *pc, int ipv, struct packet *m)
+{
+	sesscb *cb = &pc->mscb;
+	struct rcvbuf *rb = cb->rbuf;
+	struct packet **mp;
+	char *data;
+	u_int seq, s;
+	int len, fin, l, f;
+	
+	data = tcp_seg(m, ipv, &seq, &len, &fin);
+	if (rb == NULL || (len <= 0 && !fin)) {
+		del_pkt(m);
+		return 0;
+	}
+	
+	/* ahead of rcv_nxt, keep it if it is in the window */
+	if (SEQ_GT(seq, cb->ack)) {
+		if (rb->nooo >= TCP_OOOQ || 
+		    SEQ_GT(seq + len, cb->ack + TCP_RCVBUF - 
+		    (rb->tail - rb->head))) {
+			del_pkt(m);
+			return 2;
+		}
+		for (mp = &rb->oooq; *mp != NULL; mp = &(*mp)->next) {
+			tcp_seg(*mp, ipv, &s, &l, &f);
+			if (SEQ_LEQ(seq, s))
+				break;
+		}
+		if (*mp != NULL && s == seq) {
+			del_pkt(m);
+			return 2;
+		}
+		m->next = *mp;
+		*mp = m;
+		rb->nooo++;
+		
+		return 2;
+	}
+	
+	rcv_take(cb, seq, data, len, fin);
+	del_pkt(m);
+	
+	/* the hole is filled */
+	while ((m = rb->oooq) != NULL) {
+		data = tcp_seg(m, ipv, &seq, &len, &fin);
+		if (SEQ_GT(seq, cb->ack))
+			break;
+		rb->oooq = m->next;
+		rb->nooo--;
+		rcv_take(cb, seq, data, len, fin);
+		del_pkt(m);
+	}
+	
+	return 1;
+}
+
+/* 
+ * take the segments queued, ACK them. 
+ * return -1 if reset, otherwise the number of the segments
+ */
+static int tcp_pump(pcs *pc, int ipv)
+{
+	struct packet *p;
+	int (*fresponse)(struct packet *pkt, sesscb *sesscb);
+	int n = 0, k, want = 0;
+	
+	if (ipv == IPV6_VERSION)
+		fresponse = response6;
+	else
+		fresponse = response;
+	
+	while ((p = deq(&pc->iq)) != NULL) {
+		n++;
+		if (fresponse(p, &pc->mscb) != IPPROTO_TCP) {
+			del_pkt(p);
+			continue;
+		}
+		if (pc->mscb.rflags & TH_RST) {
+			del_pkt(p);
+			return -1;
+		}
+		/* no ack for an ack */
+		k = tcp_input(pc, ipv, p);
+		if (k == 2)
+			tcp_ack(pc, ipv);
+		else if (k == 1)
+			want = 1;
+	}
+	if (want)
+		tcp_ack(pc, ipv);
+	
+	return n;
+}
+
+/*
+ * read the data received in order, wait up to wait ms if none is there.
+ * return the bytes read, 0 if the remote closed, reset or timeout
+ */
+int tcp_recv(pcs *pc, int ipv, char *buf, int len, int wait)
+{
+	struct rcvbuf *rb = pc->mscb.rbuf;
+	struct timeval tv;
+	u_int i;
+	int n, k;
+	
+	if (rb == NULL)
+		return 0;
+	
+	gettimeofday(&tv, (void*)0);
+	while (ctrl_c == 0) {
+		k = tcp_pump(pc, ipv);
+		if (k < 0)
+			return 0;
+		if (rb->tail != rb->head || rb->fin)
+			break;
+		/* a hole is pending, wait for the retransmission */
+		if (timeout(tv, rb->nooo ? TCP_TIMEOUT * 1000 : wait))
+			break;
+		if (k == 0)
+			delay_ms(1);
+	}
+	
+	n = rb->tail - rb->head;
+	if (n > len)
+		n = len;
+	i = rb->head & (TCP_RCVBUF - 1);
+	k = TCP_RCVBUF - i;
+	if (k > n)
+		k = n;
+	memcpy(buf, rb->buf + i, k);
+	memcpy(buf + k, rb->buf, n - k);
+	rb->head += n;
+	
+	/* the window opened by a quarter, tell the remote */
+	if (n > 0 && !rb->fin && (int)(TCP_RCVBUF - (rb->tail - rb->head) - 
+	    rb->wnd) >= TCP_RCVBUF / 4)
+		tcp_ack(pc, ipv);
+	
+	return n;
+}
+
 int tcp_open(pcs *pc, int ipv)
 {
 	struct packet *m, *p;
@@ -107,6 +397,14 @@ int tcp_open(pcs *pc, int ipv)
 		fresponse = response;
 	}
 	
+	if (pc->mscb.rbuf == NULL)
+		pc->mscb.rbuf = calloc(1, sizeof(struct rcvbuf));
+	if (pc->mscb.rbuf == NULL) {
+		printf("out of memory\n");
+		return 0;
+	}
+	rcv_reset(pc->mscb.rbuf);
+	
 	/* try to connect */
 	//printf("DEBUG: tcp_open - attempting to connect, ipv=%d\n", ipv);
 	while (i++ < 3 && ctrl_c == 0) {
@@ -205,107 +503,239 @@ int tcp_open(pcs *pc, int ipv)
 	return 0;
 }
 /*
- * return 1 if ACK, 2 if FIN|PUSH
+ * the send window
+ *
+ * the data goes out in segments of tcp_smss() bytes, as many as fit in 
+ * min(cwnd, the remote window). The segments in flight wait in sndq in 
+ * the order of their seq until a cumulative ACK covers them. Three 
+ * duplicate ACKs resend the oldest one, the rto goes back to snd_una 
+ * with one segment of cwnd.
+ */
+struct sndseg {
+	u_int seq;
+	int len;
+};
+
+/* the payload of a full segment, the timestamp rides on every one */
+static int tcp_smss(sesscb *cb, int ipv)
+{
+	int mss;
+	
+	mss = cb->mtu - sizeof(tcphdr);
+	if (ipv == IPV6_VERSION)
+		mss -= sizeof(ip6hdr);
+	else
+		mss -= sizeof(iphdr);
+	if (cb->rmss != 0 && cb->rmss < mss)
+		mss = cb->rmss;
+	mss -= 2 + 2 + 8;
+	
+	return (mss < 64) ? 64 : mss;
+}
+
+/* send len bytes at seq, base is the data at start, NULL for the pattern */
+static int tcp_segment(pcs *pc, int ipv, char *base, u_int start, 
+    u_int seq, int len)
+{
+	struct packet *m;
+	u_int seq0 = pc->mscb.seq;
+	int dsize = pc->mscb.dsize;
+	
+	pc->mscb.flags = TH_ACK | TH_PUSH;
+	pc->mscb.winsize = tcp_rwnd(&pc->mscb);
+	pc->mscb.seq = seq;
+	pc->mscb.dsize = len;
+	pc->mscb.data = (base != NULL) ? base + (seq - start) : NULL;
+	
+	if (ipv == IPV6_VERSION)
+		m = packet6(pc);
+	else
+		m = packet(pc);
+	
+	pc->mscb.seq = seq0;
+	pc->mscb.dsize = dsize;
+	
+	if (m == NULL) {
+		printf("out of memory\n");
+		return 0;
+	}
+	/* push m into the background output queue 
+	   which is watched by pth_output */
+	enq(&pc->bgoq, m);
+	
+	return 1;
+}
+
+/*
+ * send mscb.dsize bytes of mscb.data, the pattern if it is NULL
+ * return 1 if all acked, 2 if FIN|PUSH, 0 if timeout or reset
  */
 int tcp_send(pcs *pc, int ipv)
 {
-	struct packet *m, *p;
-	int i = 0, ok;
-	int state = 0;
+	struct packet *p;
+	struct sndseg sndq[TCP_SNDQ], *q;
+	struct timeval tv, now;
+	int head = 0, count = 0;
+	int k, want, sent = 0;
+	int smss, cwnd, ssthresh, rto, flight, win, len, wait;
+	int dupacks = 0, retries = 0;
+	u_int start, una, nxt, end, sndmax, rwin;
+	char *base = pc->mscb.data;
+	int dsize = pc->mscb.dsize;
 	
-	struct packet * (*fpacket)(pcs *pc);
 	int (*fresponse)(struct packet *pkt, sesscb *sesscb);
 	
-	if (ipv == IPV6_VERSION) {
-		fpacket = packet6;
+	if (ipv == IPV6_VERSION)
 		fresponse = response6;
-	} else {
-		fpacket = packet;
+	else
 		fresponse = response;
-	}
 	
-	/* drop the response if any, but update the ack */
-	while ((p = deq(&pc->iq)) != NULL) {	
-		ok = fresponse(p, &pc->mscb);
-		del_pkt(p);
-		
-		if (!ok)
-			continue;
-			
-		if (pc->mscb.rflags == (TH_ACK | TH_PUSH) &&
-			pc->mscb.seq == pc->mscb.rack) {
-			pc->mscb.ack = pc->mscb.rseq + pc->mscb.rdsize;
-			tcp_ack(pc, ipv);
-			delay_ms(1);
+	/* take what came since */
+	if (tcp_pump(pc, ipv) < 0)
+		return 0;
+	
+	smss = tcp_smss(&pc->mscb, ipv);
+	cwnd = TCP_INITWND * smss;
+	ssthresh = TCP_SSTHRESH;
+	rto = pc->mscb.waittime;
+	start = una = nxt = sndmax = pc->mscb.seq;
+	end = start + (dsize > 0 ? dsize : 0);
+	rwin = pc->mscb.rwin;
+	
+	gettimeofday(&tv, (void*)0);
+	while (ctrl_c == 0) {
+		/* fill the window, one segment goes even if it is closed */
+		while (count < TCP_SNDQ && 
+		    (SEQ_LT(nxt, end) || (una == end && !sent))) {
+			flight = nxt - una;
+			win = (int)pc->mscb.rwin < cwnd ? (int)pc->mscb.rwin : cwnd;
+			len = (end - nxt) < smss ? (end - nxt) : smss;
+			if (flight > 0 && flight + len > win)
+				break;
+			if (!tcp_segment(pc, ipv, base, start, nxt, len))
+				return 0;
+			if (count == 0)
+				gettimeofday(&tv, (void*)0);
+			q = &sndq[(head + count++) % TCP_SNDQ];
+			q->seq = nxt;
+			q->len = len;
+			nxt += len;
+			if (SEQ_GT(nxt, sndmax))
+				sndmax = nxt;
+			sent = 1;
 		}
-	}	
-	 
-	/* try to send */ 
-	while (i++ < 3 && ctrl_c == 0) {
-		struct timeval tv;
 		
-		pc->mscb.flags = TH_ACK | TH_PUSH;
-		m = fpacket(pc);
-	
-		if (m == NULL) {
-			printf("out of memory\n");
-			return 0;
+		/* all acked */
+		if (count == 0 && sent) {
+			pc->mscb.seq = nxt;
+			pc->mscb.dsize = dsize;
+			pc->mscb.data = base;
+			return (pc->mscb.rbuf && pc->mscb.rbuf->fin) ? 2 : 1;
 		}
-		/* push m into the background output queue 
-		   which is watched by pth_output */
-		enq(&pc->bgoq, m);
 		
-		//k = 0;
-		ok = 0;
-		gettimeofday(&(tv), (void*)0);
-		while (!timeout(tv, pc->mscb.waittime) && !ctrl_c) {
-			delay_ms(1);
-			while ((p = deq(&pc->iq)) != NULL) {	
-				ok = fresponse(p, &pc->mscb);
+		/* sleep until a segment comes or the rto is due, 
+		 * look at ctrl_c now and then */
+		gettimeofday(&now, (void*)0);
+		wait = rto - ((now.tv_sec - tv.tv_sec) * 1000 + 
+		    (now.tv_usec - tv.tv_usec) / 1000);
+		if (wait > TCP_POLLWAIT)
+			wait = TCP_POLLWAIT;
+		if (timedwaitdeq_batch(&pc->iq, &p, 1, wait * 1000) == 0)
+			p = NULL;
+		
+		want = 0;
+		for (; p != NULL; p = deq(&pc->iq)) {
+			if (fresponse(p, &pc->mscb) != IPPROTO_TCP) {
 				del_pkt(p);
-
-				if (!ok)
-					continue;
-
-				if (pc->mscb.rflags == (TH_ACK) && 
-				    pc->mscb.rack == pc->mscb.seq + pc->mscb.dsize) {
-					pc->mscb.seq = pc->mscb.rack;
-					pc->mscb.ack = pc->mscb.rseq;		
-					state = 1;
-					
-					return 1;
-				}
-				if (pc->mscb.rflags == (TH_ACK | TH_PUSH)) {
-					/* Server sent ACK+PUSH+DATA (HTTP response) */
-					pc->mscb.seq = pc->mscb.rack;
-					pc->mscb.ack = pc->mscb.rseq + pc->mscb.rdsize;
-					
-					/* Send ACK to acknowledge the response data */
-					tcp_ack(pc, ipv);
-					
-					/* HTTP transaction complete */
-					return 1;
-				}
-					
-				/* the remote does not like me, closing the connection */	
-				if (pc->mscb.rflags == (TH_ACK | TH_PUSH | TH_FIN)) {
-					pc->mscb.seq = pc->mscb.rack;
-					pc->mscb.ack = pc->mscb.rseq + pc->mscb.rdsize;
-
-					state = 1;
+				continue;
+			}
+			if (pc->mscb.rflags & TH_RST) {
+				del_pkt(p);
+				pc->mscb.dsize = dsize;
+				return 0;
+			}
+			
+			/* the data goes to the receive buffer */
+			pc->mscb.seq = nxt;
+			k = tcp_input(pc, ipv, p);
+			if (k == 2)
+				tcp_ack(pc, ipv);
+			else if (k == 1)
+				want = 1;
+			
+			if (!(pc->mscb.rflags & TH_ACK))
+				continue;
+			
+			/* 
+			 * the acks sent before the rto count too, those 
+			 * outside of [una, snd_max] are stale or bogus
+			 */
+			if (SEQ_GT(pc->mscb.rack, una) && 
+			    SEQ_LEQ(pc->mscb.rack, sndmax)) {
+				len = pc->mscb.rack - una;
+				una = pc->mscb.rack;
+				if (SEQ_GT(una, nxt))
+					nxt = una;
+				dupacks = 0;
+				retries = 0;
+				rto = pc->mscb.waittime;
+				gettimeofday(&tv, (void*)0);
 				
-					return 2;
+				/* slow start, then congestion avoidance */
+				if (cwnd < ssthresh)
+					cwnd += len < smss ? len : smss;
+				else
+					cwnd += smss * smss / cwnd + 1;
+			} else if (pc->mscb.rack == una && pc->mscb.rdsize == 0 && 
+			    !(pc->mscb.rflags & (TH_SYN | TH_FIN)) && 
+			    pc->mscb.rwin == rwin && count > 0 && una != nxt) {
+				/* a duplicate ack (RFC 5681), fast retransmit */
+				if (++dupacks == 3) {
+					flight = nxt - una;
+					ssthresh = flight / 2 > 2 * smss ? 
+					    flight / 2 : 2 * smss;
+					cwnd = ssthresh;
+					q = &sndq[head];
+					if (!tcp_segment(pc, ipv, base, start, 
+					    q->seq, q->len))
+						return 0;
 				}
-				tv.tv_sec = 0;	
-				break;
+			}
+			rwin = pc->mscb.rwin;
+			
+			/* pop the segments covered, by una, never by a bogus ack */
+			while (count > 0 && SEQ_LEQ(sndq[head].seq + 
+			    sndq[head].len, una)) {
+				head = (head + 1) % TCP_SNDQ;
+				count--;
 			}
 		}
 		
-		if (state != 1)
+		if (want) {
+			pc->mscb.seq = nxt;
+			tcp_ack(pc, ipv);
+		}
+		
+		/* rto, go back to the oldest one */
+		if (count > 0 && timeout(tv, rto)) {
+			if (++retries > 3) {
+				pc->mscb.dsize = dsize;
+				return 0;
+			}
+			flight = nxt - una;
+			ssthresh = flight / 2 > 2 * smss ? flight / 2 : 2 * smss;
+			cwnd = smss;
+			rto <<= 1;
+			dupacks = 0;
+			head = count = 0;
+			nxt = una;
+			if (una == end)
+				sent = 0;
 			continue;
-					
-		return 1;
+		}
 	}
+	pc->mscb.dsize = dsize;
+	
 	return 0;
 }
 
@@ -327,39 +757,11 @@ int tcp_close(pcs *pc, int ipv)
 		fresponse = response;
 	}
 	
-	/* drop the response if any, but update the ack */
-	while ((p = deq(&pc->iq)) != NULL) {	
-		ok = fresponse(p, &pc->mscb);
-		del_pkt(p);
-		
-		if (!ok)
-			continue;
-		
-		if (pc->mscb.rflags == (TH_ACK | TH_PUSH) &&
-			pc->mscb.seq == pc->mscb.rack) {
-			pc->mscb.ack = pc->mscb.rseq + pc->mscb.rdsize;
-			tcp_ack(pc, ipv);
-			delay_ms(1);
-			continue;
-		}
-		if (pc->mscb.rflags == TH_ACK) {
-			pc->mscb.seq = pc->mscb.rack;
-			pc->mscb.ack = pc->mscb.rseq;
-			break;
-		}
-		if ((pc->mscb.rflags & (TH_ACK | TH_FIN)) == (TH_ACK | TH_FIN)) {
-			pc->mscb.seq = pc->mscb.rack;
-			pc->mscb.ack = pc->mscb.rseq;
-			pc->mscb.ack++;
-			
-			tcp_ack(pc, ipv);
-			
-			delay_ms(1);
-			rfin = 1;
-			
-			continue;
-		}
-	}
+	/* take what is left, too late to read it */
+	if (tcp_pump(pc, ipv) < 0)
+		return 0;
+	if (pc->mscb.rbuf != NULL)
+		rfin = pc->mscb.rbuf->fin;
 		
 	/* try to close */
 	while (i++ < 3 && ctrl_c == 0) {
@@ -474,8 +876,8 @@ int tcpReplyPacket(tcphdr *th, sesscb *cb, int tcplen)
 				// printf("DEBUG: Processing ACK+PUSH - data size: %d\n", tcplen - (th->th_off << 2));
 				/* HTTP-style response: send ACK+PUSH+DATA (combined acknowledgment and response) */
 				cb->flags = TH_ACK | TH_PUSH;  /* Send ACK+PUSH+DATA */
+				/* Acknowledge received data, added below */
 				dsize = tcplen - (th->th_off << 2);
-				cb->ack += dsize;  /* Acknowledge received data */
 				break;
 			case TH_ACK | TH_FIN:
 				// printf("DEBUG: Processing ACK+FIN\n");
@@ -507,6 +909,8 @@ int tcpReplyPacket(tcphdr *th, sesscb *cb, int tcplen)
 	th->th_ack = htonl(cb->ack + dsize);
 	th->th_seq = htonl(cb->seq);
 	th->th_flags = cb->flags;
+	/* the data is eaten at once, never close the window */
+	th->th_win = htons(TCP_WINDOW);
 	
 	// printf("DEBUG: tcpReplyPacket - outgoing flags: 0x%02x, seq: %u, ack: %u\n", 
 	//        cb->flags, cb->seq, cb->ack + dsize);
@@ -521,6 +925,185 @@ int tcpReplyPacket(tcphdr *th, sesscb *cb, int tcplen)
 	return 1;
 }
 
+/*
+ * session table
+ *
+ * the busy control blocks of pc->sesscb[] are chained in pc->sesshash[]
+ * by the 4-tuple, the freed ones in pc->sessfree. The links are the
+ * index + 1 of the block, 0 ends a chain. The blocks idle for more than 
+ * TCP_TIMEOUT are reclaimed by pc->sesstimer, or when the pool runs out. 
+ * pc->locker guards the table against the timer.
+ *
+ * The table is allocated by the first SYN, most VPCs never serve one. 
+ * The blocks come zeroed from calloc and are handed out in order up to
+ * pc->sesstop, those never used are never touched.
+ */
+static void sess_timer(void *arg);
+
+void init_sessions(pcs *pc)
+{
+	pc->sesscb = NULL;
+	pc->sesshash = NULL;
+	pc->sessfree = 0;
+	pc->sesstop = 0;
+	timer_set(&pc->sesstimer, sess_timer, pc);
+}
+
+static int sess_table(pcs *pc)
+{
+	if (pc->sesscb != NULL)
+		return 1;
+	
+	pc->sesshash = calloc(SESS_HASHSIZE, sizeof(int));
+	pc->sesscb = calloc(MAX_SESSIONS, sizeof(sesscb));
+	if (pc->sesshash == NULL || pc->sesscb == NULL) {
+		free(pc->sesshash);
+		free(pc->sesscb);
+		pc->sesshash = NULL;
+		pc->sesscb = NULL;
+		return 0;
+	}
+	
+	return 1;
+}
+
+static u_int sess_hash(const void *sip, const void *dip, int alen, 
+    u_int sport, u_int dport)
+{
+	const u_int *s = sip, *d = dip;
+	u_int h;
+	int i;
+	
+	h = (sport << 16) ^ dport;
+	for (i = 0; i < alen / 4; i++)
+		h ^= s[i] ^ (d[i] * 31);
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	
+	return h & (SESS_HASHSIZE - 1);
+}
+
+static void sess_free(pcs *pc, sesscb *cb)
+{
+	int *pp;
+	int idx = cb - pc->sesscb + 1;
+	
+	if (cb->hslot) {
+		pp = &pc->sesshash[cb->hslot - 1];
+		while (*pp && *pp != idx)
+			pp = &pc->sesscb[*pp - 1].hnext;
+		if (*pp)
+			*pp = cb->hnext;
+	}
+	memset(cb, 0, sizeof(sesscb));
+	cb->hnext = pc->sessfree;
+	pc->sessfree = idx;
+}
+
+static int sess_expired(sesscb *cb)
+{
+	return (time_tick - cb->timeout > TCP_TIMEOUT);
+}
+
+static void sess_reclaim(pcs *pc)
+{
+	int i;
+	
+	for (i = 0; i < pc->sesstop; i++) {
+		if (pc->sesscb[i].hslot && sess_expired(&pc->sesscb[i]))
+			sess_free(pc, &pc->sesscb[i]);
+	}
+}
+
+/* reclaim the expired blocks, come back when the next one expires */
+static void sess_timer(void *arg)
+{
+	pcs *pc = arg;
+	int i, t, next = 0;
+	
+	pthread_mutex_lock(&pc->locker);
+	for (i = 0; i < pc->sesstop; i++) {
+		if (!pc->sesscb[i].hslot)
+			continue;
+		if (sess_expired(&pc->sesscb[i])) {
+			sess_free(pc, &pc->sesscb[i]);
+			continue;
+		}
+		t = TCP_TIMEOUT + 1 - (time_tick - pc->sesscb[i].timeout);
+		if (next == 0 || t < next)
+			next = t;
+	}
+	if (next)
+		timer_add(&pc->sesstimer, next * 1000);
+	pthread_mutex_unlock(&pc->locker);
+}
+
+static sesscb *sess_alloc(pcs *pc, u_int h)
+{
+	sesscb *cb;
+	
+	if (!sess_table(pc))
+		return NULL;
+	if (pc->sessfree == 0 && pc->sesstop == MAX_SESSIONS)
+		sess_reclaim(pc);
+	if (pc->sessfree != 0) {
+		cb = &pc->sesscb[pc->sessfree - 1];
+		pc->sessfree = cb->hnext;
+	} else if (pc->sesstop < MAX_SESSIONS)
+		cb = &pc->sesscb[pc->sesstop++];
+	else
+		return NULL;
+	if (!timer_pending(&pc->sesstimer))
+		timer_add(&pc->sesstimer, (TCP_TIMEOUT + 1) * 1000);
+	
+	cb->hslot = h + 1;
+	cb->hnext = pc->sesshash[h];
+	pc->sesshash[h] = cb - pc->sesscb + 1;
+	
+	return cb;
+}
+
+/*
+ * the expired block is left alone, a SYN of the same 4-tuple reuses it
+ */
+static sesscb *sess_lookup4(pcs *pc, u_int h, iphdr *ip, u_int sport, 
+    u_int dport)
+{
+	sesscb *cb;
+	int i;
+	
+	if (pc->sesshash == NULL)
+		return NULL;
+	for (i = pc->sesshash[h]; i; i = cb->hnext) {
+		cb = &pc->sesscb[i - 1];
+		if (cb->sip == ip->sip && cb->dip == ip->dip &&
+		    cb->sport == sport && cb->dport == dport)
+			return cb;
+	}
+	
+	return NULL;
+}
+
+static sesscb *sess_lookup6(pcs *pc, u_int h, ip6hdr *ip, u_int sport, 
+    u_int dport)
+{
+	sesscb *cb;
+	int i;
+	
+	if (pc->sesshash == NULL)
+		return NULL;
+	for (i = pc->sesshash[h]; i; i = cb->hnext) {
+		cb = &pc->sesscb[i - 1];
+		if (IP6EQ(&(cb->sip6), &(ip->src)) && 
+		    IP6EQ(&(cb->dip6), &(ip->dst)) &&
+		    cb->sport == sport && cb->dport == dport)
+			return cb;
+	}
+	
+	return NULL;
+}
+
 int tcp(pcs *pc, struct packet *m)
 {
 	// printf("TCP\n");
@@ -528,7 +1111,7 @@ int tcp(pcs *pc, struct packet *m)
 	tcpiphdr *ti = (tcpiphdr *)(ip);
 	sesscb *cb = NULL;
 	struct packet *p = NULL;
-	int i;
+	u_int h;
 	
 	if (ip->dip != pc->ip4.ip) {
 		// printf("DEBUG: Packet not for us - dst: %s, our IP: %s\n", 
@@ -582,97 +1165,37 @@ int tcp(pcs *pc, struct packet *m)
 	/* request process
 	 * find control block 
 	 */
-	// printf("DEBUG: Looking for existing session or creating new one\n");
-	for (i = 0; i < MAX_SESSIONS; i++) {
-		if (ti->ti_flags == TH_SYN) {
-			if (pc->sesscb[i].timeout == 0 || 
-			    time_tick - pc->sesscb[i].timeout > TCP_TIMEOUT ||
-			    (ip->sip == pc->sesscb[i].sip && 
-			     ip->dip == pc->sesscb[i].dip &&
-			     ti->ti_sport == pc->sesscb[i].sport &&
-			     ti->ti_dport == pc->sesscb[i].dport)) {
-				/* get new scb */
-				// printf("DEBUG: Found/created session %d for incoming SYN\n", i);
-				cb = &pc->sesscb[i];
-				cb->timeout = time_tick;
-				cb->seq = random();
-				cb->sip = ip->sip;
-				cb->dip = ip->dip;
-				cb->sport = ti->ti_sport;
-				cb->dport = ti->ti_dport;
-				
-				break;
-			}
-		} else {
-			if ((time_tick - 
-			    pc->sesscb[i].timeout <= TCP_TIMEOUT) && 
-			    ip->sip == pc->sesscb[i].sip && 
-			    ip->dip == pc->sesscb[i].dip &&
-			    ti->ti_sport == pc->sesscb[i].sport &&
-			    ti->ti_dport == pc->sesscb[i].dport) {
-				/* get the scb */
-				// printf("DEBUG: Found existing session %d for packet\n", i);
-				cb = &pc->sesscb[i];
-				break;
-			}	
-		}
-	}
-	
-	if (ti->ti_flags == TH_SYN && cb == NULL) {
-		/* Check if we have an HTTP server on this port */
-		extern httpd_server_t httpd_servers[];
-		int dest_port = ntohs(ti->ti_dport);
-		int server_found = 0;
-		
-		// printf("DEBUG: SYN received on port %d from %s, checking for HTTP server...\n", 
-		    //    dest_port, inet_ntoa(*(struct in_addr*)&ip->sip));
-		
-		for (int j = 0; j < HTTPD_MAX_SERVERS; j++) {
-			if (httpd_servers[j].enabled && 
-			    httpd_servers[j].port == dest_port && 
-			    httpd_servers[j].pc_id == pcid) {
-				server_found = 1;
-				// printf("DEBUG: Found HTTP server on port %d for PC %d\n", dest_port, pcid);
-				break;
-			}
-		}
-		
-		if (!server_found) {
-			// printf("DEBUG: No HTTP server found on port %d for PC %d\n", dest_port, pcid);
-			printf("VPCS %d out of session\n", pc->id);
-			return PKT_DROP;
-		}
-		
-		// printf("DEBUG: Allocating session for HTTP server on port %d\n", dest_port);
-		
-		/* Try to find a free session for the HTTP server */
-		for (i = 0; i < MAX_SESSIONS; i++) {
-			if (pc->sesscb[i].timeout == 0 || 
-			    time_tick - pc->sesscb[i].timeout > TCP_TIMEOUT) {
-				cb = &pc->sesscb[i];
-				cb->timeout = time_tick;
-				cb->seq = random();
-				cb->sip = ip->sip;
-				cb->dip = ip->dip;
-				cb->sport = ti->ti_sport;
-				cb->dport = ti->ti_dport;
-				break;
-			}
-		}
-		
+	h = sess_hash(&ip->sip, &ip->dip, 4, ti->ti_sport, ti->ti_dport);
+	pthread_mutex_lock(&pc->locker);
+	cb = sess_lookup4(pc, h, ip, ti->ti_sport, ti->ti_dport);
+	if (cb != NULL && ti->ti_flags != TH_SYN && sess_expired(cb))
+		cb = NULL;
+	if (ti->ti_flags == TH_SYN) {
+		if (cb == NULL)
+			cb = sess_alloc(pc, h);
 		if (cb == NULL) {
-			// printf("DEBUG: VPCS %d out of session - no free sessions available\n", pc->id);
+			printf("VPCS %d out of session\n", pc->id);
+			pthread_mutex_unlock(&pc->locker);
 			return PKT_DROP;
 		}
-		
-		// printf("DEBUG: Session allocated for HTTP server - session %d\n", (int)(cb - pc->sesscb));
+		/* get new scb */
+		cb->timeout = time_tick;
+		cb->seq = random();
+		cb->sip = ip->sip;
+		cb->dip = ip->dip;
+		cb->sport = ti->ti_sport;
+		cb->dport = ti->ti_dport;
+		cb->mtu = pc->mtu;
+		tcp_synopt(cb, (u_char *)(ti + 1), 
+		    (ti->ti_off << 2) - sizeof(tcphdr));
+		/* the SYN|ACK offers no window scale, neither side scales */
+		cb->rwscale = cb->wscale = 0;
 	}
 	
 	if (cb != NULL) {
 		if (ti->ti_flags == TH_ACK && cb->flags == TH_FIN) {
 			/* clear session */
-			// printf("DEBUG: Clearing session - received final ACK\n");
-			memset(cb, 0, sizeof(sesscb));
+			sess_free(pc, cb);
 		} else {
 			cb->timeout = time_tick;
 			// printf("DEBUG: Processing packet with flags 0x%02x, generating reply\n", ti->ti_flags);
@@ -702,19 +1225,163 @@ int tcp(pcs *pc, struct packet *m)
 		// printf("DEBUG: No session control block found for packet\n");
 	}
 
+	pthread_mutex_unlock(&pc->locker);
+
 	/* anyway tell caller to drop this packet */
 	return PKT_DROP;	
 }
 
+/* 
+ * turn the copied header around, the swap of the addresses keeps the 
+ * header sum, patch it for the ttl and the new length.
+ */
+static void ip_reply(iphdr *ip, int len)
+{
+	u_short w = *(u_short *)&ip->ttl;
+	
+	ip->dip ^= ip->sip;
+	ip->sip ^= ip->dip;
+	ip->dip ^= ip->sip;
+	
+	ip->ttl = TTL;
+	ip->cksum = cksum_fixup(ip->cksum, w, *(u_short *)&ip->ttl, 0);
+	
+	w = ip->len;
+	ip->len = htons(len);
+	ip->cksum = cksum_fixup(ip->cksum, w, ip->len, 0);
+}
+
+/* 
+ * the segment sum over the pseudo header, the new header and 
+ * the payload, which is summed by the caller as sum. With the 
+ * offload only the pseudo header is summed, the device does the rest.
+ */
+static void tcp_sum(struct packet *m, iphdr *ip, tcphdr *th, int dlen, 
+    u_int sum)
+{
+	u_int ph;
+	
+	ph = cksum_pseudo4(ip->sip, ip->dip, IPPROTO_TCP, 
+	    sizeof(tcphdr) + dlen);
+	if (dev_offload()) {
+		th->th_sum = ~cksum_fold(ph);
+		m->flags |= PKT_F_CSUM;
+		return;
+	}
+	th->th_sum = 0;
+	sum = cksum_add(th, sizeof(tcphdr), sum);
+	th->th_sum = cksum_fold(sum + ph);
+}
+
+/* SYN|ACK tells the mss, return the length of the option */
+static int tcp_mssopt(tcphdr *th, int mss)
+{
+	u_char *opt = (u_char *)(th + 1);
+	
+	if (th->th_flags != (TH_SYN | TH_ACK))
+		return 0;
+	
+	opt[0] = TCPOPT_MAXSEG;
+	opt[1] = TCPOLEN_MAXSEG;
+	opt[2] = mss >> 8;
+	opt[3] = mss & 0xff;
+	th->th_off = (sizeof(tcphdr) + TCPOLEN_MAXSEG) >> 2;
+	
+	return TCPOLEN_MAXSEG;
+}
+
+/*
+ * the data in segments of the client's mss, chained for enq(). The 
+ * first one takes the headers from tcpReplyPacket(), the others copy 
+ * them and move the seq. With the offload it goes as one super 
+ * segment, the device cuts it.
+ */
+static struct packet *tcp_segments(struct packet *m0, sesscb *cb, 
+    const char *data, int dlen)
+{
+	struct packet *m, *m1 = NULL, **mp = &m1;
+	iphdr *ip, *ip0 = (iphdr *)(m0->data + sizeof(ethdr));
+	tcphdr *th;
+	u_short w;
+	u_int sum, seq = 0;
+	int hlen, mss, off, n, rt = 1;
+	
+	hlen = sizeof(ethdr) + sizeof(iphdr) + sizeof(tcphdr);
+	mss = cb->mtu - sizeof(iphdr) - sizeof(tcphdr);
+	if (cb->rmss != 0 && cb->rmss < mss)
+		mss = cb->rmss;
+	
+	for (off = 0; off < dlen; off += n) {
+		n = dlen - off;
+		if (n > mss && !dev_offload())
+			n = mss;
+		m = new_pkt(hlen + n);
+		if (m == NULL) {
+			while ((m = m1) != NULL) {
+				m1 = m->next;
+				del_pkt(m);
+			}
+			return NULL;
+		}
+		ip = (iphdr *)(m->data + sizeof(ethdr));
+		th = (tcphdr *)(ip + 1);
+		
+		/* the only full sum */
+		if (dev_offload()) {
+			memcpy(th + 1, data + off, n);
+			sum = 0;
+			/* a super segment, the device cuts it */
+			if (n > mss)
+				m->gso_size = mss;
+		} else
+			sum = cksum_copy(th + 1, data + off, n, 0);
+		
+		if (m1 == NULL) {
+			memcpy(m->data, m0->data, hlen);
+			ip_reply(ip, sizeof(iphdr) + sizeof(tcphdr) + n);
+			
+			cb->dsize = dlen;
+			rt = tcpReplyPacket(th, cb, ntohs(ip0->len) - 
+			    sizeof(iphdr));
+			if (rt == 0) {
+				del_pkt(m);
+				return NULL;
+			}
+			swap_ehead(m->data);
+			seq = ntohl(th->th_seq);
+		} else {
+			memcpy(m->data, m1->data, hlen);
+			
+			w = ip->len;
+			ip->len = htons(sizeof(iphdr) + sizeof(tcphdr) + n);
+			ip->cksum = cksum_fixup(ip->cksum, w, ip->len, 0);
+			w = ip->id;
+			ip->id = htons(ntohs(w) + off / mss);
+			ip->cksum = cksum_fixup(ip->cksum, w, ip->id, 0);
+			th->th_seq = htonl(seq + off);
+		}
+		tcp_sum(m, ip, th, n, sum);
+		
+		*mp = m;
+		mp = &m->next;
+	}
+	
+	/* save the status, ACK for TH_FIN of client was sent 
+	 * so send FIN on the next time
+	 */
+	if (rt == 2)
+		cb->flags = (TH_ACK | TH_FIN);
+	
+	return m1;
+}
+
 struct packet *tcpReply(struct packet *m0, sesscb *cb)
 {
 	ethdr *eh;
 	iphdr *ip;
-	tcpiphdr *ti;
 	tcphdr *th;
 	struct packet *m;
-	char b[9];
-	int len;
+	int len, optlen;
 
 	int tcplen = 0;
 	
@@ -746,67 +1413,9 @@ struct packet *tcpReply(struct packet *m0, sesscb *cb)
 		if(server_found) {
 			httpd_handle_request(dest_port, http_data, orig_dsize, response_buffer, &response_len);
 			
-			if (response_len > 0) {
-				// printf("DEBUG: Generated HTTP response, size: %d\n", response_len);
-				/* Create HTTP response packet */
-				len = sizeof(ethdr) + sizeof(iphdr) + sizeof(tcphdr) + response_len;
-				m = new_pkt(len);
-				if (m == NULL)
-					return NULL;
-				
-				memcpy(m->data, m0->data, sizeof(ethdr) + sizeof(iphdr) + sizeof(tcphdr));
-				
-				eh = (ethdr *)(m->data);
-				ip = (iphdr *)(eh + 1);
-				ti = (tcpiphdr *)ip;
-				th = (tcphdr *)(ip + 1);
-				
-				/* Copy HTTP response data */
-				memcpy((char *)th + sizeof(tcphdr), response_buffer, response_len);
-				
-				tcplen = ntohs(orig_ip->len) - sizeof(iphdr);
-				ip->len = htons(len - sizeof(ethdr));
-				
-				ip->dip ^= ip->sip;
-				ip->sip ^= ip->dip;
-				ip->dip ^= ip->sip;
-				ip->ttl = TTL;
-				
-				/* Set data size for tcpReplyPacket */
-				cb->dsize = response_len;
-				
-				int rt = tcpReplyPacket(th, cb, tcplen);
-				if (rt == 0) {
-					// printf("DEBUG: tcpReplyPacket failed for HTTP response\n");
-					del_pkt(m);
-					return NULL;
-				}
-				
-				// printf("DEBUG: HTTP response packet created successfully\n");
-				
-				/* Update TCP header data size */
-				ti->ti_len = htons(len - sizeof(iphdr));
-				
-				bcopy(((struct ipovly *)ip)->ih_x1, b, 9);
-				bzero(((struct ipovly *)ip)->ih_x1, 9);
-				
-				ti->ti_sum = 0;
-				ti->ti_sum = cksum((unsigned short *)ti, len - sizeof(ethdr));
-				bcopy(b, ((struct ipovly *)ip)->ih_x1, 9);
-
-				ip->cksum = 0;
-				ip->cksum = cksum((unsigned short *)ip, sizeof(iphdr));
-				
-				swap_ehead(m->data);
-				
-				/* save the status, ACK for TH_FIN of client was sent 
-				* so send FIN on the next time
-				*/
-				if (rt == 2)
-					cb->flags = (TH_ACK | TH_FIN);
-					
-				return m;
-			}
+			if (response_len > 0)
+				return tcp_segments(m0, cb, response_buffer, 
+				    response_len);
 		}
 	} else {
 		// printf("DEBUG: Not HTTP data packet - flags: 0x%02x, dsize: %d\n", orig_th->th_flags, orig_dsize);
@@ -815,23 +1424,16 @@ struct packet *tcpReply(struct packet *m0, sesscb *cb)
 	/* Default TCP reply (no HTTP data) */
 	// printf("DEBUG: Creating default TCP reply packet\n");
 	len = sizeof(ethdr) + sizeof(iphdr) + sizeof(tcphdr);
-	m = new_pkt(len);
+	m = alloc_pkt(len + TCPOLEN_MAXSEG);
 	if (m == NULL)
 		return NULL;
-	memcpy(m->data, m0->data, m->len);
+	memcpy(m->data, m0->data, len);
 	
 	eh = (ethdr *)(m->data);
 	ip = (iphdr *)(eh + 1);
-	ti = (tcpiphdr *)ip;
 	th = (tcphdr *)(ip + 1);
 	
 	tcplen = ntohs(ip->len) - sizeof(iphdr);
-	ip->len = htons(len - sizeof(ethdr));
-	
-	ip->dip ^= ip->sip;
-	ip->sip ^= ip->dip;
-	ip->dip ^= ip->sip;
-	ip->ttl = TTL;
 	
 	int rt = tcpReplyPacket(th, cb, tcplen);
 	if (rt == 0) {
@@ -841,18 +1443,12 @@ struct packet *tcpReply(struct packet *m0, sesscb *cb)
 	} 
 	
 	// printf("DEBUG: Default TCP reply packet created successfully\n");
-			
-	ti->ti_len = htons(len - sizeof(iphdr));
 	
-	bcopy(((struct ipovly *)ip)->ih_x1, b, 9);
-	bzero(((struct ipovly *)ip)->ih_x1, 9);
+	optlen = tcp_mssopt(th, cb->mtu - sizeof(iphdr) - sizeof(tcphdr));
+	m->len = len + optlen;
+	ip_reply(ip, m->len - sizeof(ethdr));
 	
-	ti->ti_sum = 0;
-	ti->ti_sum = cksum((unsigned short *)ti, len);
-	bcopy(b, ((struct ipovly *)ip)->ih_x1, 9);
-
-	ip->cksum = 0;
-	ip->cksum = cksum((unsigned short *)ip, sizeof(iphdr));
+	tcp_sum(m, ip, th, optlen, cksum_add(th + 1, optlen, 0));
 	
 	swap_ehead(m->data);
 	
@@ -871,7 +1467,7 @@ int tcp6(pcs *pc, struct packet *m)
 	struct tcphdr *th = (struct tcphdr *)(ip + 1);
 	sesscb *cb = NULL;
 	struct packet *p = NULL;
-	int i;
+	u_int h;
 
 	/* from linklocal */
 	if (ip->src.addr16[0] == IPV6_ADDR_INT16_ULL) {
@@ -922,49 +1518,37 @@ int tcp6(pcs *pc, struct packet *m)
 	/* request process
 	 * find control block 
 	 */
-	for (i = 0; i < MAX_SESSIONS; i++) {
-		if (th->th_flags == TH_SYN) {
-			if (pc->sesscb[i].timeout == 0 || 
-				(IP6EQ(&(pc->sesscb[i].sip6), &(ip->src)) && 
-				 IP6EQ(&(pc->sesscb[i].dip6), &(ip->dst)) &&
-				 th->th_sport == pc->sesscb[i].sport &&
-				 th->th_dport == pc->sesscb[i].dport)) {
-				/* get new scb */
-				cb = &pc->sesscb[i];
-				cb->timeout = time_tick;
-				cb->seq = random();
-				memcpy(cb->sip6.addr8, ip->src.addr8, 16);
-				memcpy(cb->dip6.addr8, ip->dst.addr8, 16);
-				cb->sport = th->th_sport;
-				cb->dport = th->th_dport;
-
-				break;
-			}
-		} else {
-
-	
-			if ((time_tick - 
-			    pc->sesscb[i].timeout <= TCP_TIMEOUT) && 
-			    IP6EQ(&(pc->sesscb[i].sip6), &(ip->src)) && 
-			    IP6EQ(&(pc->sesscb[i].dip6), &(ip->dst)) &&
-			    th->th_sport == pc->sesscb[i].sport &&
-			    th->th_dport == pc->sesscb[i].dport) {
-				/* get the scb */
-				cb = &pc->sesscb[i];
-				break;
-			}	
+	h = sess_hash(&ip->src, &ip->dst, 16, th->th_sport, th->th_dport);
+	pthread_mutex_lock(&pc->locker);
+	cb = sess_lookup6(pc, h, ip, th->th_sport, th->th_dport);
+	if (cb != NULL && th->th_flags != TH_SYN && sess_expired(cb))
+		cb = NULL;
+	if (th->th_flags == TH_SYN) {
+		if (cb == NULL)
+			cb = sess_alloc(pc, h);
+		if (cb == NULL) {
+			printf("VPCS %d out of session\n", pc->id);
+			pthread_mutex_unlock(&pc->locker);
+			return PKT_DROP;
 		}
-	}
-
-	if (th->th_flags == TH_SYN && cb == NULL) {
-		printf("VPCS %d out of session\n", pc->id);
-		return PKT_DROP;
+		/* get new scb */
+		cb->timeout = time_tick;
+		cb->seq = random();
+		memcpy(cb->sip6.addr8, ip->src.addr8, 16);
+		memcpy(cb->dip6.addr8, ip->dst.addr8, 16);
+		cb->sport = th->th_sport;
+		cb->dport = th->th_dport;
+		cb->mtu = pc->mtu;
+		tcp_synopt(cb, (u_char *)(th + 1), 
+		    (th->th_off << 2) - sizeof(tcphdr));
+		/* the SYN|ACK offers no window scale, neither side scales */
+		cb->rwscale = cb->wscale = 0;
 	}
 
 	if (cb != NULL) {
 		if (th->th_flags == TH_ACK && cb->flags == TH_FIN) {
 			/* clear session */
-			memset(cb, 0, sizeof(sesscb));
+			sess_free(pc, cb);
 		} else {
 			cb->timeout = time_tick;
 			p = tcp6Reply(m, cb);
@@ -985,6 +1569,8 @@ int tcp6(pcs *pc, struct packet *m)
 		}
 	}
 
+	pthread_mutex_unlock(&pc->locker);
+
 	/* anyway tell caller to drop this packet */
 	return PKT_DROP;	
 }
@@ -995,15 +1581,15 @@ struct packet *tcp6Reply(struct packet *m0, sesscb *cb)
 	ip6hdr *ip;
 	tcphdr *th;
 	struct packet *m;
-	int len;
+	int len, optlen;
 	int tcplen = 0;
 	
 	len = sizeof(ethdr) + sizeof(ip6hdr) + sizeof(tcphdr);
-	m = new_pkt(len);
+	m = alloc_pkt(len + TCPOLEN_MAXSEG);
 	if (m == NULL)
 		return NULL;
 		
-	memcpy(m->data, m0->data, m->len);
+	memcpy(m->data, m0->data, len);
 	
 	eh = (ethdr *)(m->data);
 	ip = (ip6hdr *)(eh + 1);
@@ -1022,8 +1608,12 @@ struct packet *tcp6Reply(struct packet *m0, sesscb *cb)
 		return NULL;
 	} 
 
+	optlen = tcp_mssopt(th, cb->mtu - sizeof(ip6hdr) - sizeof(tcphdr));
+	m->len = len + optlen;
+	ip->ip6_plen = htons(sizeof(tcphdr) + optlen);
+	
 	th->th_sum = 0;
-	th->th_sum = cksum6(ip, IPPROTO_TCP, len);
+	th->th_sum = cksum6(ip, IPPROTO_TCP, sizeof(tcphdr) + optlen);
 	
 	/* save the status, ACK for TH_FIN of client was sent 
 	 * so send FIN on the next time
@@ -28,10 +28,38 @@
 #define _TCP_H_
 
 #define TCP_TIMEOUT 60 /* seconds */
+#define TCP_SNDQ 64 /* segments in flight */
+#define TCP_INITWND 4 /* initial cwnd, segments */
+#define TCP_SSTHRESH 65535
+#define TCP_WINDOW 65535 /* the server window, it eats all at once */
+#define TCP_WSCALE 1 /* my window shift, sent with SYN */
+#define TCP_RCVBUF 65536 /* the client receive buffer, power of 2 */
+#define TCP_OOOQ 64 /* out of order segments held */
+#define TCP_POLLWAIT 100 /* ms, the longest sleep of the sender */
+
+/* 
+ * the client receive buffer, the data in order is in the ring from 
+ * head (read by the application) to tail (rcv_nxt), the segments 
+ * ahead of rcv_nxt in oooq, sorted by seq.
+ */
+struct rcvbuf {
+	u_int head;
+	u_int tail;
+	u_int wnd;	/* the window advertised last */
+	int fin;	/* FIN taken */
+	int nooo;
+	struct packet *oooq;
+	char buf[TCP_RCVBUF];
+};
+
 int tcp_open(pcs *pc, int ipv);
 int tcp_send(pcs *pc, int ipv);
 int tcp_close(pcs *pc, int ipv);
+int tcp_recv(pcs *pc, int ipv, char *buf, int len, int wait);
+void tcp_release(sesscb *cb);
+void tcp_synopt(sesscb *cb, const u_char *opt, int len);
 
+void init_sessions(pcs *pc);
 int tcp(pcs *pc, struct packet *m0);
 struct packet *tcpReply(struct packet *m0, sesscb *cb);
 
@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "timer.h"
+
+/*
+ * 256 slots of one tick, then 3 levels of 64 slots, each slot of a level
+ * covers the whole lower level. A timer is cascaded down a level when its 
+ * slot comes up, about 7.7 days fit in, the later ones are clamped.
+ */
+#define TVR_BITS	8
+#define TVN_BITS	6
+#define TVR_SIZE	(1 << TVR_BITS)
+#define TVN_SIZE	(1 << TVN_BITS)
+#define TVR_MASK	(TVR_SIZE - 1)
+#define TVN_MASK	(TVN_SIZE - 1)
+#define TVN_LEVELS	3
+#define TV_MAXTICKS	((1 << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1)
+#define TVN_SHIFT(n)	(TVR_BITS + (n) * TVN_BITS)
+#define TVN_INDEX(j, n)	(((j) >> TVN_SHIFT(n)) & TVN_MASK)
+
+static struct {
+	pthread_mutex_t locker;
+	pthread_cond_t cond;
+	pthread_t pid;
+	u_int jiffies;			/* the next tick to run */
+	u_int sleep;			/* the thread sleeps until */
+	int idle;
+	int count;			/* armed timers */
+	struct vtimer tv1[TVR_SIZE];
+	struct vtimer tvn[TVN_LEVELS][TVN_SIZE];
+} wheel;
+
+static time_t epoch;			/* wall clock at the monotonic zero */
+
+static u_int now_ticks(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (u_int)(ts.tv_sec * (1000 / TIMER_TICK) + 
+	    ts.tv_nsec / (TIMER_TICK * 1000000));
+}
+
+/*
+ * seconds, read off the monotonic clock, so nothing has to tick to keep it
+ */
+u_int time_sec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (u_int)(epoch + ts.tv_sec);
+}
+
+static void list_init(struct vtimer *head)
+{
+	head->next = head->prev = head;
+}
+
+static int list_empty(struct vtimer *head)
+{
+	return head->next == head;
+}
+
+static void list_add(struct vtimer *head, struct vtimer *t)
+{
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static void list_del(struct vtimer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+static void internal_add(struct vtimer *t)
+{
+	struct vtimer *head;
+	u_int idx = t->expires - wheel.jiffies;
+	int n;
+	
+	if ((int)idx < 0) {
+		/* already expired, run it on the next tick */
+		head = &wheel.tv1[wheel.jiffies & TVR_MASK];
+	} else if (idx < TVR_SIZE) {
+		head = &wheel.tv1[t->expires & TVR_MASK];
+	} else {
+		if (idx > TV_MAXTICKS) {
+			idx = TV_MAXTICKS;
+			t->expires = wheel.jiffies + idx;
+		}
+		for (n = 0; n < TVN_LEVELS - 1; n++) {
+			if (idx < (1U << TVN_SHIFT(n + 1)))
+				break;
+		}
+		head = &wheel.tvn[n][TVN_INDEX(t->expires, n)];
+	}
+	list_add(head, t);
+}
+
+/* move the timers of the slot down, return the index */
+static int cascade(int n, int index)
+{
+	struct vtimer list, *t;
+	
+	list_init(&list);
+	while (!list_empty(&wheel.tvn[n][index])) {
+		t = wheel.tvn[n][index].next;
+		list_del(t);
+		list_add(&list, t);
+	}
+	while (!list_empty(&list)) {
+		t = list.next;
+		list_del(t);
+		internal_add(t);
+	}
+	
+	return index;
+}
+
+static void run_timers(u_int now)
+{
+	struct vtimer *t;
+	void (*fn)(void *);
+	void *arg;
+	int index, n;
+	
+	while ((int)(now - wheel.jiffies) >= 0) {
+		index = wheel.jiffies & TVR_MASK;
+		for (n = 0; n < TVN_LEVELS && index == 0; n++) {
+			if (cascade(n, TVN_INDEX(wheel.jiffies, n)) != 0)
+				break;
+		}
+		wheel.jiffies++;
+		
+		while (!list_empty(&wheel.tv1[index])) {
+			t = wheel.tv1[index].next;
+			list_del(t);
+			wheel.count--;
+			fn = t->fn;
+			arg = t->arg;
+			
+			pthread_mutex_unlock(&wheel.locker);
+			fn(arg);
+			pthread_mutex_lock(&wheel.locker);
+		}
+	}
+}
+
+/* 
+ * the tick of the nearest timer, or of the nearest slot which has 
+ * to be cascaded
+ */
+static u_int next_timer(void)
+{
+	u_int j = wheel.jiffies;
+	u_int next, t;
+	int i, n;
+	
+	for (i = 0; i < TVR_SIZE; i++) {
+		if (!list_empty(&wheel.tv1[(j + i) & TVR_MASK]))
+			return j + i;
+	}
+	
+	next = j + TV_MAXTICKS;
+	for (n = 0; n < TVN_LEVELS; n++) {
+		for (i = 1; i <= TVN_SIZE; i++) {
+			if (list_empty(&wheel.tvn[n][(TVN_INDEX(j, n) + i) & TVN_MASK]))
+				continue;
+			t = ((j >> TVN_SHIFT(n)) + i) << TVN_SHIFT(n);
+			if ((int)(t - next) < 0)
+				next = t;
+			break;
+		}
+	}
+	
+	return next;
+}
+
+static void *pth_timer(void *dummy)
+{
+	struct timeval tv;
+	struct timespec ts;
+	u_int now;
+	int msec;
+	
+	pthread_mutex_lock(&wheel.locker);
+	while (1) {
+		now = now_ticks();
+		run_timers(now);
+		
+		wheel.sleep = next_timer();
+		wheel.idle = 1;
+		if (wheel.count == 0) {
+			pthread_cond_wait(&wheel.cond, &wheel.locker);
+		} else {
+			msec = (int)(wheel.sleep - now_ticks()) * TIMER_TICK;
+			if (msec > 0) {
+				gettimeofday(&tv, NULL);
+				ts.tv_sec = tv.tv_sec + msec / 1000;
+				ts.tv_nsec = (tv.tv_usec + (msec % 1000) * 1000) * 1000;
+				if (ts.tv_nsec >= 1000000000) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&wheel.cond, &wheel.locker, &ts);
+			}
+		}
+		wheel.idle = 0;
+	}
+	
+	return NULL;
+}
+
+void timer_init(void)
+{
+	struct timespec ts;
+	int i, n;
+	
+	pthread_mutex_init(&wheel.locker, NULL);
+	pthread_cond_init(&wheel.cond, NULL);
+	for (i = 0; i < TVR_SIZE; i++)
+		list_init(&wheel.tv1[i]);
+	for (n = 0; n < TVN_LEVELS; n++) {
+		for (i = 0; i < TVN_SIZE; i++)
+			list_init(&wheel.tvn[n][i]);
+	}
+	wheel.jiffies = now_ticks();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	epoch = time(0) - ts.tv_sec;
+	
+	if (pthread_create(&wheel.pid, NULL, pth_timer, NULL) != 0) {
+		printf("Create timer thread error\n");
+		exit(-1);
+	}
+}
+
+void timer_set(struct vtimer *t, void (*fn)(void *), void *arg)
+{
+	t->next = t->prev = NULL;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+/*
+ * arm the timer to fire in msec, rearm it if it is pending
+ */
+void timer_add(struct vtimer *t, int msec)
+{
+	pthread_mutex_lock(&wheel.locker);
+	
+	if (t->next != NULL)
+		list_del(t);
+	else
+		wheel.count++;
+	t->expires = now_ticks() + (msec + TIMER_TICK - 1) / TIMER_TICK;
+	internal_add(t);
+	
+	/* earlier than the thread expects */
+	if (wheel.idle && (int)(t->expires - wheel.sleep) < 0) {
+		wheel.sleep = t->expires;
+		pthread_cond_signal(&wheel.cond);
+	}
+	
+	pthread_mutex_unlock(&wheel.locker);
+}
+
+void timer_del(struct vtimer *t)
+{
+	pthread_mutex_lock(&wheel.locker);
+	if (t->next != NULL) {
+		list_del(t);
+		wheel.count--;
+	}
+	pthread_mutex_unlock(&wheel.locker);
+}
+
+int timer_pending(struct vtimer *t)
+{
+	int pending;
+	
+	pthread_mutex_lock(&wheel.locker);
+	pending = (t->next != NULL);
+	pthread_mutex_unlock(&wheel.locker);
+	
+	return pending;
+}
+
+/* end of file */
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <sys/types.h>
+
+/*
+ * hierarchical timer wheel
+ *
+ * One thread runs the timers of all VPCs and sleeps until the nearest 
+ * deadline. The callbacks run on that thread without the wheel locked, 
+ * they may add or delete timers but must not block. A timer lives in
+ * the structure which owns it and is never freed while armed.
+ */
+#define TIMER_TICK	10	/* ms */
+
+struct vtimer {
+	struct vtimer *next;
+	struct vtimer *prev;
+	u_int expires;		/* in ticks */
+	void (*fn)(void *);
+	void *arg;
+};
+
+/* seconds, the timeouts of the pools and sessions are counted in */
+u_int time_sec(void);
+#define time_tick	time_sec()
+
+void timer_init(void);
+void timer_set(struct vtimer *t, void (*fn)(void *), void *arg);
+void timer_add(struct vtimer *t, int msec);
+void timer_del(struct vtimer *t);
+int timer_pending(struct vtimer *t);
+
+#endif
+
+/* end of file */
@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#ifdef Linux
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef Linux
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "globle.h"
+#include "dev.h"
+#include "uring.h"
+
+extern int devtype;
+
+#if defined(Linux) && defined(__NR_io_uring_setup)
+
+/* linux 6.7, the older headers have not it */
+#define URING_OP_READ_MULTISHOT	49
+
+/* a submission and completion queue pair */
+struct uq {
+	int fd;
+	void *map;
+	size_t maplen;
+	struct io_uring_sqe *sqes;
+	size_t sqelen;
+	u_int *sqhead;
+	u_int *sqtail;
+	u_int *sqarray;
+	u_int sqmask;
+	u_int sqentries;
+	u_int sqt;			/* the tail not yet published */
+	u_int pending;			/* queued, not yet submitted */
+	u_int *cqhead;
+	u_int *cqtail;
+	u_int cqmask;
+	struct io_uring_cqe *cqes;
+};
+
+struct uring {
+	struct uq rx;			/* the reader's */
+	struct uq tx;			/* the writer's */
+	
+	/* rx, the buffers lent to the kernel */
+	struct io_uring_buf_ring *br;
+	u_short brtail;
+	struct packet *bufs[URING_BUFS];
+	int armed;			/* the receive is pending */
+	int multishot;			/* cleared if the kernel has not it */
+};
+
+static int sys_setup(u_int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, u_int submit, u_int wait, u_int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, u_int op, void *arg, u_int nr)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static void uq_close(struct uq *q)
+{
+	if (q->sqes != NULL && q->sqes != MAP_FAILED)
+		munmap(q->sqes, q->sqelen);
+	if (q->map != NULL && q->map != MAP_FAILED)
+		munmap(q->map, q->maplen);
+	if (q->fd > 0)
+		close(q->fd);
+}
+
+static int uq_setup(struct uq *q, u_int entries, u_int cqentries)
+{
+	struct io_uring_params p;
+	size_t sqlen, cqlen;
+	char *m;
+	
+	memset(&p, 0, sizeof(p));
+	if (cqentries) {
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = cqentries;
+	}
+	q->fd = sys_setup(entries, &p);
+	if (q->fd < 0)
+		return -1;
+	/* linux 5.4 */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS;
+		return -1;
+	}
+	
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(u_int);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	q->maplen = (sqlen > cqlen) ? sqlen : cqlen;
+	q->map = mmap(NULL, q->maplen, PROT_READ | PROT_WRITE, 
+	    MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+	if (q->map == MAP_FAILED)
+		return -1;
+	q->sqelen = p.sq_entries * sizeof(struct io_uring_sqe);
+	q->sqes = mmap(NULL, q->sqelen, PROT_READ | PROT_WRITE, 
+	    MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+	if (q->sqes == MAP_FAILED)
+		return -1;
+	
+	m = q->map;
+	q->sqhead = (u_int *)(m + p.sq_off.head);
+	q->sqtail = (u_int *)(m + p.sq_off.tail);
+	q->sqarray = (u_int *)(m + p.sq_off.array);
+	q->sqmask = *(u_int *)(m + p.sq_off.ring_mask);
+	q->sqentries = p.sq_entries;
+	q->sqt = *q->sqtail;
+	q->cqhead = (u_int *)(m + p.cq_off.head);
+	q->cqtail = (u_int *)(m + p.cq_off.tail);
+	q->cqmask = *(u_int *)(m + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)(m + p.cq_off.cqes);
+	
+	return 0;
+}
+
+/* a free entry, or NULL if all are queued */
+static struct io_uring_sqe *uq_sqe(struct uq *q)
+{
+	struct io_uring_sqe *sqe;
+	u_int i;
+	
+	if (q->sqt - __atomic_load_n(q->sqhead, __ATOMIC_ACQUIRE) >= 
+	    q->sqentries)
+		return NULL;
+	
+	i = q->sqt & q->sqmask;
+	sqe = &q->sqes[i];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	q->sqarray[i] = i;
+	q->sqt++;
+	q->pending++;
+	
+	return sqe;
+}
+
+/*
+ * submit the queued entries and wait for wait completions, 
+ * one syscall for both.
+ */
+static int uq_enter(struct uq *q, u_int wait)
+{
+	int rc;
+	
+	__atomic_store_n(q->sqtail, q->sqt, __ATOMIC_RELEASE);
+	rc = sys_enter(q->fd, q->pending, wait, 
+	    wait ? IORING_ENTER_GETEVENTS : 0);
+	if (rc > 0)
+		q->pending -= ((u_int)rc < q->pending) ? (u_int)rc : q->pending;
+	
+	return rc;
+}
+
+/* take back the entries the kernel has not seen */
+static void uq_unqueue(struct uq *q)
+{
+	q->sqt -= q->pending;
+	q->pending = 0;
+	__atomic_store_n(q->sqtail, q->sqt, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_cqe *uq_cqe(struct uq *q)
+{
+	u_int head = *q->cqhead;
+	
+	if (head == __atomic_load_n(q->cqtail, __ATOMIC_ACQUIRE))
+		return NULL;
+	
+	return &q->cqes[head & q->cqmask];
+}
+
+static void uq_seen(struct uq *q)
+{
+	__atomic_store_n(q->cqhead, *q->cqhead + 1, __ATOMIC_RELEASE);
+}
+
+/* lend the buffer bid to the kernel, published by rx_publish */
+static void rx_give(struct uring *u, int bid)
+{
+	struct io_uring_buf *b;
+	
+	b = &u->br->bufs[u->brtail & (URING_BUFS - 1)];
+	b->addr = (uintptr_t)u->bufs[bid]->data;
+	b->len = PKT_MAXSIZE;
+	b->bid = bid;
+	u->brtail++;
+}
+
+static void rx_publish(struct uring *u)
+{
+	__atomic_store_n(&u->br->tail, u->brtail, __ATOMIC_RELEASE);
+}
+
+/*
+ * the multishot receive completes with IORING_CQE_F_MORE till it stops,
+ * the socket was shut down or the buffers ran out. The old kernels have
+ * not the multishot read of the tap, one read is armed a time.
+ */
+static void rx_arm(struct uring *u, int fd)
+{
+	struct io_uring_sqe *sqe;
+	
+	sqe = uq_sqe(&u->rx);
+	if (sqe == NULL)
+		return;
+	
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	if (devtype == DEV_UDP) {
+		sqe->opcode = IORING_OP_RECV;
+		if (u->multishot)
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+		else
+			sqe->len = PKT_MAXSIZE;
+	} else {
+		sqe->off = (uint64_t)-1;
+		if (u->multishot)
+			sqe->opcode = URING_OP_READ_MULTISHOT;
+		else {
+			sqe->opcode = IORING_OP_READ;
+			sqe->len = PKT_MAXSIZE;
+		}
+	}
+	u->armed = 1;
+}
+
+/*
+ * wait for the frames, the packet of every frame is swapped with the
+ * empty one in pkts, which is lent to the kernel in its place. return 
+ * the count of the frames.
+ */
+int uring_readv(struct uring *u, int fd, struct packet **pkts, int n)
+{
+	struct io_uring_cqe *cqe;
+	struct packet *m;
+	int k = 0, res, bid;
+	u_int flags;
+	
+	while (k == 0) {
+		if (!u->armed)
+			rx_arm(u, fd);
+		
+		cqe = uq_cqe(&u->rx);
+		if (cqe == NULL) {
+			if (uq_enter(&u->rx, 1) < 0 && errno != EINTR && 
+			    errno != EAGAIN && errno != EBUSY)
+				return 0;
+			continue;
+		}
+		
+		for (; cqe != NULL && k < n; cqe = uq_cqe(&u->rx)) {
+			res = cqe->res;
+			flags = cqe->flags;
+			uq_seen(&u->rx);
+			
+			if (!(flags & IORING_CQE_F_MORE))
+				u->armed = 0;
+			if (!(flags & IORING_CQE_F_BUFFER)) {
+				if (res == -EINVAL && u->multishot) {
+					u->multishot = 0;
+					continue;
+				}
+				/* out of buffers, rearmed on the next turn */
+				if (res == -ENOBUFS || res == -EINTR || 
+				    res == -EAGAIN)
+					continue;
+				/* the device was shut down or replaced */
+				rx_publish(u);
+				return k;
+			}
+			
+			bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			if (res <= 0) {
+				rx_give(u, bid);
+				continue;
+			}
+			m = u->bufs[bid];
+			u->bufs[bid] = pkts[k];
+			rx_give(u, bid);
+			m->len = res;
+			pkts[k++] = m;
+		}
+		rx_publish(u);
+	}
+	
+	return k;
+}
+
+/*
+ * queue a send for every frame, submit them at once and wait till all
+ * are done, the packets are freed by the caller. return the count of 
+ * the frames sent.
+ */
+int uring_writev(struct uring *u, int fd, struct packet **pkts, int n)
+{
+	struct uq *q = &u->tx;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int i, res, done, sent;
+	
+	for (i = 0; i < n; i++) {
+		sqe = uq_sqe(q);
+		if (sqe == NULL)
+			break;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)pkts[i]->data;
+		sqe->len = pkts[i]->len;
+		sqe->user_data = i;
+		if (devtype == DEV_UDP)
+			sqe->opcode = IORING_OP_SEND;
+		else {
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->off = (uint64_t)-1;
+		}
+	}
+	n = i;
+	
+	done = sent = 0;
+	while (done < n) {
+		if (uq_enter(q, n - done) < 0 && errno != EINTR) {
+			if (q->pending == (u_int)(n - done)) {
+				uq_unqueue(q);
+				break;
+			}
+		}
+		while ((cqe = uq_cqe(q)) != NULL) {
+			res = cqe->res;
+			i = cqe->user_data;
+			uq_seen(q);
+			done++;
+			if (res == pkts[i]->len || 
+			    (devtype == DEV_UDP && TUNNEL_ERR(-res)))
+				sent++;
+		}
+	}
+	
+	return sent;
+}
+
+struct uring *uring_open(void)
+{
+	struct io_uring_buf_reg reg;
+	struct uring *u;
+	int i, e;
+	
+	u = calloc(1, sizeof(struct uring));
+	if (u == NULL)
+		return NULL;
+	
+	/* the rx completions pile up while the reader is busy */
+	if (uq_setup(&u->rx, 4, 2 * URING_BUFS) < 0 || 
+	    uq_setup(&u->tx, PKT_BURST, 0) < 0)
+		goto err;
+	
+	u->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), 
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		goto err;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	/* linux 5.19 */
+	if (sys_register(u->rx.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto err;
+	
+	for (i = 0; i < URING_BUFS; i++) {
+		u->bufs[i] = alloc_pkt(PKT_MAXSIZE);
+		if (u->bufs[i] == NULL)
+			goto err;
+		rx_give(u, i);
+	}
+	rx_publish(u);
+	u->multishot = 1;
+	
+	return u;
+	
+err:
+	e = errno;
+	uq_close(&u->rx);
+	uq_close(&u->tx);
+	if (u->br != NULL)
+		munmap(u->br, URING_BUFS * sizeof(struct io_uring_buf));
+	for (i = 0; i < URING_BUFS; i++) {
+		if (u->bufs[i] != NULL)
+			del_pkt(u->bufs[i]);
+	}
+	free(u);
+	errno = e;
+	
+	return NULL;
+}
+
+#else
+
+struct uring *uring_open(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+int uring_readv(struct uring *u, int fd, struct packet **pkts, int n)
+{
+	return 0;
+}
+
+int uring_writev(struct uring *u, int fd, struct packet **pkts, int n)
+{
+	return 0;
+}
+
+#endif
+
+/* end of file */
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2007-2014, Paul Meng (mirnshi@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+ * THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include "vpcs.h"
+
+/*
+ * io_uring device i/o
+ *
+ * An alternative to the read/write calls of the udp and tap devices. The
+ * reader lends a ring of buffers, taken from the packet pool, to the 
+ * kernel and keeps one multishot receive armed, every frame completes 
+ * into one of them with no syscall. A filled buffer is swapped with the 
+ * empty packet of the reader, nothing is copied. The writer queues a 
+ * batch of sends and submits them with one syscall. The reader and the
+ * writer own a ring each, no lock is taken.
+ */
+#define URING_BUFS	256		/* rx buffers, a power of 2 */
+#define URING_BGID	0		/* the buffer group */
+
+struct uring *uring_open(void);
+int uring_readv(struct uring *u, int fd, struct packet **pkts, int n);
+int uring_writev(struct uring *u, int fd, struct packet **pkts, int n);
+
+#endif
+
+/* end of file */
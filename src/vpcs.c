@@ -32,6 +32,7 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 
 #ifdef cygwin
 #include <windows.h>
@@ -50,15 +51,19 @@
 #include "help.h"
 #include "httpd.h"
 #include "dump.h"
+#include "filter.h"
 #include "relay.h"
 #include "dhcp.h"
 #include "frag6.h"
+#include "agg.h"
+#include "tcp.h"
+#include "cksum.h"
 
 const char *ver = "0.8.3";
 /* track the binary */
 static const char *ident = "$Id$";
 
-pcs vpc[MAX_NUM_PTHS];
+pcs *vpc = NULL;
 
 int pcid = 0;  /* current vpc id */
 int devtype = 0;
@@ -76,17 +81,19 @@ char *startupfile = NULL;
 const char *default_startupfile = "startup.vpc";
 char *histfile = "vpcs.hist";
 
-u_int time_tick = 0; /* time tick (second) */
-
 int ctrl_c = 0; /* ctrl+c was pressed */
 
 struct rls *rls = NULL;
 
 int daemon_port = 0;
 
-int num_pths = MAX_NUM_PTHS;  /* number of VPCs */
+int num_pths = DEF_NUM_PTHS;  /* number of VPCs */
 
 char *tapname = "tap0";  /* TAP device name (only when 1 VPC is created) */
+int tapoffload = 0;	/* checksum and segmentation offload on the TAP */
+int tapqueues = 1;	/* queues per TAP, IFF_MULTI_QUEUE */
+char *ringname = NULL;	/* interface of the AF_PACKET mode */
+int devuring = 0;	/* device i/o by io_uring */
 
 int macaddr = 0; /* the last byte of ether address */
 
@@ -94,8 +101,10 @@ int macaddr = 0; /* the last byte of ether address */
 static void *pth_reader(void *devid);
 static void *pth_output(void *devid);
 static void *pth_writer(void *devid);
-static void *pth_timer_tick(void *);
+static void *pth_qreader(void *arg);
+static void *pth_qwriter(void *arg);
 static void *pth_bgjob(void *);
+static void bgjob_wakeup(void *);
 void parse_cmd(char *cmdstr);
 static void sig_int(int sig);
 static void sig_clean(int sig);
@@ -124,6 +133,7 @@ static cmdStub cmd_entry[] = {
 	{"clear",	NULL,	run_clear,	help_clear},
 	{"dhcp",	"ip",	run_ipconfig,	help_ip},
 	{"disconnect",  NULL,   run_disconnect, NULL},
+	{"dump",	NULL,	run_dump,	help_dump},
 	{"echo",	NULL,	run_echo,	NULL},
 	{"help",	NULL,	run_help,	help_help},
 	{"history",	NULL,	run_hist,	NULL},
@@ -156,7 +166,7 @@ int main(int argc, char **argv)
 	int i;
 	char prompt[MAX_LEN];
 	int c;
-	pthread_t timer_pid, relay_pid, bgjob_pid;
+	pthread_t relay_pid, bgjob_pid;
 	int daemon_bg = 1;
 	char *cmd;
 
@@ -164,7 +174,7 @@ int main(int argc, char **argv)
 	rhost = inet_addr("127.0.0.1");
 	
 	devtype = DEV_UDP;		
-	while ((c = getopt(argc, argv, "?c:efhm:p:r:Rs:t:uvFi:d:")) != -1) {
+	while ((c = getopt(argc, argv, "?c:efhm:p:r:Rs:t:uvFi:d:Oq:l:U")) != -1) {
 		switch (c) {
 			case 'c':
 				rport_flag = 1;
@@ -206,7 +216,7 @@ int main(int argc, char **argv)
 				daemon_bg = 0;
 				break;
 			case 'i':
-				num_pths = arg2int(optarg, 1, 9, 9);
+				num_pths = arg2int(optarg, 1, MAX_NUM_PTHS, DEF_NUM_PTHS);
 				break;
 			case 'd':
 				if (num_pths != 1) {
@@ -215,6 +225,19 @@ int main(int argc, char **argv)
 				}
 				tapname = strdup(optarg);
 				break;
+			case 'O':
+				tapoffload = 1;
+				break;
+			case 'q':
+				tapqueues = arg2int(optarg, 1, TAPQ_MAX, 1);
+				break;
+			case 'l':
+				devtype = DEV_PACKET;
+				ringname = strdup(optarg);
+				break;
+			case 'U':
+				devuring = 1;
+				break;
 
 			case 'h':
 			case '?':
@@ -232,6 +255,12 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* one port per VPC, plus the relay port */
+	if (lport + num_pths > 65535 || rport + num_pths > 65535) {
+		printf("Too many VPCs for the udp port base %d/%d\n", lport, rport);
+		exit(-1);
+	}
+	
 	if (daemon_port && daemonize(daemon_port, daemon_bg))
 		exit(0);
 
@@ -248,23 +277,27 @@ int main(int argc, char **argv)
 
 	srand(time(0));
 	
-	init_ipfrag();
-	init_ip6frag();
+	cksum_init();
+	timer_init();
 	
-	memset(vpc, 0, MAX_NUM_PTHS * sizeof(pcs));
+	vpc = calloc(num_pths, sizeof(pcs));
+	if (vpc == NULL) {
+		printf("Out of memory\n");
+		exit(-1);
+	}
 	for (i = 0; i < num_pths; i++) {
-		if (pthread_create(&(vpc[i].rpid), NULL, pth_reader, (void *)&i) != 0) {
+		/* every thread of the VPC gets its own copy of the id */
+		vpc[i].id = i;
+		strcpy(vpc[i].xname, "VPCS");
+		if (pthread_create(&(vpc[i].rpid), NULL, pth_reader, 
+		    (void *)&vpc[i].id) != 0) {
 			printf("PC%d error\n", i + 1);
 			fflush(stdout);
 			exit(-1);
 		}
-		strcpy(vpc[i].xname, "VPCS");
 		while (vpc[i].ip4.mac[4] == 0) 
-			delay_ms(10);
-		delay_ms(100);
+			usleep(100);
 	}
-	pthread_create(&timer_pid, NULL, pth_timer_tick, (void *)0);
-	delay_ms(100);
 	pthread_create(&relay_pid, NULL, pth_relay, (void *)0);
 	pthread_create(&bgjob_pid, NULL, pth_bgjob, (void *)0);
 	pcid = 0;
@@ -298,6 +331,23 @@ int main(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * "1" .. num_pths to the vpc id, -1 if out of range
+ */
+int str2vpcid(const char *s)
+{
+	int id;
+	
+	if (!digitstring(s) || strlen(s) > 5)
+		return -1;
+	
+	id = atoi(s);
+	if (id < 1 || id > num_pths)
+		return -1;
+		
+	return id - 1;
+}
+
 void parse_cmd(char *cmdstr)
 {
 	cmdStub *ep = NULL, *cmd = NULL;
@@ -315,13 +365,14 @@ void parse_cmd(char *cmdstr)
 	if (argc == 0)
 		return;
 
-	if (argc == 1 && strlen(argv[0]) == 1 && num_pths >= 1 &&
-	    (argv[0][0] >= '0' && argv[0][0] <= '9')) {
-		if ((argv[0][0] - '0') <= num_pths) {
+	if (argc == 1 && digitstring(argv[0])) {
+		int id = str2vpcid(argv[0]);
+		
+		if (id != -1) {
 			if (echoctl.enable && runLoad)
 				printf("%s[%d] %s\n", vpc[pcid].xname, 
 				    pcid + 1, cmdstr);
-			pcid = argv[0][0] - '0' - 1;
+			pcid = id;
 			
 		} else 
 			printf("\nOnly %d VPCs actived\n", num_pths);
@@ -411,6 +462,7 @@ void parse_cmd(char *cmdstr)
 		
 		rc = cmd->f(argc, argv);
 
+		tcp_release(&vpc[pcid].mscb);
 		memset(&vpc[pcid].mscb, 0, sizeof(vpc[pcid].mscb));
 
 	} else
@@ -425,13 +477,213 @@ void sig_int(int sig)
 	signal(SIGINT, &sig_int);
 }
 
+/*
+ * the reader/writer hold dmpusers while in the dump file, filter and 
+ * flight recorder, the console waits for none before freeing them.
+ */
+static void dump_enter(pcs *pc)
+{
+	__atomic_add_fetch(&pc->dmpusers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void dump_leave(pcs *pc)
+{
+	__atomic_sub_fetch(&pc->dmpusers, 1, __ATOMIC_RELEASE);
+}
+
+void dump_quiesce(pcs *pc)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&pc->dmpusers, __ATOMIC_ACQUIRE) != 0)
+		sched_yield();
+}
+
+/* the flight recorder is set up by the first frame */
+static struct capring *capture(pcs *pc)
+{
+	struct capring *cr, *nil = NULL;
+	
+	cr = __atomic_load_n(&pc->capring, __ATOMIC_ACQUIRE);
+	if (cr != NULL)
+		return cr;
+	
+	cr = cap_open();
+	if (cr == NULL)
+		return NULL;
+	if (!__atomic_compare_exchange_n(&pc->capring, &nil, cr, 0, 
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* the other thread did it */
+		cap_close(cr);
+		return nil;
+	}
+	
+	return cr;
+}
+
+static int dump_wanted(pcs *pc, struct packet *m)
+{
+	struct dmpfilter *flt = pc->dmpfilter;
+	
+	return (flt == NULL || filter_match(flt, m));
+}
+
+/*
+ * a frame from the wire
+ */
+static void input(pcs *pc, struct packet *m)
+{
+	int rc;
+	
+	if (!pc->capoff || pc->dmpflag) {
+		dump_enter(pc);
+		if (!pc->capoff)
+			cap_packet(capture(pc), m);
+		if (pc->dmpflag && (!memcmp(m->data, pc->ip4.mac, ETH_ALEN) ||
+		    pc->dmpflag & DMP_ALL) && dump_wanted(pc, m)) {
+			if (pc->dmpflag & DMP_FILE)
+				dmp_packet2file(m, pc->dmpfile);
+			dmp_packet(m, pc->dmpflag);
+		}
+		dump_leave(pc);
+	}
+
+	rc = upv4(pc, &m);
+	if (rc == PKT_UP && !dhcp_enq(pc, m)) {
+		if (pc->mscb.sock != 0)
+			enq(&pc->iq, m);
+		else
+			del_pkt(m);
+	} else if (rc == PKT_DROP)
+		del_pkt(m);
+}
+
+/*
+ * receive from the queue q of the device and process the frames, 
+ * never returns.
+ */
+static void read_loop(pcs *pc, int q)
+{
+	struct packet *m = NULL;
+	struct packet *pkts[PKT_BURST];
+	struct packet *bpkts[AGG_MAXFRAMES];
+	struct timeval tv;
+	int i, j, k, n;
+	
+	memset(pkts, 0, sizeof(pkts));
+	while (1) {
+		/* receive straight into the packet buffers, the buffers 
+		 * which got nothing are kept for the next read */
+		for (i = 0; i < PKT_BURST; i++) {
+			if (pkts[i] != NULL)
+				continue;
+			pkts[i] = alloc_pkt(PKT_MAXSIZE);
+			if (pkts[i] == NULL) {
+				printf("Out of memory.\n");
+				exit(-1);
+			}
+		}
+		n = VReadv(pc, q, pkts, PKT_BURST);
+		if (n > 0)
+			gettimeofday(&tv, (void*)0);
+		
+		for (i = 0; i < n; i++) {
+			m = pkts[i];
+			pkts[i] = NULL;
+			/* the ring stamps its frames */
+			if (m->ts.tv_sec == 0)
+				m->ts = tv;
+			
+			k = agg_input(pc, m, bpkts);
+			if (k < 0) {
+				input(pc, m);
+				continue;
+			}
+			for (j = 0; j < k; j++)
+				input(pc, bpkts[j]);
+		}
+	}
+}
+
+/*
+ * open the other queues of the tap, each one gets a reader and a writer
+ * of its own. The writer of queue 0 steers the frames to them.
+ */
+static void tapq_start(pcs *pc)
+{
+	tapq *tq;
+	int q;
+	
+	if (devtype != DEV_TAP || tapqueues <= 1)
+		return;
+	
+	pc->tapq = calloc(tapqueues, sizeof(tapq));
+	if (pc->tapq == NULL) {
+		printf("Out of memory\n");
+		exit(-1);
+	}
+	for (q = 1; q < tapqueues; q++) {
+		tq = &pc->tapq[q];
+		tq->id = pc->id;
+		tq->q = q;
+		tq->fd = open_tap(pc->id);
+		if (tq->fd <= 0) {
+			printf("VPC%d open TAP queue %d error [%s]\n", pc->id + 1,
+			    q, strerror(errno));
+			break;
+		}
+		if (open_uring(pc, q) != 0)
+			printf("VPC%d io_uring of TAP queue %d error [%s]\n", 
+			    pc->id + 1, q, strerror(errno));
+		/* fed by the writer of queue 0 only */
+		init_queue(&tq->oq, 0);
+		tq->oq.type = 4 + q + pc->id * 100;
+		
+		if (pthread_create(&tq->wpid, NULL, pth_qwriter, tq) != 0 ||
+		    pthread_create(&tq->rpid, NULL, pth_qreader, tq) != 0) {
+			printf("PC%d error\n", pc->id + 1);
+			exit(-1);
+		}
+	}
+	/* the writer of queue 0 steers by ntapq, tapq goes first */
+	__atomic_store_n(&pc->ntapq, q, __ATOMIC_RELEASE);
+}
+
+void *pth_qreader(void *arg)
+{
+	tapq *tq = (tapq *)arg;
+	pcs *pc = &vpc[tq->id];
+	
+	tapq_pin(pc, tq->q);
+	read_loop(pc, tq->q);
+	
+	return NULL;
+}
+
+void *pth_qwriter(void *arg)
+{
+	tapq *tq = (tapq *)arg;
+	pcs *pc = &vpc[tq->id];
+	struct packet *pkts[PKT_BURST];
+	int i, n;
+	
+	tapq_pin(pc, tq->q);
+	while (1) {
+		n = waitdeq_batch(&tq->oq, pkts, PKT_BURST);
+		
+		if (VWritev(pc, tq->q, pkts, n) != n)
+			printf("Send packet error\n");
+		for (i = 0; i < n; i++)
+			del_pkt(pkts[i]);
+	}
+	
+	return NULL;
+}
+
 void *pth_reader(void *devid)
 {
 	int id;
 	pcs *pc = NULL;
-	struct packet *m = NULL;
-	u_char buf[PKT_MAXSIZE];
-	int rc;
+	int mprod;
 
 	id = *(int *)devid;
 	pc  = &vpc[id];
@@ -445,7 +697,7 @@ void *pth_reader(void *devid)
 	pc->ip4.mac[1] = 0x50;
 	pc->ip4.mac[2] = 0x79;
 	pc->ip4.mac[3] = 0x66;
-	pc->ip4.mac[4] = 0x68;
+	pc->ip4.mac[4] = 0x68 + (((id + macaddr) >> 8) & 0xff);
 	pc->ip4.mac[5] = (id + macaddr) & 0xff;
 	pc->ip4.flags |= IPF_FRAG;
 	pc->mtu = 1500;
@@ -461,17 +713,38 @@ void *pth_reader(void *devid)
 				printf("Create TAP device %s error [%s]\n", tapname, strerror(errno));
 		else if (devtype == DEV_UDP)
 			printf("Open port %d error [%s]\n", vpc[id].lport, strerror(errno));
+		else if (devtype == DEV_PACKET) {
+			if (num_pths > 1)
+				printf("Attach to %s%d error [%s]\n", ringname, id, strerror(errno));
+			else
+				printf("Attach to %s error [%s]\n", ringname, strerror(errno));
+		}
 		return NULL;
 	}
+	if (connect_udp(pc) != 0)
+		printf("VPC%d connect to remote peer error [%s]\n", id + 1, 
+		    strerror(errno));
+	if (open_uring(pc, 0) != 0)
+		printf("VPC%d io_uring error [%s], fall back to read/write\n", 
+		    id + 1, strerror(errno));
 		
 	pthread_mutex_init(&(pc->locker), NULL);
-	init_queue(&pc->iq);
+	pthread_mutex_init(&(pc->locker6), NULL);
+	init_sessions(pc);
+	arp_init(pc);
+	reass_init(&pc->reass);
+	timer_set(&pc->dhcptimer, bgjob_wakeup, pc);
+	/* iq/bgiq are fed by the reader only (one per queue of the tap), 
+	 * but oq/bgoq are shared by the reader, pth_output, dhcp and 
+	 * the console */
+	mprod = (devtype == DEV_TAP && tapqueues > 1) ? PQ_MPROD : 0;
+	init_queue(&pc->iq, mprod);
 	pc->iq.type = 0 + id * 100;
-	init_queue(&pc->oq);
+	init_queue(&pc->oq, PQ_MPROD);
 	pc->oq.type = 1 + id * 100;
-	init_queue(&pc->bgiq);
+	init_queue(&pc->bgiq, mprod);
 	pc->bgiq.type = 2 + id * 100;
-	init_queue(&pc->bgoq);
+	init_queue(&pc->bgoq, PQ_MPROD);
 	pc->bgoq.type = 3 + id * 100;
 	
 	
@@ -485,37 +758,9 @@ void *pth_reader(void *devid)
 		exit(-1);
 	}
 	
-	while (1) {
-		rc = VRead(pc, buf, PKT_MAXSIZE);
-		if (rc > 0) {
-			m = new_pkt(PKT_MAXSIZE);
-			if (m == NULL) {
-				printf("Out of memory.\n");
-				exit(-1);
-			}
-			memcpy(m->data, buf, rc);
-			m->len = rc;
-			gettimeofday(&(m->ts), (void*)0);
-
-			if (!memcmp(m->data, pc->ip4.mac, ETH_ALEN) ||
-			    pc->dmpflag & DMP_ALL) {
-				if (pc->dmpflag & DMP_FILE)
-					dmp_packet2file(m, pc->dmpfile);					
-				dmp_packet(m, pc->dmpflag);
-			}
-	
-			rc = upv4(pc, &m);
-			if (rc == PKT_UP) {
-				if (dhcp_enq(pc, m))
-					continue;
-				if (pc->mscb.sock != 0) {
-					enq(&pc->iq, m);
-				} else
-					del_pkt(m);
-			} else if (rc == PKT_DROP)
-				del_pkt(m);
-		}
-	}
+	tapq_start(pc);
+	tapq_pin(pc, 0);
+	read_loop(pc, 0);
 
 	return NULL;
 }
@@ -524,7 +769,8 @@ void *pth_output(void *devid)
 {
 	int id;
 	pcs *pc = NULL;
-	struct packet *m = NULL;
+	struct packet *pkts[PKT_BURST];
+	int i, n;
 	
 	id = *(int *)devid;
 	pc  = &vpc[id];
@@ -533,12 +779,10 @@ void *pth_output(void *devid)
 	   the ether address via arpresolv or neighbor solicitation 
 	*/
 	while (1) {
-		m = waitdeq(&pc->bgoq);
+		n = waitdeq_batch(&pc->bgoq, pkts, PKT_BURST);
 		
-		while (m) {
-			send4(pc, m);
-			m = deq(&pc->bgoq);
-		}
+		for (i = 0; i < n; i++)
+			send4(pc, pkts[i]);
 	}
 	return NULL;
 }
@@ -552,34 +796,72 @@ void *pth_writer(void *devid)
 	pc  = &vpc[id];
 	
 	locallink6(pc);
+	tapq_pin(pc, 0);
 	
 	while (1) {
+		struct packet *pkts[PKT_BURST];
+		struct packet *out[PKT_BURST + 1];
 		struct packet *m = NULL;
+		int i, k, n, t;
 
-		m = waitdeq(&pc->oq);
+		/* a bundle is pending, wait no longer than its deadline */
+		t = agg_timeout(pc);
+		if (t < 0)
+			n = waitdeq_batch(&pc->oq, pkts, PKT_BURST);
+		else
+			n = timedwaitdeq_batch(&pc->oq, pkts, PKT_BURST, t);
 
-		while (m) {
-			if (pc->dmpflag & DMP_FILE)
-				dmp_packet2file(m, pc->dmpfile);
+		if (!pc->capoff || pc->dmpflag) {
+			dump_enter(pc);
+			for (i = 0; !pc->capoff && i < n; i++)
+				cap_packet(capture(pc), pkts[i]);
+			for (i = 0; pc->dmpflag && i < n; i++) {
+				m = pkts[i];
+				if (!dump_wanted(pc, m))
+					continue;
+				if (pc->dmpflag & DMP_FILE)
+					dmp_packet2file(m, pc->dmpfile);
 
-			dmp_packet(m, pc->dmpflag);
-			if (VWrite(pc, m->data, m->len) != m->len)
+				dmp_packet(m, pc->dmpflag);
+			}
+			dump_leave(pc);
+		}
+		
+		n = tapq_steer(pc, pkts, n);
+		k = agg_output(pc, pkts, n, out);
+		if (n == 0 && agg_timeout(pc) == 0)
+			out[k++] = agg_flush(pc);
+		if (k == 0)
+			continue;
+		
+		for (i = 0; i < k; i += n) {
+			n = k - i;
+			if (n > PKT_BURST)
+				n = PKT_BURST;
+			if (VWritev(pc, 0, out + i, n) != n)
 				printf("Send packet error\n");
-			del_pkt(m);
-			
-			m = deq(&pc->oq);
 		}
+			
+		for (i = 0; i < k; i++)
+			del_pkt(out[i]);
 	}
 	return NULL;
 }
 
-void *pth_timer_tick(void *dummy)
+static pthread_mutex_t bgjob_locker = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bgjob_cond = PTHREAD_COND_INITIALIZER;
+static int bgjob_pending = 0;
+
+/* the dhcp timer of a VPC is due, wake up pth_bgjob */
+static void bgjob_wakeup(void *arg)
 {
-	while (1) {
-		time_tick = time(0);
-		usleep(1000);
-	}
-	return NULL;
+	pcs *pc = arg;
+	
+	pthread_mutex_lock(&bgjob_locker);
+	pc->bgjobdue = 1;
+	bgjob_pending = 1;
+	pthread_cond_signal(&bgjob_cond);
+	pthread_mutex_unlock(&bgjob_locker);
 }
 
 void *pth_bgjob(void *dummy)
@@ -587,9 +869,20 @@ void *pth_bgjob(void *dummy)
 	int i;
 	int t, s;
 
-	i = 0;
-	do {
-		if (vpc[i].ip4.dhcp.svr && vpc[i].ip4.dhcp.timetick) {
+	while (1) {
+		pthread_mutex_lock(&bgjob_locker);
+		while (!bgjob_pending)
+			pthread_cond_wait(&bgjob_cond, &bgjob_locker);
+		bgjob_pending = 0;
+		pthread_mutex_unlock(&bgjob_locker);
+		
+		for (i = 0; i < num_pths; i++) {
+			if (!vpc[i].bgjobdue)
+				continue;
+			vpc[i].bgjobdue = 0;
+			
+			if (!vpc[i].ip4.dhcp.svr || !vpc[i].ip4.dhcp.timetick)
+				continue;
 			t = time_tick - vpc[i].ip4.dhcp.timetick;
 			s = t - vpc[i].ip4.dhcp.renew;
 			if (t > vpc[i].ip4.dhcp.renew && s < 4) {
@@ -597,20 +890,18 @@ void *pth_bgjob(void *dummy)
 				if (dhcp_renew(&vpc[i]))
 					vpc[i].ip4.dhcp.timetick = time_tick;
 				vpc[i].bgjobflag = 0;
-				continue;
-			}
-			s = t - vpc[i].ip4.dhcp.rebind;
-			if (t > vpc[i].ip4.dhcp.rebind && s < 4) {
-			    	vpc[i].bgjobflag = 1;
-			    	if (dhcp_rebind(&vpc[i]))
-			    		vpc[i].ip4.dhcp.timetick = time_tick;
-			    	vpc[i].bgjobflag = 0;
-			    	continue;
+			} else {
+				s = t - vpc[i].ip4.dhcp.rebind;
+				if (t > vpc[i].ip4.dhcp.rebind && s < 4) {
+				    	vpc[i].bgjobflag = 1;
+				    	if (dhcp_rebind(&vpc[i]))
+				    		vpc[i].ip4.dhcp.timetick = time_tick;
+				    	vpc[i].bgjobflag = 0;
+				}
 			}
+			dhcp_schedule(&vpc[i]);
 		}
-		usleep(1000);
-		i = (i + 1) % num_pths;
-	} while (1);
+	}
 	
 	return NULL;
 }
@@ -716,19 +1007,28 @@ void usage()
 		"  {H-v}             print version information then exit\r\n"
 		"\r\n"
 		"  {H-R}             disable relay function\r\n"
-		"  {H-i} {Unum}         number of vpc instances to start (default is 9)\r\n"
+		"  {H-i} {Unum}         number of vpc instances to start (default is 9, up to 8192)\r\n"
 		"  {H-p} {Uport}        run as a daemon listening on the tcp {Uport}\r\n"
 		"  {H-m} {Unum}         start byte of ether address, default from 0\r\n"
 		"  [{H-r}] {UFILENAME}  load and execute script file {HFILENAME}\r\n"
 		"\r\n"
 		"  {H-e}             tap mode, using /dev/tapx by default (linux only)\r\n"
 		"  [{H-u}]           udp mode, default\r\n"
+		"  {H-l} {Uifname}      packet mode, attach to the interface {Uifname}, or to\r\n"
+		"                    {Uifname}0, {Uifname}1... if -i is more than 1 (linux only)\r\n"
+		"  {H-U}             udp and tap i/o by io_uring (linux 5.19 or later, not with -O)\r\n"
 		"\r\nudp mode options:\r\n"
 		"  {H-s} {Uport}        local udp base {Uport}, default from 20000\r\n"
 		"  {H-c} {Uport}        remote udp base {Uport} (dynamips udp port), default from 30000\r\n"
 		"  {H-t} {Uip}          remote host {UIP}, default 127.0.0.1\r\n"
+		"                 the frames from other than the remote host and\r\n"
+		"                 port are dropped\r\n"
 		"\r\ntap mode options:\r\n"
 		"  {H-d} {Udevice}      {Udevice} name, works only when -i is set to 1\r\n"
+		"  {H-O}             leave the tcp/udp checksums and the tcp segmentation\r\n"
+		"                    to the kernel (linux only)\r\n"
+		"  {H-q} {Unum}         {Unum} queues per device, each with its own threads\r\n"
+		"                    (linux only, default 1, up to 8)\r\n"
 		"\r\nhypervisor mode option:\r\n"
 		"  {H-H} {Uport}        run as the hypervisor listening on the tcp {Uport}\r\n"
 		"\r\n"
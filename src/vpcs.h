@@ -30,15 +30,41 @@
 #include "queue.h"
 #include "globle.h"
 #include "ip.h"
+#include "timer.h"
+#include "reass.h"
 
 #define MAX_LEN  (128)
 
 typedef struct {
 	u_char mac[6];
+	u_char state;		/* neighbor state */
+#define ARP_FREE	0
+#define ARP_INCOMPLETE	1	/* request sent, no answer yet */
+#define ARP_REACHABLE	2	/* confirmed within POOL_TIMEOUT */
+#define ARP_STALE	3	/* usable, refreshed on the next use */
+	u_char tries;		/* requests sent since the last answer */
 	u_int ip;
-	int timeout;
+	int timeout;		/* time_tick of the last confirmation */
+	int sent;		/* time_tick of the last request */
+	int next;		/* hash chain, index + 1 */
+	int npending;
+	struct packet *pending;	/* waiting for the address */
+	struct packet *ptail;
 } ipmac;
 
+#define ARP_CACHE_SIZE	128
+#define ARP_HASHSIZE	64	/* power of 2 */
+
+typedef struct {
+	ipmac ent[ARP_CACHE_SIZE];
+	int hash[ARP_HASHSIZE];	/* index + 1 */
+	int free;		/* idle entries, index + 1 */
+	int npending;		/* packets held by all entries */
+	pthread_mutex_t locker;
+	pthread_cond_t cond;	/* signaled when an entry is resolved */
+	struct vtimer timer;	/* retransmits the requests */
+} arpcache;
+
 typedef struct {
 	u_int svr;
 	u_char smac[6];
@@ -93,8 +119,42 @@ typedef struct {
 #define IPF_FRAG 0x1
 } hipv4;
 
+typedef struct {
+	int mode;		/* frame aggregation on the udp tunnel */
+#define AGG_MODE_OFF	0
+#define AGG_MODE_PROBE	1	/* enabled, waiting for the peer */
+#define AGG_MODE_ON	2	/* both ends agreed */
+	int delay;		/* flush deadline, usec */
+	struct packet *first;	/* the first frame of the pending bundle */
+	struct packet *bundle;	/* the pending bundle */
+	int count;		/* frames in the pending bundle */
+	struct timeval deadline;
+	u_int tx_bundles;
+	u_int rx_bundles;
+} aggctl;
+
+#define TAPQ_MAX	8	/* queues of a multi-queue tap */
+
+struct uring;				/* io_uring, uring.c */
+
+typedef struct {
+	int id;				/* pc id */
+	int q;				/* queue index */
+	int fd;
+	struct uring *uring;		/* io_uring of the queue */
+	pthread_t rpid;			/* reader pthread id */
+	pthread_t wpid;			/* writer pthread id */
+	struct pq oq;			/* frames steered to this queue */
+} tapq;
+
+struct ring;				/* AF_PACKET rings, ring.c */
+struct dmpfile;				/* pcap writer, dump.c */
+struct dmpfilter;			/* dump filter, filter.c */
+struct capring;				/* flight recorder, dump.c */
+
 #define MAX_NAMES_LEN	(12)
 #define MAX_SESSIONS	1000
+#define SESS_HASHSIZE	1024	/* power of 2 */
 #define POOL_SIZE	32
 #define POOL_TIMEOUT	120
 
@@ -105,8 +165,14 @@ typedef struct {
 	pthread_t rpid;			/* reader pthread id */
 	pthread_t wpid;			/* writer pthread id */	
 	int dmpflag;			/* dump flag */
-	FILE *dmpfile;			/* dump file pointer */
+	struct dmpfile *dmpfile;	/* dump file, dump.c */
+	struct dmpfilter *dmpfilter;	/* frames to dump, NULL all */
+	int dmpusers;			/* reader/writer in the dump */
+	struct capring *capring;	/* the last frames, dump.c */
+	int capoff;			/* flight recorder turned off */
 	int bgjobflag;			/* backgroun job flag */
+	int bgjobdue;			/* dhcp renew/rebind is due */
+	struct vtimer dhcptimer;	/* dhcp renew/rebind */
 	int fd;				/* device handle */
 	int rfd;			/* client handle if in the udp mode		 */	
 	int lport;			/* local udp port */
@@ -116,11 +182,16 @@ typedef struct {
 	struct pq bgoq;			/* background output queue */
 	struct pq iq;			/* queue */
 	struct pq oq;			/* queue */
-	pthread_mutex_t locker;		/* mutex */
+	pthread_mutex_t locker;		/* session table */
 	sesscb mscb;			/* opened by app */
-	sesscb sesscb[MAX_SESSIONS];	/* tcp session pool */
-	tcpcb6 tcpcb6[MAX_SESSIONS];	/* tcp6 session pool */
-	ipmac ipmac4[POOL_SIZE];	/* arp pool */
+	sesscb *sesscb;			/* tcp session pool, by the first SYN */
+	int *sesshash;			/* busy sessions by 4-tuple */
+	int sessfree;			/* idle sessions */
+	int sesstop;			/* sessions ever handed out */
+	struct vtimer sesstimer;	/* reclaims the idle sessions */
+	arpcache arp4;			/* arp cache */
+	struct reasstab reass;		/* ipv4/ipv6 reassembly */
+	pthread_mutex_t locker6;	/* RA autoconf, ipmac6 and ip6mtu */
 	ip6mac ipmac6[POOL_SIZE];	/* neighbor pool */
 	ip6mtu ip6mtu[POOL_SIZE];	/* mtu6 record */
 	hipv4 ip4;
@@ -128,6 +199,11 @@ typedef struct {
 	hipv6 ip6;
 	hipv6 link6;
 	int mtu;
+	aggctl agg;			/* udp tunnel frame aggregation */
+	int ntapq;			/* queues of the tap */
+	tapq *tapq;			/* queue 1.., queue 0 is fd/oq */
+	struct ring *ring;		/* rx/tx rings of the packet socket */
+	struct uring *uring;		/* io_uring of fd, queue 0 */
 } pcs;
 
 struct echoctl {
@@ -136,11 +212,14 @@ struct echoctl {
 	int bgcolor;
 };
 
-extern pcs vpc[MAX_NUM_PTHS];
+extern pcs *vpc;
+extern int num_pths;
 
 #define delay_ms(s) usleep(s * 1000)
 
 void parse_cmd(char *cmdstr);
+void dump_quiesce(pcs *pc);
+int str2vpcid(const char *s);
 
 #endif
 